@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <string>
 #include <zlib.h>
 #include <thread>
@@ -17,6 +18,31 @@
 #include <cstring>
 #include <regex>
 #include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <functional>
+#include <map>
+#include <set>
+#include <unistd.h>
+#include <charconv>
+#include <sys/resource.h>
+#include <fnmatch.h>
+#include <csignal>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 // MySQL C API headers
@@ -27,7 +53,9 @@ using namespace std;
 namespace fs = std::filesystem;
 
 const int BUFFER_SIZE = 1024 * 1024; // 1 MB buffer size
-const int MAX_THREADS = 4;             // Maximum number of threads
+const size_t MAPPED_CHUNK_BYTES = 16 * 1024 * 1024; // Part of a mapped dump handed to the parser at once
+const size_t RESTORE_QUEUE_BYTES = 64 * 1024 * 1024; // Statement bytes queued per restore connection
+const size_t LOAD_DATA_MAX_BYTES = 256 * 1024 * 1024; // Rows streamed through one LOAD DATA before it is committed
 
 // Data structure to store table creation statements
 struct TableDefinition {
@@ -35,8 +63,21 @@ struct TableDefinition {
     std::string createStatement;
 };
 
+// Site identity read from the global_property table of a dump
+struct SiteIdentity {
+    std::string siteName;
+    std::string siteId;
+
+    bool complete() const {
+        return !siteName.empty() && !siteId.empty();
+    }
+
+    // Name of the database the site is restored into
+    std::string database() const {
+        return "openmrs_" + siteId + "_" + siteName;
+    }
+};
 
-atomic<bool> searchComplete(false); // Atomic flag to indicate search completion
 
 // this replaces the site name spaces with underscores
 std::string replaceSpacesWithUnderscores(std::string& str) {
@@ -49,9 +90,6 @@ std::string replaceSpacesWithUnderscores(std::string& str) {
     }
 
     if (spaceCount > 0) {
-        size_t newLength = modifiedStr.length() + spaceCount;
-        modifiedStr.resize(newLength);
-
         for (size_t i = 0; i < modifiedStr.length(); ++i) {
             if (modifiedStr[i] == ' ') {
                 modifiedStr[i] = '_';
@@ -120,6 +158,52 @@ void loadEnvironmentFromFile(const std::string& filename) {
     }
 }
 
+// Returns the environment variable or the fallback when it is not set
+std::string getEnvOrDefault(const char* name, const std::string& fallback) {
+    const char* value = std::getenv(name);
+    if (value == nullptr || *value == '\0') {
+        return fallback;
+    }
+    return value;
+}
+
+const uint64_t FNV_OFFSET_BASIS = 1469598103934665603ULL;
+
+// 64-bit FNV-1a, stable across builds so manifests can be compared between runs.
+// Passing the hash of earlier data as seed continues it over data, as if both were one.
+uint64_t hashBytes(std::string_view data, uint64_t seed = FNV_OFFSET_BASIS) {
+    uint64_t hash = seed;
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Replaces path with content through <path>.tmp and a rename, so a reader finds either the old
+// file or all of the new one. durable syncs the data before the rename, for a file a crash must not lose.
+bool writeFileAtomically(const fs::path& path, const std::string& content, bool durable = false) {
+    fs::path temporary = path.string() + ".tmp";
+    std::FILE* out = std::fopen(temporary.c_str(), "wb");
+    bool written = out != nullptr && std::fwrite(content.data(), 1, content.size(), out) == content.size() && std::fflush(out) == 0 &&
+                   (!durable || fsync(fileno(out)) == 0);
+    std::string reason = written ? "" : std::strerror(errno);
+    if (out != nullptr && std::fclose(out) != 0 && written) {
+        written = false;
+        reason = std::strerror(errno);
+    }
+    std::error_code error;
+    if (written) {
+        fs::rename(temporary, path, error);
+        reason = error.message();
+    }
+    if (!written || error) {
+        std::cerr << "Error: Could not write " << path << ": " << reason << std::endl;
+        fs::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
 // Function to check if a table exists
 bool tableExists(MYSQL* conn, const std::string& tableName) {
     std::string query = "SHOW TABLES LIKE '" + tableName + "'";
@@ -264,9 +348,8 @@ bool closerToWord(const std::string& chaword, const std::string& reformat) {
 
 
 // Function to restore MySQL dump from a gzipped file
-bool restoreMySQLDumpC(const char* gzippedDumpFile, const char* mysqlHost, const char* mysqlUser, const char* mysqlPassword, const char* mysqlDatabase) {
+bool restoreMySQLDumpC(const char* gzippedDumpFile, const char* mysqlHost, const char* mysqlUser, const char* mysqlPassword, const char* mysqlDatabase, unsigned int port = 3900) {
     // Open MySQL connection
-    unsigned int port = 3900;
     MYSQL *mysql = mysql_init(NULL);
     if (mysql == NULL) {
         std::cerr << "Error: Unable to initialize MySQL connection." << std::endl;
@@ -375,9 +458,8 @@ bool restoreMySQLDumpC(const char* gzippedDumpFile, const char* mysqlHost, const
 
 
 
-bool restoreMySQLDump(const char* gzippedDumpFile, const char* mysqlHost, const char* mysqlUser, const char* mysqlPassword, const char* mysqlDatabase) {
+bool restoreMySQLDump(const char* gzippedDumpFile, const char* mysqlHost, const char* mysqlUser, const char* mysqlPassword, const char* mysqlDatabase, unsigned int port = 3900) {
     // Open MySQL connection
-    unsigned int port = 3900; // Default MySQL port
     MYSQL *mysql = mysql_init(NULL);
     if (mysql == NULL) {
         std::cerr << "Error: Unable to initialize MySQL connection." << std::endl;
@@ -501,18 +583,17 @@ bool restoreMySQLDump(const char* gzippedDumpFile, const char* mysqlHost, const
 }
 
 
-// Function to restore MySQL dump file
-void restoreMySQLDumpB(const std::string& filename, const std::string& db_host, const std::string& db_user, const std::string& db_password, const std::string& db_name) {
+// Function to restore MySQL dump file, returns false when a statement fails
+bool restoreMySQLDumpB(const std::string& filename, const std::string& db_host, const std::string& db_user, const std::string& db_password, const std::string& db_name,
+                       unsigned int port = 3900) {
     MYSQL *conn;
     conn = mysql_init(NULL);
 
     std::unordered_map<std::string, bool> createdTables;
 
-    std::string db_hostb = "0.0.0.0";
-    unsigned int port = 3900;
-    if (!mysql_real_connect(conn, db_hostb.c_str(), db_user.c_str(), db_password.c_str(), NULL, port, NULL, 0)) {
+    if (!mysql_real_connect(conn, db_host.c_str(), db_user.c_str(), db_password.c_str(), NULL, port, NULL, 0)) {
         std::cerr << "Failed to connect to MySQL server: " << mysql_error(conn) << std::endl;
-        return;
+        return false;
     }
 
     // Check if the database exists
@@ -521,7 +602,7 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
         if (mysql_query(conn, ("CREATE DATABASE " + db_name).c_str()) != 0) {
             std::cerr << "Failed to create database: " << mysql_error(conn) << std::endl;
             mysql_close(conn);
-            return;
+            return false;
         } else {
             std::cout << "Database created: " << db_name << std::endl;
         }
@@ -534,7 +615,7 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
     conn = mysql_init(NULL);
     if (!mysql_real_connect(conn, db_host.c_str(), db_user.c_str(), db_password.c_str(), db_name.c_str(), port, NULL, 0)) {
         std::cerr << "Failed to connect to MySQL server: " << mysql_error(conn) << std::endl;
-        return;
+        return false;
     }
 
     // Open the compressed SQL dump file
@@ -542,7 +623,7 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
     if (!file) {
         std::cerr << "Failed to open file: " << filename << std::endl;
         mysql_close(conn);
-        return;
+        return false;
     }
 
     std::string line;
@@ -700,7 +781,7 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
                             std::cerr << "Failed to execute asterik_query: " << mysql_error(conn) << std::endl;
                             mysql_close(conn);
                             gzclose(file);
-                            return;
+                            return false;
                         }
                         
                         //continue;
@@ -722,7 +803,7 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
                         std::cerr << "Failed to execute query: " << mysql_error(conn) << std::endl;
                         mysql_close(conn);
                         gzclose(file);
-                        return;
+                        return false;
                     }
                     query.clear();
                 }
@@ -734,7 +815,7 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
                         std::cerr << "Failed to execute insert_query: " << mysql_error(conn) << std::endl;
                         mysql_close(conn);
                         gzclose(file);
-                        return;
+                        return false;
                     }
                     insert_query.clear();
 
@@ -747,7 +828,7 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
                         std::cerr << "Failed to execute drop_query: " << mysql_error(conn) << std::endl;
                         mysql_close(conn);
                         gzclose(file);
-                        return;
+                        return false;
                     }
                     drop_query.clear();
                 }
@@ -759,7 +840,7 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
                         std::cerr << "Failed to execute set_query: " << mysql_error(conn) << std::endl;
                         mysql_close(conn);
                         gzclose(file);
-                        return;
+                        return false;
                     }
                     set_query.clear();
                 }
@@ -773,7 +854,7 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
                         std::cerr << "Failed to execute bare_query: " << mysql_error(conn) << std::endl;
                         mysql_close(conn);
                         gzclose(file);
-                        return;
+                        return false;
                     }
 
                 }
@@ -791,7 +872,7 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
                         if (std::strcmp(mysql_error(conn), "FUNCTION age already exists") != 0) {
                             mysql_close(conn);
                             gzclose(file);
-                            return;
+                            return false;
                         }
                         
                     }
@@ -842,210 +923,7406 @@ void restoreMySQLDumpB(const std::string& filename, const std::string& db_host,
     if (!semicolonFound && !query.empty()) {
         std::cerr << "Error: Incomplete query found in the SQL file." << std::endl;
         mysql_close(conn);
-        return;
+        return false;
     }
 
     // Close MySQL connection
     mysql_close(conn);
+    return true;
 }
 
 
 
-void searchInBuffer(const string &searchString1, const string &searchString2, const char *buffer, size_t bytesRead,const std::string &gzFileName)
-{
-    std::string removeText = "name\\n";
-    // Search for the search strings in the buffer
-    const char *pos = buffer;
-    bool found1 = false, found2 = false;
-    std::string new_sitename;
-    char startChar = ',';
-    char endChar = '\'';
-    char startCombinator = '\'';
-    char endCombinator = ',';
-    // Retrieve database connection parameters from environment variables
-    std::string db_host = std::getenv("DB_HOST");
-    std::string db_user = std::getenv("DB_USER");
-    std::string db_password = std::getenv("DB_PASSWORD");
-    std::string db_port = std::getenv("DB_PORT");
+// Kind of statement found in a mysqldump stream, decides which restore connection runs it
+enum class StatementKind {
+    Session,  // SET statements, replayed on every connection so each session matches the dump
+    Table,    // DROP/CREATE/ALTER/INSERT belonging to a single table
+    Lock,     // LOCK TABLES / UNLOCK TABLES, not needed once every table has its own connection
+    Barrier,  // routines, triggers and views, run after everything queued before them
+    Skip      // USE / CREATE DATABASE, the target database is chosen from the site identity
+};
 
-    while ((pos = strstr(pos, searchString1.c_str())) != NULL)
-    {
-        found1 = true;
-        std::string chaline = string(pos, min(static_cast<size_t>(60), bytesRead - (pos - buffer)));
-        char delimiter = ',';
-        std::vector<std::string> tokens = splitString(chaline, delimiter);
-        std::string word = "";
-        if (tokens.size() > 1) {
-            word = tokens[1];
-
-        }
-        //std::string word = extractWord(chaline, startChar, endChar, startCombinator, endCombinator);
-        removeSubstring(word, removeText);
-        // Convert each character in the string to lowercase
-        std::transform(word.begin(), word.end(), word.begin(),
-                       [](unsigned char c){ return std::tolower(c); });
-        new_sitename = replaceSpacesWithUnderscores(word);
-        //std::cout<<"sitename:"<<chaline<<std::endl;
-        //cout << "Found match for search string 1: " << string(pos, min(static_cast<size_t>(60), bytesRead - (pos - buffer))) << endl;
-        pos += searchString1.size();
-    }
-
-    pos = buffer;
-    while ((pos = strstr(pos, searchString2.c_str())) != NULL)
-    {
-        found2 = true;
-        std::string chalineb = string(pos, min(static_cast<size_t>(60), bytesRead - (pos - buffer)));
-        char delimiterb = ',';
-        std::vector<std::string> tokensb = splitString(chalineb, delimiterb);
-        std::string instance_id = "";
-        if (tokensb.size() > 1) {
-            instance_id = tokensb[1];
-        }
-
-        //std::cout<<"siteid:"<<chalineb<<std::endl;
-        //std::string instance_id = extractWord(chalineb, startChar, endChar, startCombinator, endCombinator);
-        if(new_sitename != "")
-        {
-            std::string db_name = "openmrs_"+instance_id+"_"+new_sitename;
-            std::cout << "instance_name:" << db_name << std::endl;
-            /*const char* gzippedDumpFile = gzFileName.c_str();
-            const char* mysqlHost = db_host.c_str();
-            const char* mysqlUser = db_user.c_str();
-            const char* mysqlPassword = db_password.c_str();
-            const char* mysqlDatabase = db_name.c_str();
-
-            if (restoreMySQLDump(gzippedDumpFile, mysqlHost, mysqlUser, mysqlPassword, mysqlDatabase)) {
-                std::cout << "MySQL dump restored successfully." << std::endl;
-            } else {
-                std::cerr << "Failed to restore MySQL dump." << std::endl;
-            }*/
+// A complete statement read from the dump
+struct DumpStatement {
+    StatementKind kind = StatementKind::Skip;
+    std::string table;
+    std::string sql;
+    uint64_t ordinal = 0;  // position of the statement in the dump, used by checkpoints
+};
 
-            //restoreMySQLDumpB(gzFileName, db_host, db_user, db_password, db_name);
+// Recycles the strings statements are assembled in. Once the restore has warmed up, every
+// statement is copied into a buffer a finished statement gave back, so parsing a dump does
+// not go to the heap for each line. The counters show how often it still had to, together
+// with what the table names and the LOAD DATA conversion allocate and copy on the side.
+class StatementBufferPool {
+public:
+    // At most retainBytes of idle buffers are kept, the rest are freed when given back
+    explicit StatementBufferPool(size_t retainBytes) : retainBytes(retainBytes) {}
+
+    // Copies sql into out, reusing a returned buffer big enough for it when there is one
+    void assign(std::string& out, std::string_view sql) {
+        if (out.capacity() < sql.size()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            // The smallest that fits, so short statements leave the big buffers to the INSERTs
+            size_t best = idle.size();
+            for (size_t i = 0; i < idle.size(); ++i) {
+                if (idle[i].capacity() >= sql.size() && (best == idle.size() || idle[i].capacity() < idle[best].capacity())) {
+                    best = i;
+                }
+            }
+            if (best < idle.size()) {
+                idleBytes -= idle[best].capacity();
+                out.swap(idle[best]);
+                idle[best].swap(idle.back());
+                idle.pop_back();
+            }
+        }
+        if (out.capacity() < sql.size()) {
+            // Some room to spare, the INSERTs of a dump are all about the same size but not exactly
+            out.reserve(sql.size() + sql.size() / 8);
+            allocationCount++;
+        }
+        out.assign(sql.data(), sql.size());
+        copiedBytes += sql.size();
+        statementCount++;
+    }
 
-            // Construct the command to restore the database from the SQL dump
-            std::string db_hostb = "0.0.0.0";
-            MYSQL *conn;
-            conn = mysql_init(NULL);
+    // Takes back the buffer of a statement that is done with
+    void release(std::string& buffer) {
+        size_t capacity = buffer.capacity();
+        // Short strings live inside the std::string itself, there is nothing to keep
+        if (capacity < 64) {
+            return;
+        }
+        buffer.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idleBytes + capacity <= retainBytes) {
+            idleBytes += capacity;
+            idle.push_back(std::move(buffer));
+        }
+        buffer = std::string();
+    }
 
-            if (!mysql_real_connect(conn, db_hostb.c_str(), db_user.c_str(), db_password.c_str(), NULL, std::stoi(db_port), NULL, 0)) {
+    // Notes heap allocations and copies made for statements outside the pool
+    void counted(size_t allocations, size_t bytes) {
+        allocationCount += allocations;
+        copiedBytes += bytes;
+    }
 
-                std::cerr << "Failed to connect to MySQL server: " << mysql_error(conn) << std::endl;
-                return;
-            }
+    size_t allocations() const {
+        return allocationCount;
+    }
 
-            // Check if the database exists
-            if (mysql_select_db(conn, db_name.c_str()) != 0) {
-                // Database does not exist, create it
-                if (mysql_query(conn, ("CREATE DATABASE " + db_name).c_str()) != 0) {
-                    std::cerr << "Failed to create database: " << mysql_error(conn) << std::endl;
-                    mysql_close(conn);
-                    return;
-                } else {
-                    std::cout << "Database created: " << db_name << std::endl;
-                }
-            }
+    size_t bytesCopied() const {
+        return copiedBytes;
+    }
 
-            // Close the connection
-            mysql_close(conn);
+    size_t statements() const {
+        return statementCount;
+    }
 
+private:
+    size_t retainBytes;
+    std::mutex mutex;
+    std::vector<std::string> idle;
+    size_t idleBytes = 0;
+    std::atomic<size_t> allocationCount{0};
+    std::atomic<size_t> copiedBytes{0};
+    std::atomic<size_t> statementCount{0};
+};
 
-            std::cout << "start loading data......... " << std::endl;
+bool startsWithWord(const std::string& text, size_t pos, const char* word) {
+    size_t length = std::strlen(word);
+    return text.compare(pos, length, word) == 0;
+}
 
-            // Reconnect to the MySQL server and connect to the database
-            //conn = mysql_init(NULL);
+// Returns the first backtick quoted name found at or after pos
+std::string extractQuotedName(const std::string& text, size_t pos) {
+    size_t startPos = text.find('`', pos);
+    if (startPos == std::string::npos) {
+        return "";
+    }
+    size_t endPos = text.find('`', startPos + 1);
+    if (endPos == std::string::npos) {
+        return "";
+    }
+    return text.substr(startPos + 1, endPos - startPos - 1);
+}
 
-            std::string restoreCommand = "gunzip < " + gzFileName + " | mysql -u " + db_user +" -h "+db_hostb+ " -p" + db_password  + " -P" + db_port + " " + db_name;
+// Works out where a statement has to run, following the keywords restoreMySQLDumpB looks for.
+// With a pool the text is copied into a recycled buffer instead of a new one.
+DumpStatement classifyStatement(std::string_view sql, bool insideDelimiter, StatementBufferPool* pool = nullptr) {
+    DumpStatement statement;
+    if (pool) {
+        pool->assign(statement.sql, sql);
+    } else {
+        statement.sql.assign(sql.data(), sql.size());
+    }
+    const std::string& text = statement.sql;
 
-            // Execute the command
-            int returnValue = system(restoreCommand.c_str());
+    size_t pos = text.find_first_not_of(" \t\r\n");
+    if (pos == std::string::npos) {
+        return statement;
+    }
+    if (insideDelimiter) {
+        statement.kind = StatementKind::Barrier;
+        return statement;
+    }
 
-            // Check if the command executed successfully
-            if (returnValue == 0) {
-                std::cout << "Database restore from " << gzFileName << " successful." << std::endl;
-            } else {
-                std::cerr << "Error: Database restore from " << gzFileName << " failed." << std::endl;
-            }
+    // Versioned comments such as /*!40101 SET ... */ or /*!40000 ALTER TABLE `x` DISABLE KEYS */
+    bool versioned = startsWithWord(text, pos, "/*!");
+    if (versioned) {
+        pos += 3;
+        while (pos < text.size() && std::isdigit(static_cast<unsigned char>(text[pos]))) {
+            pos++;
         }
-        //cout << "Found match for search string 2: " << string(pos, min(static_cast<size_t>(60), bytesRead - (pos - buffer))) << endl;
-        pos += searchString2.size();
-        chalineb = "";
+        pos = text.find_first_not_of(" \t\r\n", pos);
+        if (pos == std::string::npos) {
+            return statement;
+        }
+    }
+
+    if (startsWithWord(text, pos, "SET ")) {
+        statement.kind = StatementKind::Session;
+    }
+    else if (startsWithWord(text, pos, "LOCK TABLES") || startsWithWord(text, pos, "UNLOCK TABLES")) {
+        statement.kind = StatementKind::Lock;
+    }
+    else if (startsWithWord(text, pos, "USE ") || startsWithWord(text, pos, "CREATE DATABASE")) {
+        statement.kind = StatementKind::Skip;
+    }
+    else if (!versioned && (startsWithWord(text, pos, "DROP TABLE") || startsWithWord(text, pos, "CREATE TABLE"))) {
+        statement.kind = StatementKind::Table;
+        statement.table = extractQuotedName(text, pos);
+    }
+    else if (startsWithWord(text, pos, "ALTER TABLE")) {
+        statement.kind = StatementKind::Table;
+        statement.table = extractQuotedName(text, pos);
+    }
+    else if (startsWithWord(text, pos, "INSERT") || startsWithWord(text, pos, "REPLACE")) {
+        statement.kind = StatementKind::Table;
+        size_t intoPos = text.find("INTO", pos);
+        statement.table = intoPos == std::string::npos ? "" : extractQuotedName(text, intoPos);
+    }
+    else {
+        statement.kind = StatementKind::Barrier;
     }
 
-    // Set search complete flag to true if both match is found
-    if (found1 && found2)
-        searchComplete = true;
+    // Without a table name we cannot keep it ordered with its table, so run it on its own
+    if (statement.kind == StatementKind::Table && statement.table.empty()) {
+        statement.kind = StatementKind::Barrier;
+    }
+    // Names too long for the string's own storage take an allocation of their own
+    if (pool && !statement.table.empty()) {
+        pool->counted(statement.table.capacity() > std::string().capacity() ? 1 : 0, statement.table.size());
+    }
+    return statement;
 }
 
-void searchInGzipFile(const string &gzFileName, const string &searchString1, const string &searchString2)
-{
-    gzFile file = gzopen(gzFileName.c_str(), "rb");
-    if (!file)
-    {
-        cerr << "Error: Could not open file " << gzFileName << endl;
-        return;
+// DROP, CREATE and ALTER TABLE end the open transaction on the server even with autocommit off,
+// and end a batch here so a failure is reported against the statement that failed
+bool commitsImplicitly(const DumpStatement& statement) {
+    if (statement.kind != StatementKind::Table) {
+        return false;
     }
+    const std::string& text = statement.sql;
+    size_t pos = text.find_first_not_of(" \t\r\n");
+    if (pos != std::string::npos && startsWithWord(text, pos, "/*!")) {
+        pos = text.find_first_not_of("0123456789", pos + 3);
+        pos = pos == std::string::npos ? pos : text.find_first_not_of(" \t\r\n", pos);
+    }
+    return pos != std::string::npos && !startsWithWord(text, pos, "INSERT") && !startsWithWord(text, pos, "REPLACE") &&
+           !startsWithWord(text, pos, "DELETE") && !startsWithWord(text, pos, "UPDATE");
+}
 
-    vector<thread> threads;
+// Parts of an extended INSERT written by mysqldump
+struct InsertStatementParts {
+    std::string_view table;
+    std::string_view columns;  // "(`a`,`b`)" when the dump was made with --complete-insert
+    std::string_view values;   // "(...),(...)"
+};
 
-    char buffer[BUFFER_SIZE];
-    while (!searchComplete)
-    {
-        int bytesRead = gzread(file, buffer, BUFFER_SIZE - 1);
-        if (bytesRead <= 0)
-        {
-            break; // End of file or error
+// Splits INSERT INTO `t` [(`a`,...)] VALUES (...),(...) into its parts
+bool splitInsertStatement(std::string_view sql, InsertStatementParts& parts) {
+    size_t pos = sql.find_first_not_of(" \t\r\n");
+    if (pos == std::string_view::npos || sql.compare(pos, 11, "INSERT INTO") != 0) {
+        return false;
+    }
+    size_t tableStart = sql.find('`', pos + 11);
+    size_t tableEnd = tableStart == std::string_view::npos ? tableStart : sql.find('`', tableStart + 1);
+    if (tableEnd == std::string_view::npos) {
+        return false;
+    }
+    parts.table = sql.substr(tableStart + 1, tableEnd - tableStart - 1);
+
+    pos = sql.find_first_not_of(" \t\r\n", tableEnd + 1);
+    parts.columns = std::string_view();
+    if (pos != std::string_view::npos && sql[pos] == '(') {
+        size_t close = sql.find(')', pos);
+        if (close == std::string_view::npos) {
+            return false;
         }
+        parts.columns = sql.substr(pos, close - pos + 1);
+        pos = sql.find_first_not_of(" \t\r\n", close + 1);
+    }
+    if (pos == std::string_view::npos || sql.compare(pos, 6, "VALUES") != 0) {
+        return false;
+    }
+    pos = sql.find('(', pos + 6);
+    if (pos == std::string_view::npos) {
+        return false;
+    }
+    parts.values = sql.substr(pos);
+    return true;
+}
 
-        // Launch a thread to search in the current buffer
-        threads.emplace_back(searchInBuffer, ref(searchString1), ref(searchString2), buffer, static_cast<size_t>(bytesRead),gzFileName);
+// Which tables of a dump get their rows restored. TABLE_INCLUDE and TABLE_EXCLUDE are comma
+// separated table names or shell patterns such as hl7_in_* ; an empty include list takes every
+// table and exclude wins over include. Decisions are cached, the same few names come back for
+// every INSERT of a table.
+class TableFilter {
+public:
+    TableFilter(const std::string& include, const std::string& exclude)
+        : include(patterns(include)), exclude(patterns(exclude)) {}
+
+    bool active() const {
+        return !include.empty() || !exclude.empty();
+    }
 
-        // Ensure we don't have too many threads active
-        if (threads.size() >= MAX_THREADS)
-        {
-            for (auto &t : threads)
-            {
-                t.join();
+    bool excluded(const std::string& table) {
+        auto it = decisions.find(table);
+        if (it == decisions.end()) {
+            bool out = matchesAny(exclude, table) || (!include.empty() && !matchesAny(include, table));
+            it = decisions.emplace(table, out).first;
+        }
+        return it->second;
+    }
+
+private:
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+    std::unordered_map<std::string, bool> decisions;
+
+    static std::vector<std::string> patterns(const std::string& list) {
+        std::vector<std::string> out;
+        for (std::string pattern : splitString(list, ',')) {
+            size_t first = pattern.find_first_not_of(" \t");
+            size_t last = pattern.find_last_not_of(" \t");
+            if (first != std::string::npos) {
+                out.push_back(pattern.substr(first, last - first + 1));
             }
-            threads.clear();
         }
+        return out;
     }
 
-    // Join remaining threads
-    for (auto &t : threads)
-    {
-        t.join();
+    static bool matchesAny(const std::vector<std::string>& list, const std::string& table) {
+        for (const auto& pattern : list) {
+            if (fnmatch(pattern.c_str(), table.c_str(), 0) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+int hexDigitValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Appends one raw byte in LOAD DATA's default escaping (FIELDS ESCAPED BY '\\')
+inline void appendTsvByte(std::string& out, char c) {
+    switch (c) {
+        case '\\': out += "\\\\"; break;
+        case '\t': out += "\\t"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\0': out += "\\0"; break;
+        default: out += c;
     }
+}
 
-    gzclose(file);
+// What a value of an INSERT tuple was written as
+enum class InsertValueKind { Null, Number, String, Hex, Bits, Other };
+
+// The tokenizer of INSERT values, shared by everything that reads rows out of a dump. Calls
+// onValue(field, kind, value, literal) for every value of the tuples of an extended INSERT and
+// onRow(fields, row) after each tuple, row being its "(...)" text and literal the value as
+// written. With Decode, value holds strings unescaped with mysqldump's escapes, 0x / X'' literals
+// as bytes and b'' as a decimal number; without it value is the literal and nothing is copied.
+// Returns false when the values do not parse or a callback returns false. The views are only
+// valid during the call.
+template <bool Decode = true, typename OnValue, typename OnRow>
+bool forEachInsertValue(std::string_view values, OnValue onValue, OnRow onRow) {
+    std::string value;
+    size_t pos = 0;
+    const size_t length = values.size();
+    while (true) {
+        while (pos < length && (values[pos] == ' ' || values[pos] == '\n' || values[pos] == '\r' || values[pos] == '\t' || values[pos] == ',')) {
+            pos++;
+        }
+        if (pos == length) {
+            return true;
+        }
+        if (values[pos] != '(') {
+            return false;
+        }
+        size_t rowStart = pos++;
+
+        size_t field = 0;
+        while (true) {
+            size_t literalStart = pos;
+            if (values.compare(pos, 8, "_binary ") == 0) {
+                pos += 8;
+            }
+            if (pos >= length) {
+                return false;
+            }
+            char c = values[pos];
+            InsertValueKind kind;
+            value.clear();
+            if (c == '\'' || c == '"') {
+                // Quoted string, mysqldump escapes \0 \b \n \r \t \Z \\ \' \"
+                kind = InsertValueKind::String;
+                char quote = c;
+                pos++;
+                while (true) {
+                    size_t runStart = pos;
+                    while (pos < length && values[pos] != quote && values[pos] != '\\') {
+                        pos++;
+                    }
+                    if (Decode) {
+                        value.append(values.data() + runStart, pos - runStart);
+                    }
+                    if (pos + 1 >= length) {
+                        return false;
+                    }
+                    if (values[pos] == quote) {
+                        if (values[pos + 1] == quote) {
+                            if (Decode) {
+                                value += quote;  // doubled quote
+                            }
+                            pos += 2;
+                            continue;
+                        }
+                        pos++;
+                        break;
+                    }
+                    char e = values[pos + 1];
+                    pos += 2;
+                    if (Decode) {
+                        switch (e) {
+                            case '0': value += '\0'; break;
+                            case 'b': value += '\b'; break;
+                            case 'n': value += '\n'; break;
+                            case 'r': value += '\r'; break;
+                            case 't': value += '\t'; break;
+                            case 'Z': value += '\x1a'; break;
+                            // \% and \_ keep their backslash outside LIKE patterns
+                            case '%': case '_': value += '\\'; value += e; break;
+                            default: value += e;
+                        }
+                    }
+                }
+            }
+            else if ((c == '0' && pos + 1 < length && values[pos + 1] == 'x') ||
+                     ((c == 'X' || c == 'x') && pos + 1 < length && values[pos + 1] == '\'')) {
+                // Hex literal as written by --hex-blob
+                kind = InsertValueKind::Hex;
+                bool quoted = c != '0';
+                pos += 2;
+                while (pos + 1 < length && hexDigitValue(values[pos]) >= 0 && hexDigitValue(values[pos + 1]) >= 0) {
+                    if (Decode) {
+                        value += static_cast<char>(hexDigitValue(values[pos]) * 16 + hexDigitValue(values[pos + 1]));
+                    }
+                    pos += 2;
+                }
+                if (quoted) {
+                    if (pos >= length || values[pos] != '\'') {
+                        return false;
+                    }
+                    pos++;
+                }
+            }
+            else if (c == 'b' && pos + 1 < length && values[pos + 1] == '\'') {
+                // BIT columns, b'101'
+                kind = InsertValueKind::Bits;
+                uint64_t bits = 0;
+                for (pos += 2; pos < length && (values[pos] == '0' || values[pos] == '1'); pos++) {
+                    bits = bits * 2 + (values[pos] - '0');
+                }
+                if (pos >= length || values[pos] != '\'') {
+                    return false;
+                }
+                pos++;
+                if (Decode) {
+                    value = std::to_string(bits);
+                }
+            }
+            else if (values.compare(pos, 4, "NULL") == 0) {
+                kind = InsertValueKind::Null;
+                pos += 4;
+            }
+            else {
+                kind = (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ? InsertValueKind::Number : InsertValueKind::Other;
+                size_t runStart = pos;
+                while (pos < length && values[pos] != ',' && values[pos] != ')') {
+                    pos++;
+                }
+                if (Decode) {
+                    value.assign(values.data() + runStart, pos - runStart);
+                }
+            }
+
+            if (pos >= length) {
+                return false;
+            }
+            std::string_view literal = values.substr(literalStart, pos - literalStart);
+            if (!onValue(field++, kind, Decode ? std::string_view(value) : literal, literal)) {
+                return false;
+            }
+            if (values[pos] == ',') {
+                pos++;
+                continue;
+            }
+            if (values[pos] == ')') {
+                pos++;
+                break;
+            }
+            return false;
+        }
+        if (!onRow(field, values.substr(rowStart, pos - rowStart))) {
+            return false;
+        }
+    }
+}
+
+// Re-encodes the value tuples of an extended INSERT as tab separated rows for LOAD DATA.
+// Handles NULL, numbers, quoted strings and 0x / X'' hex literals. Returns false on anything
+// else so the caller can run the statement as a plain INSERT.
+bool appendInsertValuesAsTsv(std::string_view values, std::string& out, size_t& rows) {
+    size_t startSize = out.size();
+    size_t startRows = rows;
+    bool ok = forEachInsertValue(values,
+        [&](size_t field, InsertValueKind kind, std::string_view value, std::string_view) {
+            if (field > 0) {
+                out += '\t';
+            }
+            switch (kind) {
+                case InsertValueKind::Null:
+                    out += "\\N";
+                    return true;
+                case InsertValueKind::Number:
+                    out.append(value.data(), value.size());
+                    return true;
+                case InsertValueKind::String:
+                case InsertValueKind::Hex:
+                    for (size_t pos = 0; pos < value.size();) {
+                        size_t runStart = pos;
+                        while (pos < value.size() && value[pos] != '\\' && value[pos] != '\t' && value[pos] != '\n' &&
+                               value[pos] != '\r' && value[pos] != '\0') {
+                            pos++;
+                        }
+                        out.append(value.data() + runStart, pos - runStart);
+                        if (pos < value.size()) {
+                            appendTsvByte(out, value[pos++]);
+                        }
+                    }
+                    return true;
+                default:
+                    return false;
+            }
+        },
+        [&](size_t, std::string_view) {
+            out += '\n';
+            rows++;
+            return true;
+        });
+    if (!ok || rows == startRows) {
+        out.resize(startSize);
+        rows = startRows;
+        return false;
+    }
+    return true;
+}
+
+// Secondary keys and foreign keys taken out of a CREATE TABLE, added back once its rows are loaded
+struct DeferredTableIndexes {
+    std::string table;
+    std::vector<std::string> keys;              // KEY / UNIQUE KEY definitions, added together in one ALTER
+    std::vector<std::string> separateKeys;      // FULLTEXT and SPATIAL keys, InnoDB adds these one per ALTER
+    std::vector<std::string> foreignKeys;       // CONSTRAINT ... FOREIGN KEY definitions
+    std::vector<std::string> referencedTables;  // tables named in REFERENCES, excluding this one
+    size_t dataBytes = 0;                       // INSERT bytes seen for the table, larger tables are indexed first
+};
+
+// Splits the body of CREATE TABLE `t` (...) into its column and key definitions.
+// Returns false for statements it does not understand (CREATE TABLE ... LIKE, unbalanced quotes).
+bool splitCreateDefinitions(const std::string& sql, size_t& bodyStart, size_t& bodyEnd, std::vector<std::string>& items) {
+    size_t nameStart = sql.find('`');
+    size_t nameEnd = nameStart == std::string::npos ? nameStart : sql.find('`', nameStart + 1);
+    if (nameEnd == std::string::npos) {
+        return false;
+    }
+    bodyStart = sql.find_first_not_of(" \t\r\n", nameEnd + 1);
+    if (bodyStart == std::string::npos || sql[bodyStart] != '(') {
+        return false;
+    }
+
+    int depth = 0;
+    char quote = 0;
+    size_t itemStart = bodyStart + 1;
+    for (size_t i = bodyStart; i < sql.size(); ++i) {
+        char c = sql[i];
+        if (quote) {
+            if (c == '\\' && quote != '`') {
+                i++;
+            } else if (c == quote) {
+                quote = 0;
+            }
+            continue;
+        }
+        if (c == '\'' || c == '"' || c == '`') {
+            quote = c;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            if (--depth == 0) {
+                items.push_back(sql.substr(itemStart, i - itemStart));
+                bodyEnd = i;
+                return true;
+            }
+        } else if (c == ',' && depth == 1) {
+            items.push_back(sql.substr(itemStart, i - itemStart));
+            itemStart = i + 1;
+        }
+    }
+    return false;
 }
 
+// Collects the secondary keys and foreign keys of every table while the dump is restored
+class DeferredIndexPlan {
+public:
+    std::vector<DeferredTableIndexes> tables;
+
+    // Rewrites CREATE TABLE statements to keep only the primary key and counts the INSERT bytes of each table
+    void take(DumpStatement& statement) {
+        if (statement.kind != StatementKind::Table) {
+            return;
+        }
+        size_t pos = statement.sql.find_first_not_of(" \t\r\n");
+        if (startsWithWord(statement.sql, pos, "INSERT")) {
+            auto it = byName.find(statement.table);
+            if (it != byName.end()) {
+                tables[it->second].dataBytes += statement.sql.size();
+            }
+        } else if (startsWithWord(statement.sql, pos, "CREATE TABLE")) {
+            rewriteCreateTable(statement);
+        }
+    }
+
+private:
+    std::unordered_map<std::string, size_t> byName;
+
+    void rewriteCreateTable(DumpStatement& statement) {
+        size_t bodyStart = 0;
+        size_t bodyEnd = 0;
+        std::vector<std::string> items;
+        if (!splitCreateDefinitions(statement.sql, bodyStart, bodyEnd, items)) {
+            return;
+        }
 
+        DeferredTableIndexes indexes;
+        indexes.table = statement.table;
+        std::vector<std::string> kept;
+        bool hasPrimaryKey = false;
+        // An AUTO_INCREMENT column has to lead some key, without one the CREATE fails
+        std::string autoIncrement;
+        bool autoIncrementKeyed = false;
+        for (const auto& item : items) {
+            size_t pos = item.find_first_not_of(" \t\r\n");
+            if (pos == std::string::npos) {
+                continue;
+            }
+            if (item.compare(pos, 11, "PRIMARY KEY") == 0) {
+                hasPrimaryKey = true;
+                autoIncrementKeyed = autoIncrementKeyed || (!autoIncrement.empty() && extractQuotedName(item, item.find('(', pos)) == autoIncrement);
+            } else if (item[pos] == '`' && item.find(" AUTO_INCREMENT") != std::string::npos) {
+                autoIncrement = extractQuotedName(item, pos);
+            }
+        }
+        for (auto& item : items) {
+            size_t pos = item.find_first_not_of(" \t\r\n");
+            std::string definition = pos == std::string::npos ? "" : item.substr(pos);
+            bool keyOrUnique = startsWithWord(definition, 0, "KEY ") || startsWithWord(definition, 0, "INDEX ") ||
+                               startsWithWord(definition, 0, "UNIQUE ");
+            if (keyOrUnique && !autoIncrement.empty() && !autoIncrementKeyed &&
+                extractQuotedName(definition, definition.find('(')) == autoIncrement) {
+                autoIncrementKeyed = true;
+                kept.push_back(item);
+            }
+            else if (startsWithWord(definition, 0, "KEY ") || startsWithWord(definition, 0, "INDEX ")) {
+                indexes.keys.push_back(definition);
+            }
+            else if (startsWithWord(definition, 0, "UNIQUE ")) {
+                // Without a primary key InnoDB clusters on the first unique key, so that one stays
+                if (!hasPrimaryKey) {
+                    hasPrimaryKey = true;
+                    kept.push_back(item);
+                } else {
+                    indexes.keys.push_back(definition);
+                }
+            }
+            else if (startsWithWord(definition, 0, "FULLTEXT ") || startsWithWord(definition, 0, "SPATIAL ")) {
+                indexes.separateKeys.push_back(definition);
+            }
+            else if ((startsWithWord(definition, 0, "CONSTRAINT ") || startsWithWord(definition, 0, "FOREIGN KEY")) &&
+                     definition.find(" FOREIGN KEY ") != std::string::npos) {
+                std::string referenced = extractQuotedName(definition, definition.find(" REFERENCES "));
+                if (!referenced.empty() && referenced != indexes.table &&
+                    std::find(indexes.referencedTables.begin(), indexes.referencedTables.end(), referenced) == indexes.referencedTables.end()) {
+                    indexes.referencedTables.push_back(referenced);
+                }
+                indexes.foreignKeys.push_back(definition);
+            }
+            else {
+                kept.push_back(item);
+            }
+        }
+        if (indexes.keys.empty() && indexes.separateKeys.empty() && indexes.foreignKeys.empty()) {
+            return;
+        }
 
+        std::string rewritten = statement.sql.substr(0, bodyStart + 1);
+        for (size_t i = 0; i < kept.size(); ++i) {
+            rewritten += (i > 0 ? "," : "") + kept[i];
+        }
+        if (rewritten.back() != '\n') {
+            rewritten += "\n";
+        }
+        rewritten += statement.sql.substr(bodyEnd);
+        statement.sql = std::move(rewritten);
 
+        add(std::move(indexes));
+    }
 
+public:
+    // For a table that was created and dropped again
+    void forget(const std::string& table) {
+        auto it = byName.find(table);
+        if (it == byName.end()) {
+            return;
+        }
+        tables.erase(tables.begin() + it->second);
+        byName.clear();
+        for (size_t i = 0; i < tables.size(); ++i) {
+            byName[tables[i].table] = i;
+        }
+    }
 
-void searchInFolder(const string &folderPath, const string &searchString1, const string &searchString2)
-{
-    for (const auto &entry : fs::directory_iterator(folderPath))
-    {
-        if (fs::is_regular_file(entry.path()) && entry.path().extension() == ".gz")
-        {
-            cout << "Searching in file: " << entry.path() << endl;
-            searchComplete = false;
-            searchInGzipFile(entry.path(), searchString1, searchString2);
+    // A table created twice in one dump keeps the definition that was loaded last
+    void add(DeferredTableIndexes indexes) {
+        auto it = byName.find(indexes.table);
+        if (it != byName.end()) {
+            tables[it->second] = std::move(indexes);
+        } else {
+            byName[indexes.table] = tables.size();
+            tables.push_back(std::move(indexes));
         }
     }
+};
+
+// Vector instructions the statement splitter may use
+enum class ScanKernel { Scalar, Sse2 };
+
+// Widest scan kernel this build runs. SCAN_KERNEL=scalar asks for the plain loop, which is how
+// the benchmark compares them.
+ScanKernel scanKernel() {
+#if defined(__SSE2__)
+    const ScanKernel widest = ScanKernel::Sse2;
+#else
+    const ScanKernel widest = ScanKernel::Scalar;
+#endif
+    const char* requested = std::getenv("SCAN_KERNEL");
+    return requested != nullptr && std::strcmp(requested, "scalar") == 0 ? ScanKernel::Scalar : widest;
+}
+
+const char* scanKernelName(ScanKernel kernel) {
+    return kernel == ScanKernel::Sse2 ? "sse2" : "scalar";
+}
+
+// Splits a mysqldump stream into statements in a single pass over the decompressed data.
+// Quotes, backslash escapes, /* */ and /*! */ comments, -- and # comments and DELIMITER
+// directives are tracked as state, so a statement cut by the end of a buffer continues
+// correctly in the next one. Statements that end inside the buffer are handed out as views
+// into it; only a statement running past the end of a buffer is copied into carry.
+class SqlStatementSplitter {
+public:
+    SqlStatementSplitter() {
+        setDelimiter(";");
+    }
+
+    // Calls onStatement(std::string_view sql, bool insideDelimiter) for every complete statement.
+    // The view is only valid during the call.
+    template <typename Callback>
+    bool feed(const char* data, size_t size, Callback&& onStatement) {
+        const char* p = data;
+        const char* end = data + size;
+        const char* statementStart = inStatement ? data : nullptr;
+        bufferStart = data;
+
+        while (p < end) {
+            switch (state) {
+                case State::Between: {
+                    char c = *p;
+                    if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                        ++p;
+                    } else if (c == '#') {
+                        commentInStatement = false;
+                        state = State::LineComment;
+                        ++p;
+                    } else if (c == '-') {
+                        commentInStatement = false;
+                        state = State::BetweenDash;
+                        ++p;
+                    } else {
+                        inStatement = true;
+                        statementStart = p;
+                        directiveMatched = 0;
+                        state = (c == 'D' || c == 'd') ? State::DirectiveCheck : State::Statement;
+                    }
+                    break;
+                }
+                case State::BetweenDash:
+                    // "--" between statements is always a comment in a dump
+                    if (*p == '-') {
+                        ++p;
+                        state = State::LineComment;
+                        break;
+                    }
+                    // A single '-' starts the statement. It may have been the last byte of the previous buffer.
+                    inStatement = true;
+                    if (p > data) {
+                        statementStart = p - 1;
+                    } else {
+                        carry = "-";
+                        statementStart = p;
+                    }
+                    state = State::Statement;
+                    break;
+                case State::DirectiveCheck: {
+                    static const char keyword[] = "DELIMITER ";
+                    if (std::toupper(static_cast<unsigned char>(*p)) == keyword[directiveMatched] ||
+                        (keyword[directiveMatched] == ' ' && *p == '\t')) {
+                        ++p;
+                        if (++directiveMatched == sizeof(keyword) - 1) {
+                            // A client directive, not a statement: drop what we collected
+                            inStatement = false;
+                            statementStart = nullptr;
+                            carry.clear();
+                            directive.clear();
+                            state = State::Directive;
+                        }
+                    } else {
+                        state = State::Statement;
+                    }
+                    break;
+                }
+                case State::Directive: {
+                    const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+                    const char* stop = newline ? newline : end;
+                    directive.append(p, stop - p);
+                    p = stop;
+                    if (newline) {
+                        ++p;
+                        size_t first = directive.find_first_not_of(" \t\r");
+                        size_t last = directive.find_last_not_of(" \t\r");
+                        if (first != std::string::npos) {
+                            setDelimiter(directive.substr(first, last - first + 1));
+                        }
+                        state = State::Between;
+                    }
+                    break;
+                }
+                case State::Statement: {
+                    char c = 0;
+                    while (true) {
+                        p = scanUntil(p, end, statementStops);
+                        if (p == end) {
+                            break;
+                        }
+                        c = *p++;
+                        if (c != '\'') {
+                            break;
+                        }
+                        c = 0;
+                        if (!skipSingleQuoted(p, end)) {
+                            break;
+                        }
+                        // The string closed inside this buffer, carry on with the statement
+                    }
+                    if (c == 0) {
+                        break;
+                    }
+                    if (c == delimiter[0]) {
+                        delimiterMatched = 1;
+                        if (delimiterMatched == delimiter.size()) {
+                            if (!emit(statementStart, p, onStatement)) {
+                                return false;
+                            }
+                            statementStart = nullptr;
+                        } else {
+                            state = State::DelimiterMatch;
+                        }
+                    } else if (c == '"') {
+                        state = State::DoubleQuote;
+                    } else if (c == '`') {
+                        state = State::Backtick;
+                    } else if (c == '/') {
+                        state = State::StatementSlash;
+                    } else if (c == '-') {
+                        state = State::StatementDash;
+                    } else if (c == '#') {
+                        commentInStatement = true;
+                        state = State::LineComment;
+                    }
+                    break;
+                }
+                case State::DelimiterMatch:
+                    if (*p == delimiter[delimiterMatched]) {
+                        ++p;
+                        if (++delimiterMatched == delimiter.size()) {
+                            if (!emit(statementStart, p, onStatement)) {
+                                return false;
+                            }
+                            statementStart = nullptr;
+                        }
+                    } else if (delimiterMatched == 1 && delimiter[0] == '/') {
+                        // A delimiter such as // shares its first character with a /* comment
+                        state = State::StatementSlash;
+                    } else if (delimiterMatched == 1 && delimiter[0] == '-') {
+                        state = State::StatementDash;
+                    } else {
+                        // Not the delimiter after all, look at this character again as statement text
+                        state = State::Statement;
+                    }
+                    break;
+                case State::SingleQuote:
+                case State::DoubleQuote:
+                case State::Backtick: {
+                    const StopSet& stops = state == State::SingleQuote ? singleQuoteStops
+                                         : state == State::DoubleQuote ? doubleQuoteStops : backtickStops;
+                    p = scanUntil(p, end, stops);
+                    if (p == end) {
+                        break;
+                    }
+                    if (*p++ == '\\') {
+                        escapedFrom = state;
+                        state = State::Escape;
+                    } else {
+                        state = State::Statement;
+                    }
+                    break;
+                }
+                case State::Escape:
+                    // The escaped character never ends the string, whichever buffer it is in
+                    ++p;
+                    state = escapedFrom;
+                    break;
+                case State::StatementSlash:
+                    if (*p == '*') {
+                        ++p;
+                        state = State::BlockComment;
+                    } else {
+                        state = State::Statement;
+                    }
+                    break;
+                case State::StatementDash:
+                    if (*p == '-') {
+                        ++p;
+                        state = State::StatementDashDash;
+                    } else {
+                        state = State::Statement;
+                    }
+                    break;
+                case State::StatementDashDash:
+                    // Inside a statement "--" only starts a comment when followed by whitespace
+                    if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+                        commentInStatement = true;
+                        state = State::LineComment;
+                    } else {
+                        state = State::Statement;
+                    }
+                    break;
+                case State::BlockComment: {
+                    const char* star = static_cast<const char*>(std::memchr(p, '*', end - p));
+                    if (star == nullptr) {
+                        p = end;
+                        break;
+                    }
+                    p = star + 1;
+                    state = State::BlockCommentStar;
+                    break;
+                }
+                case State::BlockCommentStar:
+                    if (*p == '/') {
+                        state = State::Statement;
+                    } else if (*p != '*') {
+                        state = State::BlockComment;
+                    }
+                    ++p;
+                    break;
+                case State::LineComment: {
+                    const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+                    if (newline == nullptr) {
+                        p = end;
+                        break;
+                    }
+                    p = newline + 1;
+                    state = commentInStatement ? State::Statement : State::Between;
+                    break;
+                }
+            }
+        }
+
+        if (inStatement && statementStart != nullptr) {
+            carry.append(statementStart, end - statementStart);
+        }
+        bufferOffset += size;
+        return true;
+    }
+
+    // Offset in the dump just past the delimiter of the statement being handed out
+    uint64_t statementEnd() const {
+        return lastStatementEnd;
+    }
+
+    const std::string& currentDelimiter() const {
+        return delimiter;
+    }
+
+    // Prepares to be fed the dump from offset, a place where an earlier run's statement ended
+    void resumeAt(uint64_t offset, const std::string& activeDelimiter) {
+        bufferOffset = offset;
+        setDelimiter(activeDelimiter);
+    }
+
+    // Reports a statement left without its delimiter at the end of the dump
+    bool finish() const {
+        if (inStatement && carry.find_first_not_of(" \t\r\n") != std::string::npos) {
+            std::cerr << "Error: Incomplete query found at the end of the dump." << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    enum class State : uint8_t {
+        Between, BetweenDash, DirectiveCheck, Directive,
+        Statement, DelimiterMatch, SingleQuote, DoubleQuote, Backtick, Escape,
+        StatementSlash, StatementDash, StatementDashDash,
+        BlockComment, BlockCommentStar, LineComment
+    };
+
+    // Characters that end a run of plain text in one of the states
+    struct StopSet {
+        bool table[256] = {};
+        size_t count = 0;
+        ScanKernel kernel = ScanKernel::Scalar;
+#if defined(__SSE2__)
+        __m128i needles[8];
+#endif
+
+        void assign(std::initializer_list<char> stops) {
+            std::fill(std::begin(table), std::end(table), false);
+            count = 0;
+            kernel = scanKernel();
+            for (char c : stops) {
+                table[static_cast<unsigned char>(c)] = true;
+#if defined(__SSE2__)
+                needles[count] = _mm_set1_epi8(c);
+#endif
+                count++;
+            }
+        }
+    };
+
+    State state = State::Between;
+    State escapedFrom = State::SingleQuote;
+    bool inStatement = false;
+    bool commentInStatement = false;
+    size_t delimiterMatched = 0;
+    size_t directiveMatched = 0;
+    std::string delimiter;
+    std::string directive;
+    std::string carry;
+    const char* bufferStart = nullptr;
+    uint64_t bufferOffset = 0;       // dump offset of bufferStart
+    uint64_t lastStatementEnd = 0;
+    StopSet statementStops;
+    StopSet singleQuoteStops;
+    StopSet doubleQuoteStops;
+    StopSet backtickStops;
+
+    void setDelimiter(const std::string& value) {
+        delimiter = value;
+        statementStops.assign({'\'', '"', '`', '/', '-', '#', delimiter[0]});
+        singleQuoteStops.assign({'\'', '\\'});
+        doubleQuoteStops.assign({'"', '\\'});
+        backtickStops.assign({'`'});
+    }
+
+    // Returns the first stop character in [p, end), or end.
+    // Most of a dump is plain values, so 16 bytes are compared per step where SSE2 is available.
+    // AVX2 measured slower here: most quoted values end within the first 16 bytes.
+    static const char* scanUntil(const char* p, const char* end, const StopSet& stops) {
+#if defined(__SSE2__)
+        while (stops.kernel != ScanKernel::Scalar && end - p >= 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i hits = _mm_cmpeq_epi8(block, stops.needles[0]);
+            for (size_t i = 1; i < stops.count; ++i) {
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, stops.needles[i]));
+            }
+            int mask = _mm_movemask_epi8(hits);
+            if (mask != 0) {
+                return p + __builtin_ctz(mask);
+            }
+            p += 16;
+        }
+#endif
+        while (p < end && !stops.table[static_cast<unsigned char>(*p)]) {
+            ++p;
+        }
+        return p;
+    }
+
+    // Fast path for the single quoted values that make up most of an INSERT.
+    // Returns false with the state set when the string runs past the end of the buffer.
+    bool skipSingleQuoted(const char*& p, const char* end) {
+        while (true) {
+            p = scanUntil(p, end, singleQuoteStops);
+            if (p == end) {
+                state = State::SingleQuote;
+                return false;
+            }
+            if (*p == '\'') {
+                ++p;
+                return true;
+            }
+            if (p + 1 == end) {
+                ++p;
+                escapedFrom = State::SingleQuote;
+                state = State::Escape;
+                return false;
+            }
+            p += 2;
+        }
+    }
+
+    // Hands out the statement ending just before the delimiter at statementEnd
+    template <typename Callback>
+    bool emit(const char* statementStart, const char* statementEnd, Callback&& onStatement) {
+        bool insideDelimiter = delimiter != ";";
+        lastStatementEnd = bufferOffset + (statementEnd - bufferStart);
+        bool ok;
+        if (carry.empty()) {
+            ok = onStatement(std::string_view(statementStart, statementEnd - statementStart - delimiter.size()), insideDelimiter);
+        } else {
+            carry.append(statementStart, statementEnd - statementStart);
+            ok = onStatement(std::string_view(carry.data(), carry.size() - delimiter.size()), insideDelimiter);
+            carry.clear();
+        }
+        inStatement = false;
+        state = State::Between;
+        return ok;
+    }
+};
+
+// What a restore spent on one table
+struct TableMetrics {
+    size_t statements = 0;
+    size_t rows = 0;            // rows the sink wrote, as reported by the server for a restore
+    size_t bytes = 0;           // SQL text of its statements
+    size_t skippedBytes = 0;    // INSERTs dropped by TABLE_INCLUDE / TABLE_EXCLUDE
+    double parseSeconds = 0;    // splitting and classifying its statements on the client
+    double serverSeconds = 0;   // connections waiting for the server to run them
+};
+
+// Collects per table and per dump counters while a restore runs and writes them out as a JSON
+// summary and as a Prometheus text file, which node_exporter's textfile collector picks up.
+// Connections report from their own threads, so everything is kept under one mutex.
+class RestoreMetrics {
+public:
+    RestoreMetrics(const std::string& site, const std::string& dump) : site(site), dump(dump) {}
+
+    ~RestoreMetrics() {
+        stopWriter();
+    }
+
+    // Rewrites the files in folder every seconds from a thread of its own, so they stay current
+    // while the parser is blocked on full connection queues or the restore waits on the server
+    void start(const fs::path& folder, double seconds) {
+        writerFolder = folder;
+        if (seconds > 0) {
+            writer = std::thread([this, seconds] {
+                std::unique_lock<std::mutex> lock(writerMutex);
+                while (!writerStopping) {
+                    if (!writerWake.wait_for(lock, std::chrono::duration<double>(seconds), [&] { return writerStopping; })) {
+                        write(writerFolder, false);
+                    }
+                }
+            });
+        }
+    }
+
+    // Stops the writer thread and writes the final files
+    void finish(bool finished) {
+        stopWriter();
+        write(writerFolder, finished);
+    }
+
+    // Statement of table split off the dump and classified in seconds
+    void parsed(const std::string& table, size_t bytes, double seconds) {
+        if (table.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        current = table;
+        TableMetrics& metrics = tables[table];
+        metrics.statements++;
+        metrics.bytes += bytes;
+        metrics.parseSeconds += seconds;
+    }
+
+    // INSERT of an excluded table dropped before it was parsed any further
+    void skipped(const std::string& table, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tables[table].skippedBytes += bytes;
+    }
+
+    // Rows of table written by the sink, seconds spent waiting on the server for them.
+    // Work that belongs to no table, such as a COMMIT, is passed with an empty name.
+    void loaded(const std::string& table, size_t rows, double seconds) {
+        std::lock_guard<std::mutex> lock(mutex);
+        serverSeconds += seconds;
+        if (!table.empty()) {
+            TableMetrics& metrics = tables[table];
+            metrics.rows += rows;
+            metrics.serverSeconds += seconds;
+        }
+    }
+
+    // Bytes of SQL the dump reader handed over, seconds the parser waited for them, and the
+    // reader's own count of the seconds spent decompressing so far
+    void decompressed(size_t bytes, double seconds, double inflateTotal) {
+        std::lock_guard<std::mutex> lock(mutex);
+        readBytes += bytes;
+        readSeconds += seconds;
+        inflateSeconds = inflateTotal;
+    }
+
+    // Writes <site>.json and <site>.prom to folder. Each file is written next to its final name
+    // and renamed over it, so a collector never reads half a file.
+    bool write(const fs::path& folder, bool finished) {
+        std::lock_guard<std::mutex> lock(mutex);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        double megabytesPerSecond = inflateSeconds > 0 ? readBytes / (1024.0 * 1024.0) / inflateSeconds : 0;
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        size_t peakRss = static_cast<size_t>(usage.ru_maxrss) * 1024;  // kilobytes on Linux
+
+        std::ostringstream json;
+        json << std::setprecision(12) << "{\"site\": " << quoted(site) << ", \"dump\": " << quoted(dump) << ", \"finished\": " << (finished ? "true" : "false")
+             << ", \"elapsed_seconds\": " << elapsed << ", \"decompressed_bytes\": " << readBytes
+             << ", \"decompress_mb_per_second\": " << megabytesPerSecond << ", \"decompress_seconds\": " << inflateSeconds
+             << ", \"reader_wait_seconds\": " << readSeconds << ", \"server_seconds\": " << serverSeconds
+             << ", \"process_peak_rss_bytes\": " << peakRss << ", \"current_table\": " << quoted(current) << ", \"tables\": {";
+        bool first = true;
+        for (const auto& entry : tables) {
+            const TableMetrics& table = entry.second;
+            json << (first ? "" : ",") << "\n  " << quoted(entry.first) << ": {\"statements\": " << table.statements
+                 << ", \"rows\": " << table.rows << ", \"bytes\": " << table.bytes << ", \"skipped_bytes\": " << table.skippedBytes << ", \"parse_seconds\": " << table.parseSeconds
+                 << ", \"server_seconds\": " << table.serverSeconds << "}";
+            first = false;
+        }
+        json << "\n}}\n";
+
+        std::ostringstream prom;
+        prom << std::setprecision(12);
+        std::string labels = "site=\"" + labelValue(site) + "\"";
+        auto family = [&](const char* name, const char* type, const char* help) {
+            prom << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+        };
+        family("openmrs_restore_finished", "gauge", "1 once the restore of the site dump has finished");
+        prom << "openmrs_restore_finished{" << labels << "} " << (finished ? 1 : 0) << "\n";
+        family("openmrs_restore_elapsed_seconds", "gauge", "Time since the restore started");
+        prom << "openmrs_restore_elapsed_seconds{" << labels << "} " << elapsed << "\n";
+        family("openmrs_restore_decompressed_bytes_total", "counter", "Bytes of SQL read from the dump");
+        prom << "openmrs_restore_decompressed_bytes_total{" << labels << "} " << readBytes << "\n";
+        family("openmrs_restore_decompress_megabytes_per_second", "gauge", "SQL bytes decompressed per second spent decompressing, summed over decompressor threads");
+        prom << "openmrs_restore_decompress_megabytes_per_second{" << labels << "} " << megabytesPerSecond << "\n";
+        family("openmrs_restore_decompress_seconds_total", "counter", "Time spent decompressing the dump, summed over decompressor threads");
+        prom << "openmrs_restore_decompress_seconds_total{" << labels << "} " << inflateSeconds << "\n";
+        family("openmrs_restore_reader_wait_seconds_total", "counter", "Time the parser waited on the dump reader");
+        prom << "openmrs_restore_reader_wait_seconds_total{" << labels << "} " << readSeconds << "\n";
+        family("openmrs_restore_server_seconds_total", "counter", "Time connections waited on the server, commits included");
+        prom << "openmrs_restore_server_seconds_total{" << labels << "} " << serverSeconds << "\n";
+        family("openmrs_restore_process_peak_rss_bytes", "gauge", "Peak resident memory of the whole restore process, shared by every dump it restores");
+        prom << "openmrs_restore_process_peak_rss_bytes{" << labels << "} " << peakRss << "\n";
+        if (!current.empty()) {
+            family("openmrs_restore_parsing_table", "gauge", "Table of the last statement read from the dump");
+            prom << "openmrs_restore_parsing_table{" << labels << ",table=\"" << labelValue(current) << "\"} 1\n";
+        }
+        struct Column {
+            const char* name;
+            const char* help;
+            std::function<double(const TableMetrics&)> value;
+        };
+        const Column columns[] = {
+            {"openmrs_restore_table_statements_total", "Statements of the table read from the dump", [](const TableMetrics& t) { return static_cast<double>(t.statements); }},
+            {"openmrs_restore_table_rows_total", "Rows of the table written", [](const TableMetrics& t) { return static_cast<double>(t.rows); }},
+            {"openmrs_restore_table_bytes_total", "Bytes of SQL of the table read from the dump", [](const TableMetrics& t) { return static_cast<double>(t.bytes); }},
+            {"openmrs_restore_table_skipped_bytes_total", "Bytes of INSERTs of the table dropped by the table filters", [](const TableMetrics& t) { return static_cast<double>(t.skippedBytes); }},
+            {"openmrs_restore_table_parse_seconds_total", "Client time spent splitting and classifying the table's statements", [](const TableMetrics& t) { return t.parseSeconds; }},
+            {"openmrs_restore_table_server_seconds_total", "Time connections waited on the server for the table", [](const TableMetrics& t) { return t.serverSeconds; }},
+        };
+        for (const Column& column : columns) {
+            family(column.name, "counter", column.help);
+            for (const auto& entry : tables) {
+                prom << column.name << "{" << labels << ",table=\"" << labelValue(entry.first) << "\"} " << column.value(entry.second) << "\n";
+            }
+        }
+
+        std::error_code error;
+        fs::create_directories(folder, error);
+        std::string fileName = site;
+        std::replace(fileName.begin(), fileName.end(), '/', '_');
+        return writeFileAtomically(folder / (fileName + ".json"), json.str()) && writeFileAtomically(folder / (fileName + ".prom"), prom.str());
+    }
+
+    // JSON string literal of text
+    static std::string quoted(const std::string& text) {
+        std::string out = "\"";
+        for (char c : text) {
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        char escaped[7];
+                        std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                        out += escaped;
+                    } else {
+                        out += c;
+                    }
+            }
+        }
+        return out + "\"";
+    }
+
+private:
+    std::string site;
+    std::string dump;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    std::mutex mutex;
+    std::map<std::string, TableMetrics> tables;
+    std::string current;
+    size_t readBytes = 0;
+    double readSeconds = 0;
+    double inflateSeconds = 0;
+    double serverSeconds = 0;
+    fs::path writerFolder;
+    std::thread writer;
+    std::mutex writerMutex;
+    std::condition_variable writerWake;
+    bool writerStopping = false;
+
+    void stopWriter() {
+        {
+            std::lock_guard<std::mutex> lock(writerMutex);
+            writerStopping = true;
+        }
+        writerWake.notify_all();
+        if (writer.joinable()) {
+            writer.join();
+        }
+    }
+
+    static std::string labelValue(const std::string& text) {
+        std::string out;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (c == '\n') {
+                out += "\\n";
+            } else {
+                out += c;
+            }
+        }
+        return out;
+    }
+};
+
+// Where the statements parsed from a dump go. The parser only sees this interface, so the same
+// statement stream can load a server, be split into files, or be thrown away to time parsing alone.
+class StatementSink {
+public:
+    virtual ~StatementSink() = default;
+
+    // Takes the next statement of the dump, returns false once the sink has failed
+    virtual bool submit(DumpStatement statement) = 0;
+
+    // Called after the last statement, returns whether everything was written
+    virtual bool finish() = 0;
+
+    // Short description for the restore summary
+    virtual std::string describe() const = 0;
+
+    // Statements finished by the sink give their buffers back to pool
+    void recycleInto(StatementBufferPool* pool) {
+        buffers = pool;
+    }
+
+    // Rows written and time spent on the server are reported to metrics
+    void reportInto(RestoreMetrics* restoreMetrics) {
+        metrics = restoreMetrics;
+    }
+
+protected:
+    StatementBufferPool* buffers = nullptr;
+    RestoreMetrics* metrics = nullptr;
+
+    void recycle(std::string& sql) {
+        if (buffers) {
+            buffers->release(sql);
+        }
+    }
+};
+
+// Whether the RESTORE_SINK of that name sends the statements to the MySQL server
+bool sinkLoadsServer(const std::string& sinkName) {
+    return sinkName != "null" && sinkName != "split" && sinkName != "columnar";
+}
+
+// Session variables of the bulk load profile, all set to 0 while restoring
+const char* const BULK_SESSION_VARIABLES[] = {"unique_checks", "foreign_key_checks", "sql_log_bin", "autocommit"};
+
+// How restore connections commit. The dump profile runs each statement the way the dump wrote it,
+// the bulk profile turns off the variables above and commits every rows / bytes.
+struct CommitPolicy {
+    bool bulkSession = false;
+    size_t rows = 50000;                 // rows per commit to start with, adjusted from commit latency
+    size_t bytes = 64 * 1024 * 1024;     // statement bytes per commit, never exceeded
+};
+
+// How statements travel to the server. With batchBytes set, consecutive INSERTs queued on a connection
+// go out as one multi-statement query, so a round trip carries many small statements instead of one.
+// queueBytes is how much the parser may get ahead of each connection before it waits.
+struct PipelinePolicy {
+    size_t batchBytes = 0;
+    size_t queueBytes = RESTORE_QUEUE_BYTES;
+};
+
+// One MySQL connection of the restore pool together with the statements queued for it
+struct RestoreWorker {
+    MYSQL* conn = nullptr;
+    std::string characterSet = "utf8mb4";  // last SET NAMES seen on this connection, used for LOAD DATA
+    std::thread thread;
+    std::deque<DumpStatement> queue;
+    size_t queuedBytes = 0;
+    bool running = false;
+    bool dirty = false;                    // rows written since the last COMMIT in the bulk profile
+    uint64_t runningOrdinal = 0;           // first statement of the work in progress
+    uint64_t firstUncommitted = UINT64_MAX;                        // bulk profile: oldest statement waiting for COMMIT
+    std::unordered_map<std::string, uint64_t> uncommittedTables;  // bulk profile: last statement per table waiting for COMMIT
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    // Bulk profile state, only touched by the worker's own thread
+    std::vector<std::string> savedSession;  // values of BULK_SESSION_VARIABLES before the restore
+    size_t commitRows = 0;
+    size_t pendingRows = 0;
+    size_t pendingBytes = 0;
+    std::chrono::steady_clock::time_point batchStart;
+    size_t commits = 0;
+    double commitSeconds = 0;
+
+    // Multi-statement batches, reused from one batch to the next
+    std::vector<DumpStatement> batch;
+    std::string batchSql;
+    std::vector<my_ulonglong> batchRows;
+    // Pipeline statistics, written by the worker's thread and read once it has stopped
+    size_t roundTrips = 0;
+    size_t statementsRun = 0;
+    double idleSeconds = 0;                 // waiting for the parser to queue statements
+    double busySeconds = 0;                 // sending statements and waiting for the server
+};
+
+// Runs the statements of a dump over a pool of connections.
+// Statements of one table always go to the same connection so they run in dump order,
+// while different tables load at the same time on different connections.
+class ParallelRestoreEngine : public StatementSink {
+public:
+    // With useInfile, extended INSERTs are converted to tab separated rows and streamed with LOAD DATA LOCAL INFILE
+    explicit ParallelRestoreEngine(size_t connections, bool useInfile = false, CommitPolicy policy = CommitPolicy(),
+                                   PipelinePolicy pipeline = PipelinePolicy())
+        : workers(std::max<size_t>(connections, 1)), useInfile(useInfile), policy(policy), pipeline(pipeline) {
+        for (auto& worker : workers) {
+            worker = std::make_unique<RestoreWorker>();
+        }
+    }
+
+    ~ParallelRestoreEngine() {
+        stopWorkers();
+    }
+
+    bool open(const std::string& host, const std::string& user, const std::string& password, const std::string& database, unsigned int port) {
+        for (auto& worker : workers) {
+            worker->conn = mysql_init(NULL);
+            if (worker->conn == NULL) {
+                std::cerr << "Error: Unable to initialize MySQL connection." << std::endl;
+                return false;
+            }
+            if (useInfile) {
+                unsigned int enable = 1;
+                mysql_options(worker->conn, MYSQL_OPT_LOCAL_INFILE, &enable);
+            }
+            // Also asked for with LOAD DATA, which falls back to INSERTs when the server refuses it
+            unsigned long flags = pipeline.batchBytes > 0 ? CLIENT_MULTI_STATEMENTS : 0;
+            if (!mysql_real_connect(worker->conn, host.c_str(), user.c_str(), password.c_str(), database.c_str(), port, NULL, flags)) {
+                std::cerr << "Failed to connect to MySQL server: " << mysql_error(worker->conn) << std::endl;
+                return false;
+            }
+            if (policy.bulkSession && !applyBulkSession(*worker)) {
+                return false;
+            }
+        }
+        for (auto& worker : workers) {
+            worker->thread = std::thread(&ParallelRestoreEngine::run, this, std::ref(*worker));
+        }
+        return true;
+    }
+
+    bool submit(DumpStatement statement) override {
+        switch (statement.kind) {
+            case StatementKind::Skip:
+            case StatementKind::Lock:
+                recycle(statement.sql);
+                return !failed;
+            case StatementKind::Session:
+                for (auto& worker : workers) {
+                    if (!enqueue(*worker, statement)) {
+                        return false;
+                    }
+                }
+                recycle(statement.sql);
+                return true;
+            case StatementKind::Barrier:
+                // Run on the first connection once all earlier statements have finished
+                return drain() && enqueue(*workers[0], std::move(statement)) && drain();
+            case StatementKind::Table:
+                break;
+        }
+        size_t index = workerForTable(statement.table);
+        return enqueue(*workers[index], std::move(statement));
+    }
+
+    // Waits for every queued statement and closes the connections
+    bool finish() override {
+        bool ok = drain();
+        stopWorkers();
+        return ok && !failed;
+    }
+
+    std::string describe() const override {
+        return std::to_string(workers.size()) + " connections, " + (useInfile ? "LOAD DATA" : "INSERT");
+    }
+
+    // Runs check(conn) on the first connection once every queued statement has finished, for
+    // queries whose result the caller needs, without opening a connection beyond the pool. Only
+    // the thread submitting statements may call it, so nothing is queued meanwhile.
+    bool withConnection(const std::function<bool(MYSQL*)>& check) {
+        if (!drain()) {
+            return false;
+        }
+        bool ok = check(workers[0]->conn);
+        // With autocommit off the queries opened a transaction, it must not hold a stale snapshot
+        return mysql_query(workers[0]->conn, "COMMIT") == 0 && ok;
+    }
+
+    // Returns the lowest statement ordinal that may not be committed yet, and fills tables with
+    // the last committed ordinal of every table. Statements of a table run in order on one
+    // connection, so everything of that table up to its ordinal is in the database.
+    uint64_t committedBefore(uint64_t nextOrdinal, std::unordered_map<std::string, uint64_t>& tables) {
+        uint64_t frontier = nextOrdinal;
+        for (auto& worker : workers) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            if (!worker->queue.empty()) {
+                frontier = std::min(frontier, worker->queue.front().ordinal);
+            }
+            if (worker->running) {
+                frontier = std::min(frontier, worker->runningOrdinal);
+            }
+            frontier = std::min(frontier, worker->firstUncommitted);
+        }
+        // Read after the workers: a statement they no longer hold is already in here
+        std::lock_guard<std::mutex> lock(progressMutex);
+        tables = committedTables;
+        return frontier;
+    }
+
+    // Commit statistics of the bulk profile, summed over all connections
+    void commitStats(size_t& commits, double& seconds, size_t& rowsPerCommit) const {
+        commits = 0;
+        seconds = 0;
+        rowsPerCommit = 0;
+        for (const auto& worker : workers) {
+            commits += worker->commits;
+            seconds += worker->commitSeconds;
+            rowsPerCommit = std::max(rowsPerCommit, worker->commitRows);
+        }
+    }
+
+    // Where the pipeline waited, once the restore is finished: the parser for queue space,
+    // the connections (summed) for statements to send, against the time they spent on the server
+    void pipelineStats(double& parserWait, double& connectionIdle, double& connectionBusy, size_t& statements, size_t& roundTrips) const {
+        parserWait = parserWaitSeconds;
+        connectionIdle = 0;
+        connectionBusy = 0;
+        statements = 0;
+        roundTrips = 0;
+        for (const auto& worker : workers) {
+            connectionIdle += worker->idleSeconds;
+            connectionBusy += worker->busySeconds;
+            statements += worker->statementsRun;
+            roundTrips += worker->roundTrips;
+        }
+    }
+
+private:
+    // One LOAD DATA LOCAL INFILE in progress, fed from the INSERTs queued on its worker
+    struct InfileFeed {
+        ParallelRestoreEngine* engine = nullptr;
+        RestoreWorker* worker = nullptr;
+        std::string table;
+        std::string columns;
+        std::string tsv;
+        size_t offset = 0;
+        size_t rows = 0;
+        size_t statements = 0;
+        size_t bytesSent = 0;
+        size_t converted = 0;    // TSV bytes written
+        size_t allocations = 0;  // times tsv had to grow
+        uint64_t lastOrdinal = 0;
+    };
+
+    std::vector<std::unique_ptr<RestoreWorker>> workers;
+    std::unordered_map<std::string, size_t> tableWorkers;
+    std::atomic<bool> useInfile;
+    CommitPolicy policy;
+    PipelinePolicy pipeline;
+    double parserWaitSeconds = 0;  // only the thread submitting statements touches it
+    std::atomic<bool> failed{false};
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> flushing{false};
+    std::mutex progressMutex;
+    std::unordered_map<std::string, uint64_t> committedTables;
+
+    // Tables stick to the connection that was least busy when they first appeared in the dump
+    size_t workerForTable(const std::string& table) {
+        auto it = tableWorkers.find(table);
+        if (it != tableWorkers.end()) {
+            return it->second;
+        }
+        size_t best = 0;
+        size_t bestBytes = SIZE_MAX;
+        for (size_t i = 0; i < workers.size(); ++i) {
+            std::lock_guard<std::mutex> lock(workers[i]->mutex);
+            size_t pending = workers[i]->queuedBytes + (workers[i]->running ? 1 : 0);
+            if (pending < bestBytes) {
+                best = i;
+                bestBytes = pending;
+            }
+        }
+        tableWorkers[table] = best;
+        return best;
+    }
+
+    bool enqueue(RestoreWorker& worker, DumpStatement statement) {
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        // Back-pressure: wait while this connection already has enough work queued
+        auto room = [&] {
+            return failed || worker.queue.empty() || worker.queuedBytes + statement.sql.size() <= pipeline.queueBytes;
+        };
+        if (!room()) {
+            auto waitStart = std::chrono::steady_clock::now();
+            worker.changed.wait(lock, room);
+            parserWaitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+        }
+        if (failed) {
+            return false;
+        }
+        worker.queuedBytes += statement.sql.size();
+        worker.queue.push_back(std::move(statement));
+        worker.changed.notify_all();
+        return true;
+    }
+
+    bool drain() {
+        // Tell workers streaming a LOAD DATA not to wait for more rows
+        flushing = true;
+        for (auto& worker : workers) {
+            std::unique_lock<std::mutex> lock(worker->mutex);
+            worker->changed.notify_all();
+            worker->changed.wait(lock, [&] {
+                return failed || (worker->queue.empty() && !worker->running && !worker->dirty);
+            });
+        }
+        flushing = false;
+        return !failed;
+    }
+
+    void run(RestoreWorker& worker) {
+        mysql_thread_init();
+        while (true) {
+            DumpStatement statement;
+            bool commitOnly = false;
+            {
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                // Open transactions are committed before a barrier so DDL never waits on their locks
+                auto waitStart = std::chrono::steady_clock::now();
+                worker.changed.wait(lock, [&] {
+                    return stopping || failed || !worker.queue.empty() || (flushing && worker.dirty);
+                });
+                if (!worker.queue.empty()) {
+                    worker.idleSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+                }
+                if (failed) {
+                    break;
+                }
+                if (worker.queue.empty()) {
+                    if (!worker.dirty) {
+                        break;
+                    }
+                    commitOnly = true;
+                    worker.runningOrdinal = worker.firstUncommitted;
+                } else {
+                    statement = std::move(worker.queue.front());
+                    worker.queue.pop_front();
+                    worker.queuedBytes -= statement.sql.size();
+                    worker.runningOrdinal = statement.ordinal;
+                    takeBatch(worker, statement);
+                }
+                worker.running = true;
+                worker.changed.notify_all();
+            }
+
+            InsertStatementParts parts;
+            bool ok;
+            uint64_t lastOrdinal = statement.ordinal;
+            auto serverStart = std::chrono::steady_clock::now();
+            if (!worker.batch.empty()) {
+                ok = executeBatch(worker);
+                worker.busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - serverStart).count();
+                if (!ok) {
+                    fail();
+                    break;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(worker.mutex);
+                    worker.running = false;
+                    worker.dirty = worker.pendingRows > 0 || worker.pendingBytes > 0;
+                }
+                worker.changed.notify_all();
+                continue;
+            }
+            // DDL commits whatever the connection has open, so that is committed first and recorded as such
+            bool implicitCommit = !commitOnly && policy.bulkSession && commitsImplicitly(statement);
+            if (implicitCommit && (worker.pendingRows > 0 || worker.pendingBytes > 0 || worker.firstUncommitted != UINT64_MAX)) {
+                ok = commit(worker);
+                if (!ok) {
+                    fail();
+                    break;
+                }
+            }
+            if (commitOnly) {
+                ok = commit(worker);
+            } else if (useInfile && statement.kind == StatementKind::Table && splitInsertStatement(statement.sql, parts)) {
+                ok = loadWithInfile(worker, statement, parts, lastOrdinal);
+            } else {
+                ok = execute(worker.conn, statement);
+                if (ok && statement.kind == StatementKind::Session) {
+                    rememberCharacterSet(worker, statement.sql);
+                }
+            }
+            // A LOAD DATA reports every row it streamed, including those of the INSERTs merged into it
+            my_ulonglong rows = ok && !commitOnly ? mysql_affected_rows(worker.conn) : 0;
+            if (ok && !commitOnly && statement.kind == StatementKind::Table) {
+                recordProgress(worker, statement, lastOrdinal);
+            }
+            // Anything but SET may have written rows, and with autocommit off they must reach a COMMIT
+            if (ok && !commitOnly && !implicitCommit && policy.bulkSession && statement.kind != StatementKind::Session) {
+                ok = countUncommitted(worker, statement.sql.size(), rows);
+            }
+            worker.busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - serverStart).count();
+            if (!commitOnly) {
+                worker.roundTrips++;
+                worker.statementsRun++;
+            }
+            if (ok && metrics) {
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - serverStart).count();
+                metrics->loaded(statement.kind == StatementKind::Table ? statement.table : "",
+                                rows == static_cast<my_ulonglong>(-1) ? 0 : static_cast<size_t>(rows), seconds);
+            }
+
+            if (!ok) {
+                // running stays set, so no checkpoint is written past the statement that failed
+                fail();
+                break;
+            }
+            recycle(statement.sql);
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                worker.running = false;
+                worker.dirty = worker.pendingRows > 0 || worker.pendingBytes > 0;
+            }
+            worker.changed.notify_all();
+        }
+        if (policy.bulkSession && !failed) {
+            restoreSession(worker);
+        }
+        mysql_thread_end();
+    }
+
+    // Saves the profile variables and sets them all to 0 for this connection
+    bool applyBulkSession(RestoreWorker& worker) {
+        std::string select = "SELECT ";
+        for (const char* variable : BULK_SESSION_VARIABLES) {
+            select += std::string(select.size() > 7 ? ", " : "") + "@@session." + variable;
+        }
+        if (mysql_query(worker.conn, select.c_str()) != 0) {
+            std::cerr << "Failed to read session settings: " << mysql_error(worker.conn) << std::endl;
+            return false;
+        }
+        MYSQL_RES* result = mysql_store_result(worker.conn);
+        MYSQL_ROW row = result ? mysql_fetch_row(result) : NULL;
+        for (size_t i = 0; i < std::size(BULK_SESSION_VARIABLES); ++i) {
+            worker.savedSession.push_back(row && row[i] ? row[i] : "1");
+        }
+        if (result) {
+            mysql_free_result(result);
+        }
+
+        for (const char* variable : BULK_SESSION_VARIABLES) {
+            std::string set = std::string("SET SESSION ") + variable + " = 0";
+            if (mysql_query(worker.conn, set.c_str()) != 0) {
+                // sql_log_bin needs extra privileges, the rest of the profile still helps
+                std::cerr << "Warning: could not set " << variable << " for the bulk load: " << mysql_error(worker.conn) << std::endl;
+            }
+        }
+        worker.commitRows = policy.rows;
+        worker.batchStart = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    // Notes that the statements of a table up to lastOrdinal ran, committed unless the bulk profile holds them.
+    // DDL is committed by the server as it runs, whatever the profile.
+    void recordProgress(RestoreWorker& worker, const DumpStatement& statement, uint64_t lastOrdinal) {
+        if (policy.bulkSession && !commitsImplicitly(statement)) {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.uncommittedTables[statement.table] = lastOrdinal;
+            worker.firstUncommitted = std::min(worker.firstUncommitted, statement.ordinal);
+        } else {
+            std::lock_guard<std::mutex> lock(progressMutex);
+            committedTables[statement.table] = lastOrdinal;
+        }
+    }
+
+    // Puts the profile variables back to what they were before the restore
+    void restoreSession(RestoreWorker& worker) {
+        for (size_t i = 0; i < worker.savedSession.size(); ++i) {
+            std::string set = std::string("SET SESSION ") + BULK_SESSION_VARIABLES[i] + " = " + worker.savedSession[i];
+            mysql_query(worker.conn, set.c_str());
+        }
+    }
+
+    // Adds the rows of the statements just run to the open transaction and commits once it is big enough
+    bool countUncommitted(RestoreWorker& worker, size_t bytes, my_ulonglong rows) {
+        if (rows != static_cast<my_ulonglong>(-1)) {
+            worker.pendingRows += rows;
+        }
+        worker.pendingBytes += bytes;
+        if (worker.pendingRows >= worker.commitRows || worker.pendingBytes >= policy.bytes) {
+            return commit(worker);
+        }
+        return true;
+    }
+
+    // Commits and sizes the next transaction from how long this one took.
+    // When COMMIT costs more than 5% of the time spent loading the batch, batches double;
+    // when a batch runs longer than 2 s its undo grows large, so the next one is halved.
+    bool commit(RestoreWorker& worker) {
+        auto commitStart = std::chrono::steady_clock::now();
+        if (mysql_query(worker.conn, "COMMIT") != 0) {
+            std::cerr << "Failed to commit: " << mysql_error(worker.conn) << std::endl;
+            return false;
+        }
+        auto now = std::chrono::steady_clock::now();
+        double commitSeconds = std::chrono::duration<double>(now - commitStart).count();
+        double batchSeconds = std::chrono::duration<double>(commitStart - worker.batchStart).count();
+
+        // Only batches ended by the row limit say something about the row limit
+        if (worker.pendingRows >= worker.commitRows) {
+            if (commitSeconds > 0.05 * batchSeconds) {
+                worker.commitRows = std::min<size_t>(worker.commitRows * 2, 10 * 1000 * 1000);
+            } else if (batchSeconds > 2.0) {
+                worker.commitRows = std::max<size_t>(worker.commitRows / 2, 1000);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(progressMutex);
+            for (const auto& entry : worker.uncommittedTables) {
+                committedTables[entry.first] = entry.second;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.uncommittedTables.clear();
+            worker.firstUncommitted = UINT64_MAX;
+        }
+        worker.commits++;
+        worker.commitSeconds += commitSeconds;
+        worker.pendingRows = 0;
+        worker.pendingBytes = 0;
+        worker.batchStart = now;
+        return true;
+    }
+
+    // LOAD DATA does not follow SET NAMES, so keep track of it for the CHARACTER SET clause
+    static void rememberCharacterSet(RestoreWorker& worker, const std::string& sql) {
+        size_t pos = sql.find("SET NAMES ");
+        if (pos == std::string::npos) {
+            return;
+        }
+        pos += 10;
+        size_t end = pos;
+        while (end < sql.size() && (std::isalnum(static_cast<unsigned char>(sql[end])) || sql[end] == '_')) {
+            end++;
+        }
+        if (end > pos) {
+            worker.characterSet = sql.substr(pos, end - pos);
+        }
+    }
+
+    // Streams this INSERT and the INSERTs for the same table queued behind it through one LOAD DATA
+    bool loadWithInfile(RestoreWorker& worker, const DumpStatement& statement, const InsertStatementParts& parts, uint64_t& lastOrdinal) {
+        InfileFeed feed;
+        feed.engine = this;
+        feed.worker = &worker;
+        feed.table = std::string(parts.table);
+        feed.columns = std::string(parts.columns);
+        feed.lastOrdinal = statement.ordinal;
+        if (!appendTsv(feed, parts)) {
+            return execute(worker.conn, statement);
+        }
+        feed.statements = 1;
+
+        mysql_set_local_infile_handler(worker.conn, infileInit, infileRead, infileEnd, infileError, &feed);
+        // LOAD DATA's defaults: fields end with \t, lines with \n, escaped by backslash
+        std::string load = "LOAD DATA LOCAL INFILE 'openmrs-dump' INTO TABLE `" + feed.table +
+                           "` CHARACTER SET " + worker.characterSet + " " + feed.columns;
+        int status = mysql_real_query(worker.conn, load.c_str(), load.size());
+        // The table, columns and statement strings, and every row converted and then copied out to the client library
+        if (buffers) {
+            buffers->counted(feed.allocations + 3, feed.table.size() + feed.columns.size() + load.size() + feed.converted + feed.bytesSent);
+        }
+        if (status != 0) {
+            if (feed.bytesSent == 0 && feed.statements == 1) {
+                // LOCAL INFILE is disabled on the client or the server, keep going with INSERTs
+                std::cerr << "LOAD DATA LOCAL INFILE not available (" << mysql_error(worker.conn) << "), falling back to INSERT." << std::endl;
+                useInfile = false;
+                return execute(worker.conn, statement);
+            }
+            std::cerr << "Failed to load table '" << feed.table << "' with LOAD DATA: " << mysql_error(worker.conn) << std::endl;
+            return false;
+        }
+        // With LOCAL the server skips duplicate keys and stores bad values with only a warning,
+        // where the INSERTs being replaced would have failed, so a warning fails the table
+        unsigned int warnings = mysql_warning_count(worker.conn);
+        if (warnings > 0) {
+            std::cerr << "Failed to load table '" << feed.table << "' with LOAD DATA: " << warnings << " warnings" << std::endl;
+            MYSQL_RES* result = mysql_query(worker.conn, "SHOW WARNINGS LIMIT 5") == 0 ? mysql_store_result(worker.conn) : NULL;
+            MYSQL_ROW row;
+            while (result && (row = mysql_fetch_row(result)) != NULL) {
+                std::cerr << "  " << (row[0] ? row[0] : "") << " " << (row[1] ? row[1] : "") << ": " << (row[2] ? row[2] : "") << std::endl;
+            }
+            if (result) {
+                mysql_free_result(result);
+            }
+            return false;
+        }
+        lastOrdinal = feed.lastOrdinal;
+        return true;
+    }
+
+    static int infileInit(void** ptr, const char*, void* userdata) {
+        *ptr = userdata;
+        return 0;
+    }
+
+    static int infileRead(void* ptr, char* buffer, unsigned int length) {
+        InfileFeed& feed = *static_cast<InfileFeed*>(ptr);
+        return feed.engine->fillInfile(feed, buffer, length);
+    }
+
+    static void infileEnd(void*) {
+    }
+
+    static int infileError(void*, char* message, unsigned int length) {
+        std::snprintf(message, length, "restore stopped while streaming rows");
+        return 2000;
+    }
+
+    // Converts the rows of an INSERT onto the feed, counting what that costs in the pool's terms
+    static bool appendTsv(InfileFeed& feed, const InsertStatementParts& parts) {
+        size_t capacity = feed.tsv.capacity();
+        size_t size = feed.tsv.size();
+        bool ok = appendInsertValuesAsTsv(parts.values, feed.tsv, feed.rows);
+        feed.allocations += feed.tsv.capacity() > capacity ? 1 : 0;
+        feed.converted += feed.tsv.size() - size;
+        return ok;
+    }
+
+    int fillInfile(InfileFeed& feed, char* buffer, unsigned int length) {
+        while (feed.offset == feed.tsv.size()) {
+            feed.tsv.clear();
+            feed.offset = 0;
+            if (feed.bytesSent >= LOAD_DATA_MAX_BYTES || !takeNextInsert(feed)) {
+                return 0;  // end of this LOAD DATA
+            }
+        }
+        size_t count = std::min<size_t>(length, feed.tsv.size() - feed.offset);
+        std::memcpy(buffer, feed.tsv.data() + feed.offset, count);
+        feed.offset += count;
+        feed.bytesSent += count;
+        return static_cast<int>(count);
+    }
+
+    // Takes the next queued statement into the feed if it is an INSERT for the same table and columns
+    bool takeNextInsert(InfileFeed& feed) {
+        RestoreWorker& worker = *feed.worker;
+        DumpStatement next;
+        {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.changed.wait(lock, [&] { return stopping || failed || flushing || !worker.queue.empty(); });
+            if (failed || worker.queue.empty()) {
+                return false;
+            }
+            InsertStatementParts parts;
+            const DumpStatement& front = worker.queue.front();
+            if (front.kind != StatementKind::Table || front.table != feed.table ||
+                !splitInsertStatement(front.sql, parts) || parts.columns != feed.columns) {
+                return false;
+            }
+            next = std::move(worker.queue.front());
+            worker.queue.pop_front();
+            worker.queuedBytes -= next.sql.size();
+            worker.changed.notify_all();
+        }
+
+        InsertStatementParts parts;
+        splitInsertStatement(next.sql, parts);
+        if (!appendTsv(feed, parts)) {
+            // Leave it for a plain INSERT once this LOAD DATA is done
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.queuedBytes += next.sql.size();
+            worker.queue.push_front(std::move(next));
+            return false;
+        }
+        feed.statements++;
+        feed.lastOrdinal = next.ordinal;
+        recycle(next.sql);
+        return true;
+    }
+
+    bool execute(MYSQL* conn, const DumpStatement& statement) {
+        if (mysql_real_query(conn, statement.sql.c_str(), statement.sql.size()) != 0) {
+            // Same exception restoreMySQLDumpB makes for the age function, any other existing
+            // routine, trigger or view fails the restore
+            if (statement.kind == StatementKind::Barrier && std::strcmp(mysql_error(conn), "FUNCTION age already exists") == 0) {
+                std::cerr << "Skipping existing routine: " << mysql_error(conn) << std::endl;
+                return true;
+            }
+            std::cerr << "Failed to execute query on table '" << statement.table << "': " << mysql_error(conn) << std::endl;
+            std::cerr << "Query: " << statement.sql.substr(0, 200) << std::endl;
+            return false;
+        }
+        // Drain any result set so the connection is ready for the next statement
+        do {
+            MYSQL_RES* result = mysql_store_result(conn);
+            if (result) {
+                mysql_free_result(result);
+            }
+        } while (mysql_next_result(conn) == 0);
+        return true;
+    }
+
+    // Called with the worker's mutex held, right after statement left the queue. Moves it and the
+    // table statements queued behind it into the worker's batch, up to batchBytes of SQL in all.
+    // The batch stays empty when nothing can join statement, which then runs on its own, as DDL always does.
+    void takeBatch(RestoreWorker& worker, DumpStatement& statement) {
+        if (pipeline.batchBytes == 0 || useInfile || statement.kind != StatementKind::Table || commitsImplicitly(statement)) {
+            return;
+        }
+        size_t bytes = statement.sql.size();
+        while (!worker.queue.empty()) {
+            DumpStatement& next = worker.queue.front();
+            if (next.kind != StatementKind::Table || commitsImplicitly(next) || bytes + next.sql.size() + 2 > pipeline.batchBytes) {
+                break;
+            }
+            if (worker.batch.empty()) {
+                worker.batch.push_back(std::move(statement));
+            }
+            bytes += next.sql.size() + 2;
+            worker.queuedBytes -= next.sql.size();
+            worker.batch.push_back(std::move(next));
+            worker.queue.pop_front();
+        }
+    }
+
+    // Sends the batch as one multi-statement query and reads back a result per statement.
+    // The server stops at the first statement that fails; the ones before it ran and count as progress.
+    bool executeBatch(RestoreWorker& worker) {
+        std::string& sql = worker.batchSql;
+        sql.clear();
+        for (const auto& statement : worker.batch) {
+            if (!sql.empty()) {
+                sql += ";\n";
+            }
+            sql += statement.sql;
+        }
+        worker.batchRows.clear();
+        auto serverStart = std::chrono::steady_clock::now();
+        int status = mysql_real_query(worker.conn, sql.data(), sql.size());
+        while (status == 0) {
+            MYSQL_RES* result = mysql_store_result(worker.conn);
+            if (result) {
+                mysql_free_result(result);
+            }
+            worker.batchRows.push_back(mysql_affected_rows(worker.conn));
+            status = mysql_next_result(worker.conn);  // -1 after the last result, above 0 on an error
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - serverStart).count();
+
+        size_t ran = std::min(worker.batchRows.size(), worker.batch.size());
+        size_t bytes = 0;
+        my_ulonglong rows = 0;
+        for (size_t i = 0; i < ran; ++i) {
+            const DumpStatement& statement = worker.batch[i];
+            my_ulonglong statementRows = worker.batchRows[i] == static_cast<my_ulonglong>(-1) ? 0 : worker.batchRows[i];
+            recordProgress(worker, statement, statement.ordinal);
+            rows += statementRows;
+            bytes += statement.sql.size();
+            if (metrics) {
+                // The server time of the batch is shared out by statement size
+                metrics->loaded(statement.table, static_cast<size_t>(statementRows), seconds * statement.sql.size() / sql.size());
+            }
+        }
+        worker.roundTrips++;
+        worker.statementsRun += ran;
+
+        bool ok = status < 0 && ran == worker.batch.size();
+        if (!ok) {
+            const DumpStatement& statement = worker.batch[std::min(ran, worker.batch.size() - 1)];
+            std::cerr << "Failed to execute query on table '" << statement.table << "': " << mysql_error(worker.conn) << std::endl;
+            std::cerr << "Query: " << statement.sql.substr(0, 200) << std::endl;
+        }
+        // Every result has been read by now, so a COMMIT here covers the whole batch
+        if (ok && policy.bulkSession) {
+            ok = countUncommitted(worker, bytes, rows);
+        }
+        for (auto& statement : worker.batch) {
+            recycle(statement.sql);
+        }
+        worker.batch.clear();
+        return ok;
+    }
+
+    void fail() {
+        failed = true;
+        for (auto& worker : workers) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->changed.notify_all();
+        }
+    }
+
+    void stopWorkers() {
+        for (auto& worker : workers) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            stopping = true;
+            worker->changed.notify_all();
+        }
+        for (auto& worker : workers) {
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
+            if (worker->conn) {
+                mysql_close(worker->conn);
+                worker->conn = nullptr;
+            }
+        }
+    }
+};
+
+// Accepts every statement and does nothing with it, what is left is the cost of reading and parsing
+class NullStatementSink : public StatementSink {
+public:
+    bool submit(DumpStatement statement) override {
+        statements++;
+        bytes += statement.sql.size();
+        recycle(statement.sql);
+        return true;
+    }
+
+    bool finish() override {
+        return true;
+    }
+
+    std::string describe() const override {
+        return "null sink, " + std::to_string(statements) + " statements, " + std::to_string(bytes / (1024 * 1024)) + " MB of SQL";
+    }
+
+private:
+    size_t statements = 0;
+    size_t bytes = 0;
+};
+
+// Writes every table of the dump to its own gzip file in folder, each one loadable on its own
+// with the mysql client. Every file starts with the session the dump had set up by the time
+// the table began. Views, routines and triggers go to _objects.sql.gz, to be loaded last.
+class TableFileSink : public StatementSink {
+public:
+    explicit TableFileSink(const fs::path& folder) : folder(folder) {}
+
+    ~TableFileSink() {
+        close();
+    }
+
+    bool submit(DumpStatement statement) override {
+        if (failed) {
+            return false;
+        }
+        bool ok = true;
+        switch (statement.kind) {
+            case StatementKind::Skip:
+            case StatementKind::Lock:
+                break;
+            case StatementKind::Session:
+                // Also written to the open file, a SET can change how the statements after it behave
+                session.push_back(statement.sql);
+                ok = out == NULL || (write(statement.sql) && write(";\n"));
+                break;
+            case StatementKind::Barrier:
+                // Routines and triggers contain semicolons, so they keep a delimiter of their own
+                ok = open("_objects") && write("DELIMITER ;;\n") && write(statement.sql) && write(";;\nDELIMITER ;\n");
+                break;
+            case StatementKind::Table:
+                ok = open(statement.table) && write(statement.sql) && write(";\n");
+                break;
+        }
+        recycle(statement.sql);
+        return ok;
+    }
+
+    bool finish() override {
+        return close() && !failed;
+    }
+
+    std::string describe() const override {
+        return std::to_string(written.size()) + " table files in " + folder.string();
+    }
+
+private:
+    fs::path folder;
+    std::vector<std::string> session;
+    std::unordered_set<std::string> written;   // files created by this run
+    std::string current;
+    gzFile out = NULL;
+    bool failed = false;
+
+    // Makes name the file being written. mysqldump keeps the statements of a table together,
+    // so only one file is open at a time and a table seen again is appended as a new gzip member.
+    // Level 1 keeps compression from becoming the slowest step of the split.
+    bool open(const std::string& name) {
+        if (out != NULL && name == current) {
+            return true;
+        }
+        if (!close()) {
+            return false;
+        }
+        std::string fileName = name;
+        std::replace(fileName.begin(), fileName.end(), '/', '_');
+        fs::path path = folder / (fileName + ".sql.gz");
+        bool created = written.insert(name).second;
+        std::error_code error;
+        fs::create_directories(folder, error);
+        out = gzopen(path.string().c_str(), created ? "wb1" : "ab1");
+        if (out == NULL) {
+            std::cerr << "Error: Could not create " << path << std::endl;
+            failed = true;
+            return false;
+        }
+        current = name;
+        if (created) {
+            std::string preamble;
+            for (const auto& sql : session) {
+                preamble += sql + ";\n";
+            }
+            return write(preamble);
+        }
+        return true;
+    }
+
+    bool write(const std::string& text) {
+        if (!text.empty() && gzwrite(out, text.data(), static_cast<unsigned>(text.size())) != static_cast<int>(text.size())) {
+            std::cerr << "Error: Failed to write " << (folder / current) << ".sql.gz" << std::endl;
+            failed = true;
+        }
+        return !failed;
+    }
+
+    bool close() {
+        if (out != NULL && gzclose(out) != Z_OK) {
+            std::cerr << "Error: Failed to close " << (folder / current) << ".sql.gz" << std::endl;
+            failed = true;
+        }
+        out = NULL;
+        return !failed;
+    }
+};
+
+// Days since 1970-01-01 of a proleptic Gregorian date
+int64_t daysFromCivil(int64_t year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    unsigned yearOfEra = static_cast<unsigned>(year - era * 400);
+    unsigned dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + static_cast<int64_t>(dayOfEra) - 719468;
+}
+
+// Reads 'YYYY-MM-DD[ HH:MM:SS[.ffffff]]' as milliseconds since the epoch.
+// MySQL's zero dates have no such value and come back as false.
+bool parseDumpDateTime(std::string_view text, int64_t& millis) {
+    auto number = [&](size_t pos, size_t digits, unsigned& out) {
+        out = 0;
+        if (pos + digits > text.size()) {
+            return false;
+        }
+        for (size_t i = pos; i < pos + digits; ++i) {
+            if (text[i] < '0' || text[i] > '9') {
+                return false;
+            }
+            out = out * 10 + (text[i] - '0');
+        }
+        return true;
+    };
+    unsigned year, month, day, hour = 0, minute = 0, second = 0;
+    if (!number(0, 4, year) || !number(5, 2, month) || !number(8, 2, day) || month == 0 || day == 0) {
+        return false;
+    }
+    if (text.size() >= 19 && (!number(11, 2, hour) || !number(14, 2, minute) || !number(17, 2, second))) {
+        return false;
+    }
+    unsigned fraction = 0;
+    if (text.size() >= 23 && text[19] == '.') {
+        number(20, 3, fraction);
+    }
+    millis = ((daysFromCivil(year, month, day) * 24 + hour) * 60 + minute) * 60000 + second * 1000 + fraction;
+    return true;
+}
+
+// Writes Thrift's compact protocol, the encoding of Parquet's page headers and file footer
+class ThriftCompactWriter {
+public:
+    enum Type : uint8_t { True = 1, False = 2, I32 = 5, I64 = 6, Binary = 8, List = 9, Struct = 12 };
+
+    std::string out;
+
+    void beginStruct() {
+        lastField.push_back(0);
+    }
+
+    void endStruct() {
+        out += '\0';
+        lastField.pop_back();
+    }
+
+    // A boolean field is all header, the type says the value
+    void fieldBool(int16_t id, bool value) {
+        fieldHeader(id, value ? True : False);
+    }
+
+    void fieldI32(int16_t id, int32_t value) {
+        fieldHeader(id, I32);
+        varint(zigzag(value));
+    }
+
+    void fieldI64(int16_t id, int64_t value) {
+        fieldHeader(id, I64);
+        varint(zigzag(value));
+    }
+
+    void fieldBinary(int16_t id, const std::string& value) {
+        fieldHeader(id, Binary);
+        binary(value);
+    }
+
+    void fieldStruct(int16_t id) {
+        fieldHeader(id, Struct);
+        beginStruct();
+    }
+
+    void fieldList(int16_t id, Type elementType, size_t size) {
+        fieldHeader(id, List);
+        if (size < 15) {
+            out += static_cast<char>(size << 4 | elementType);
+        } else {
+            out += static_cast<char>(0xf0 | elementType);
+            varint(size);
+        }
+    }
+
+    void listI32(int32_t value) {
+        varint(zigzag(value));
+    }
+
+    void binary(const std::string& value) {
+        varint(value.size());
+        out += value;
+    }
+
+private:
+    std::vector<int16_t> lastField;
+
+    static uint64_t zigzag(int64_t value) {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    void varint(uint64_t value) {
+        while (value >= 0x80) {
+            out += static_cast<char>(value | 0x80);
+            value >>= 7;
+        }
+        out += static_cast<char>(value);
+    }
+
+    void fieldHeader(int16_t id, Type type) {
+        int delta = id - lastField.back();
+        if (delta > 0 && delta <= 15) {
+            out += static_cast<char>(delta << 4 | type);
+        } else {
+            out += static_cast<char>(type);
+            varint(zigzag(id));
+        }
+        lastField.back() = id;
+    }
+};
+
+// Column types of the columnar export, taken from the CREATE TABLE of the dump
+enum class ColumnarType {
+    Int64,      // integer types, YEAR and BIT
+    UInt64,     // BIGINT UNSIGNED, which can be past the largest INT64
+    Double,     // FLOAT / DOUBLE
+    Text,       // character types, DECIMAL (kept exact), TIME, ENUM, SET, JSON
+    Binary,     // BLOB and BINARY types
+    Timestamp,  // DATETIME / TIMESTAMP as milliseconds since the epoch, in the time zone of the dump
+    Date        // DATE as days since the epoch
+};
+
+struct ColumnarColumn {
+    std::string name;
+    ColumnarType type = ColumnarType::Text;
+    std::string values;            // PLAIN encoded values of the row group, nulls left out
+    std::vector<uint8_t> defined;  // 1 for every row with a value
+};
+
+// Reads the column names and types of a CREATE TABLE
+bool parseColumnarSchema(const std::string& sql, std::vector<ColumnarColumn>& columns) {
+    size_t bodyStart, bodyEnd;
+    std::vector<std::string> items;
+    if (!splitCreateDefinitions(sql, bodyStart, bodyEnd, items)) {
+        return false;
+    }
+    for (const auto& item : items) {
+        size_t pos = item.find_first_not_of(" \t\r\n");
+        if (pos == std::string::npos || item[pos] != '`') {
+            continue;  // keys and constraints
+        }
+        ColumnarColumn column;
+        column.name = extractQuotedName(item, pos);
+        size_t typeStart = item.find_first_not_of(" \t", item.find('`', pos + 1) + 1);
+        size_t typeEnd = item.find_first_of(" (\t,", typeStart);
+        std::string type = item.substr(typeStart, typeEnd == std::string::npos ? std::string::npos : typeEnd - typeStart);
+        std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+        if (type == "tinyint" || type == "smallint" || type == "mediumint" || type == "int" || type == "integer" ||
+            type == "bigint" || type == "year" || type == "bit") {
+            bool isUnsigned = type == "bigint" && item.find(" unsigned", typeStart) != std::string::npos;
+            column.type = isUnsigned ? ColumnarType::UInt64 : ColumnarType::Int64;
+        } else if (type == "float" || type == "double" || type == "real") {
+            column.type = ColumnarType::Double;
+        } else if (type == "datetime" || type == "timestamp") {
+            column.type = ColumnarType::Timestamp;
+        } else if (type == "date") {
+            column.type = ColumnarType::Date;
+        } else if (type.find("blob") != std::string::npos || type == "binary" || type == "varbinary") {
+            column.type = ColumnarType::Binary;
+        }
+        columns.push_back(std::move(column));
+    }
+    return !columns.empty();
+}
+
+// Writes one table to a Parquet file, a row group at a time. Every column is OPTIONAL with a
+// single PLAIN encoded, gzip compressed data page per row group, which every Parquet reader
+// understands. Only the row group being filled is held in memory. The file is written as
+// <path>.tmp and renamed once its footer is in, so a reader never finds a file without one.
+class ParquetTableWriter {
+public:
+    ParquetTableWriter(const fs::path& path, std::vector<ColumnarColumn> columns) : path(path), columns(std::move(columns)) {}
+
+    // A writer that was never closed leaves no file behind
+    ~ParquetTableWriter() {
+        if (out) {
+            std::fclose(out);
+            std::error_code error;
+            fs::remove(temporaryPath(), error);
+        }
+    }
+
+    bool open() {
+        std::error_code error;
+        fs::create_directories(path.parent_path(), error);
+        out = std::fopen(temporaryPath().string().c_str(), "wb");
+        if (!out) {
+            std::cerr << "Error: Could not create " << temporaryPath() << std::endl;
+            return false;
+        }
+        return writeBytes("PAR1", 4);
+    }
+
+    // Adds the value of column field to the current row, an unparsable value is stored as NULL.
+    // Integers are the exception: one out of range for its column fails the file.
+    void add(size_t field, bool isNull, std::string_view text) {
+        if (field >= columns.size()) {
+            return;
+        }
+        ColumnarColumn& column = columns[field];
+        filled[field] = true;
+        if (!isNull && append(column, text)) {
+            column.defined.push_back(1);
+        } else {
+            column.defined.push_back(0);
+            if (!isNull && ok && outOfRange(column, text)) {
+                std::cerr << "Error: " << text << " does not fit column " << column.name << " of " << path << std::endl;
+                ok = false;
+            }
+        }
+    }
+
+    // Ends the current row, columns the INSERT left out are NULL
+    void endRow() {
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (!filled[i]) {
+                columns[i].defined.push_back(0);
+            }
+            filled[i] = false;
+        }
+        rowGroupRows++;
+    }
+
+    size_t bufferedBytes() const {
+        size_t bytes = 0;
+        for (const auto& column : columns) {
+            bytes += column.values.size() + column.defined.size();
+        }
+        return bytes;
+    }
+
+    bool flushRowGroup() {
+        if (rowGroupRows == 0) {
+            return ok;
+        }
+        RowGroup group;
+        group.rows = rowGroupRows;
+        for (auto& column : columns) {
+            // Definition levels as one bit-packed run of the RLE / bit-packing hybrid, bit width 1
+            std::string levels;
+            size_t groups = (column.defined.size() + 7) / 8;
+            uint64_t header = groups << 1 | 1;
+            while (header >= 0x80) {
+                levels += static_cast<char>(header | 0x80);
+                header >>= 7;
+            }
+            levels += static_cast<char>(header);
+            size_t packedStart = levels.size();
+            levels.resize(packedStart + groups, '\0');
+            for (size_t i = 0; i < column.defined.size(); ++i) {
+                levels[packedStart + i / 8] |= static_cast<char>(column.defined[i] << (i % 8));
+            }
+
+            std::string page;
+            appendLittleEndian(page, static_cast<uint32_t>(levels.size()));
+            page += levels;
+            page += column.values;
+            std::string compressed;
+            if (!gzipPage(page, compressed)) {
+                std::cerr << "Error: Failed to compress a page of " << path << std::endl;
+                ok = false;
+                return false;
+            }
+
+            ThriftCompactWriter pageHeader;
+            pageHeader.beginStruct();
+            pageHeader.fieldI32(1, 0);                                  // DATA_PAGE
+            pageHeader.fieldI32(2, static_cast<int32_t>(page.size()));
+            pageHeader.fieldI32(3, static_cast<int32_t>(compressed.size()));
+            pageHeader.fieldStruct(5);
+            pageHeader.fieldI32(1, static_cast<int32_t>(rowGroupRows));
+            pageHeader.fieldI32(2, 0);                                  // PLAIN
+            pageHeader.fieldI32(3, 3);                                  // RLE definition levels
+            pageHeader.fieldI32(4, 3);                                  // RLE repetition levels
+            pageHeader.endStruct();
+            pageHeader.endStruct();
+
+            ColumnChunk chunk;
+            chunk.offset = offset;
+            chunk.uncompressed = pageHeader.out.size() + page.size();
+            chunk.compressed = pageHeader.out.size() + compressed.size();
+            group.chunks.push_back(chunk);
+            group.bytes += chunk.uncompressed;
+            if (!writeBytes(pageHeader.out.data(), pageHeader.out.size()) || !writeBytes(compressed.data(), compressed.size())) {
+                return false;
+            }
+            column.values.clear();
+            column.defined.clear();
+        }
+        rows += rowGroupRows;
+        rowGroupRows = 0;
+        rowGroups.push_back(std::move(group));
+        return ok;
+    }
+
+    // Writes the last row group and the footer
+    bool close() {
+        if (!out || !flushRowGroup()) {
+            return false;
+        }
+        ThriftCompactWriter footer;
+        footer.beginStruct();
+        footer.fieldI32(1, 1);
+        footer.fieldList(2, ThriftCompactWriter::Struct, columns.size() + 1);
+        footer.beginStruct();
+        footer.fieldBinary(4, "schema");
+        footer.fieldI32(5, static_cast<int32_t>(columns.size()));
+        footer.endStruct();
+        for (const auto& column : columns) {
+            footer.beginStruct();
+            footer.fieldI32(1, physicalType(column.type));
+            footer.fieldI32(3, 1);                                      // OPTIONAL
+            footer.fieldBinary(4, column.name);
+            if (convertedType(column.type) >= 0) {
+                footer.fieldI32(6, convertedType(column.type));
+            }
+            if (column.type == ColumnarType::Timestamp) {
+                // DATETIME has no time zone. TIMESTAMP_MILLIS would mark the values as UTC, only
+                // the logical type can say they are local, and then no converted type is written.
+                footer.fieldStruct(10);
+                footer.fieldStruct(8);                                  // TIMESTAMP
+                footer.fieldBool(1, false);                             // isAdjustedToUTC
+                footer.fieldStruct(2);
+                footer.fieldStruct(1);                                  // MILLIS
+                footer.endStruct();
+                footer.endStruct();
+                footer.endStruct();
+                footer.endStruct();
+            }
+            footer.endStruct();
+        }
+        footer.fieldI64(3, static_cast<int64_t>(rows));
+        footer.fieldList(4, ThriftCompactWriter::Struct, rowGroups.size());
+        for (const auto& group : rowGroups) {
+            footer.beginStruct();
+            footer.fieldList(1, ThriftCompactWriter::Struct, columns.size());
+            for (size_t i = 0; i < columns.size(); ++i) {
+                const ColumnChunk& chunk = group.chunks[i];
+                footer.beginStruct();
+                footer.fieldI64(2, static_cast<int64_t>(chunk.offset));
+                footer.fieldStruct(3);
+                footer.fieldI32(1, physicalType(columns[i].type));
+                footer.fieldList(2, ThriftCompactWriter::I32, 2);
+                footer.listI32(0);                                      // PLAIN
+                footer.listI32(3);                                      // RLE
+                footer.fieldList(3, ThriftCompactWriter::Binary, 1);
+                footer.binary(columns[i].name);
+                footer.fieldI32(4, 2);                                  // GZIP
+                footer.fieldI64(5, static_cast<int64_t>(group.rows));
+                footer.fieldI64(6, static_cast<int64_t>(chunk.uncompressed));
+                footer.fieldI64(7, static_cast<int64_t>(chunk.compressed));
+                footer.fieldI64(9, static_cast<int64_t>(chunk.offset));
+                footer.endStruct();
+                footer.endStruct();
+            }
+            footer.fieldI64(2, static_cast<int64_t>(group.bytes));
+            footer.fieldI64(3, static_cast<int64_t>(group.rows));
+            footer.endStruct();
+        }
+        footer.fieldBinary(6, "openmrs_dump_restoration");
+        footer.endStruct();
+
+        std::string tail;
+        appendLittleEndian(tail, static_cast<uint32_t>(footer.out.size()));
+        tail += "PAR1";
+        bool written = writeBytes(footer.out.data(), footer.out.size()) && writeBytes(tail.data(), tail.size());
+        written = std::fclose(out) == 0 && written;
+        out = nullptr;
+        std::error_code error;
+        if (written) {
+            fs::rename(temporaryPath(), path, error);
+        }
+        if (!written || error) {
+            std::cerr << "Error: Failed to write " << path << std::endl;
+            fs::remove(temporaryPath(), error);
+            return false;
+        }
+        return true;
+    }
+
+    size_t rowCount() const {
+        return rows + rowGroupRows;
+    }
+
+private:
+    struct ColumnChunk {
+        size_t offset = 0;
+        size_t uncompressed = 0;
+        size_t compressed = 0;
+    };
+
+    struct RowGroup {
+        std::vector<ColumnChunk> chunks;
+        size_t rows = 0;
+        size_t bytes = 0;
+    };
+
+    fs::path path;
+    std::vector<ColumnarColumn> columns;
+    std::vector<bool> filled = std::vector<bool>(columns.size());
+    std::vector<RowGroup> rowGroups;
+    size_t rowGroupRows = 0;
+    size_t rows = 0;
+    size_t offset = 0;
+    FILE* out = nullptr;
+    bool ok = true;
+
+    template <typename T>
+    static void appendLittleEndian(std::string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    fs::path temporaryPath() const {
+        return path.string() + ".tmp";
+    }
+
+    // An integer column given a number it cannot hold, as opposed to text that is no number
+    static bool outOfRange(const ColumnarColumn& column, std::string_view text) {
+        if (column.type != ColumnarType::Int64 && column.type != ColumnarType::UInt64) {
+            return false;
+        }
+        size_t digits = text.size() > 0 && text[0] == '-' ? 1 : 0;
+        return digits < text.size() && text.find_first_not_of("0123456789", digits) == std::string_view::npos;
+    }
+
+    static int32_t physicalType(ColumnarType type) {
+        switch (type) {
+            case ColumnarType::Int64: case ColumnarType::UInt64: case ColumnarType::Timestamp: return 2;  // INT64
+            case ColumnarType::Date: return 1;                                 // INT32
+            case ColumnarType::Double: return 5;                               // DOUBLE
+            default: return 6;                                                 // BYTE_ARRAY
+        }
+    }
+
+    static int32_t convertedType(ColumnarType type) {
+        switch (type) {
+            case ColumnarType::Text: return 0;       // UTF8
+            case ColumnarType::Date: return 6;       // DATE
+            case ColumnarType::UInt64: return 14;    // UINT_64
+            default: return -1;
+        }
+    }
+
+    static bool append(ColumnarColumn& column, std::string_view text) {
+        switch (column.type) {
+            case ColumnarType::Int64: {
+                int64_t value;
+                auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+                if (result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+                    return false;
+                }
+                appendLittleEndian(column.values, value);
+                return true;
+            }
+            case ColumnarType::UInt64: {
+                uint64_t value;
+                auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+                if (result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+                    return false;
+                }
+                appendLittleEndian(column.values, value);  // INT64 holding the unsigned bits
+                return true;
+            }
+            case ColumnarType::Double: {
+                char number[64];
+                if (text.empty() || text.size() >= sizeof(number)) {
+                    return false;
+                }
+                std::memcpy(number, text.data(), text.size());
+                number[text.size()] = '\0';
+                char* end;
+                double value = std::strtod(number, &end);
+                if (end != number + text.size()) {
+                    return false;
+                }
+                appendLittleEndian(column.values, value);
+                return true;
+            }
+            case ColumnarType::Timestamp:
+            case ColumnarType::Date: {
+                int64_t millis;
+                if (!parseDumpDateTime(text, millis)) {
+                    return false;
+                }
+                if (column.type == ColumnarType::Date) {
+                    appendLittleEndian(column.values, static_cast<int32_t>(millis / 86400000));
+                } else {
+                    appendLittleEndian(column.values, millis);
+                }
+                return true;
+            }
+            default:
+                appendLittleEndian(column.values, static_cast<uint32_t>(text.size()));
+                column.values.append(text.data(), text.size());
+                return true;
+        }
+    }
+
+    static bool gzipPage(const std::string& page, std::string& compressed) {
+        z_stream stream = {};
+        // Level 1, as for the split files, so compression keeps up with parsing
+        if (deflateInit2(&stream, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        compressed.resize(deflateBound(&stream, page.size()));
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(page.data()));
+        stream.avail_in = static_cast<uInt>(page.size());
+        stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+        stream.avail_out = static_cast<uInt>(compressed.size());
+        int result = deflate(&stream, Z_FINISH);
+        compressed.resize(stream.total_out);
+        deflateEnd(&stream);
+        return result == Z_STREAM_END;
+    }
+
+    bool writeBytes(const char* data, size_t size) {
+        if (ok && std::fwrite(data, 1, size, out) != size) {
+            std::cerr << "Error: Failed to write " << path << std::endl;
+            ok = false;
+        }
+        offset += size;
+        return ok;
+    }
+};
+
+// Converts the dump straight into one Parquet file per table, no server involved. Files are laid
+// out as folder/<table>/site=<database>/<table>.parquet so a datalake sees the site as a partition.
+// Memory stays bounded: a table's rows are written out once they reach rowGroupBytes, and when
+// the dump moves on to the next table.
+class ColumnarExportSink : public StatementSink {
+public:
+    ColumnarExportSink(const fs::path& folder, const std::string& site, size_t rowGroupBytes)
+        : folder(folder), site(site), rowGroupBytes(rowGroupBytes) {}
+
+    bool submit(DumpStatement statement) override {
+        bool ok = !failed && exportStatement(statement);
+        recycle(statement.sql);
+        return ok;
+    }
+
+    bool finish() override {
+        for (auto& entry : writers) {
+            if (!entry.second->close()) {
+                failed = true;
+            }
+            rows += entry.second->rowCount();
+        }
+        writers.clear();
+        return !failed;
+    }
+
+    std::string describe() const override {
+        return "columnar export of " + std::to_string(schemas.size()) + " tables, " + std::to_string(rows) + " rows to " + folder.string();
+    }
+
+private:
+    fs::path folder;
+    std::string site;
+    size_t rowGroupBytes;
+    std::unordered_map<std::string, std::vector<ColumnarColumn>> schemas;
+    std::map<std::string, std::unique_ptr<ParquetTableWriter>> writers;
+    std::string current;
+    size_t rows = 0;
+    bool failed = false;
+
+    // Keeps the schema of a CREATE TABLE and adds the rows of an INSERT to its table's writer
+    bool exportStatement(const DumpStatement& statement) {
+        if (statement.kind != StatementKind::Table) {
+            return true;
+        }
+        const std::string& sql = statement.sql;
+        size_t pos = sql.find_first_not_of(" \t\r\n");
+        if (startsWithWord(sql, pos, "CREATE TABLE")) {
+            std::vector<ColumnarColumn> columns;
+            if (!parseColumnarSchema(sql, columns)) {
+                std::cerr << "Warning: No columns found for table " << statement.table << ", it is not exported" << std::endl;
+                return true;
+            }
+            schemas[statement.table] = std::move(columns);
+            return true;
+        }
+
+        InsertStatementParts parts;
+        if (!splitInsertStatement(sql, parts)) {
+            return true;
+        }
+        ParquetTableWriter* writer = writerFor(statement.table);
+        if (!writer) {
+            return !failed;
+        }
+
+        // With --complete-insert the INSERT names its columns, map them onto the table's order
+        std::vector<size_t> positions;
+        if (!parts.columns.empty()) {
+            const std::vector<ColumnarColumn>& columns = schemas[statement.table];
+            for (size_t p = parts.columns.find('`'); p != std::string_view::npos; p = parts.columns.find('`', p + 1)) {
+                size_t end = parts.columns.find('`', p + 1);
+                std::string_view name = parts.columns.substr(p + 1, end - p - 1);
+                size_t index = columns.size();
+                for (size_t i = 0; i < columns.size(); ++i) {
+                    if (columns[i].name == name) {
+                        index = i;
+                    }
+                }
+                positions.push_back(index);
+                p = end;
+            }
+        }
+
+        size_t rowsAdded = 0;
+        bool parsed = forEachInsertValue(parts.values,
+            [&](size_t field, InsertValueKind kind, std::string_view value, std::string_view) {
+                writer->add(positions.empty() ? field : (field < positions.size() ? positions[field] : SIZE_MAX), kind == InsertValueKind::Null, value);
+                return true;
+            },
+            [&](size_t, std::string_view) {
+                writer->endRow();
+                rowsAdded++;
+                return true;
+            });
+        if (!parsed) {
+            std::cerr << "Error: Could not decode an INSERT into " << statement.table << std::endl;
+            failed = true;
+            return false;
+        }
+        if (metrics) {
+            metrics->loaded(statement.table, rowsAdded, 0);
+        }
+        if (writer->bufferedBytes() >= rowGroupBytes && !writer->flushRowGroup()) {
+            failed = true;
+        }
+        return !failed;
+    }
+
+    ParquetTableWriter* writerFor(const std::string& table) {
+        if (table != current) {
+            // Leaving a table, write out what it has buffered
+            auto previous = writers.find(current);
+            if (previous != writers.end() && !previous->second->flushRowGroup()) {
+                failed = true;
+                return nullptr;
+            }
+            current = table;
+        }
+        auto it = writers.find(table);
+        if (it != writers.end()) {
+            return it->second.get();
+        }
+        auto schema = schemas.find(table);
+        if (schema == schemas.end()) {
+            std::cerr << "Warning: Rows of " << table << " come before its CREATE TABLE, they are not exported" << std::endl;
+            return nullptr;
+        }
+        auto writer = std::make_unique<ParquetTableWriter>(folder / table / ("site=" + site) / (table + ".parquet"), schema->second);
+        if (!writer->open()) {
+            failed = true;
+            return nullptr;
+        }
+        return writers.emplace(table, std::move(writer)).first->second.get();
+    }
+};
+
+// One ALTER TABLE job of the deferred index build
+struct IndexBuildJob {
+    IndexBuildJob(size_t table, bool foreignKeys) : table(table), foreignKeys(foreignKeys) {}
+
+    size_t table;                        // position in DeferredIndexPlan::tables
+    bool foreignKeys;
+    std::vector<std::string> statements;
+    std::vector<std::string> locks;      // tables the ALTER holds metadata locks on
+    std::vector<size_t> dependents;      // jobs waiting for this one
+    size_t waitingOn = 0;
+    int state = 0;                       // 0 pending, 1 running, 2 done, 3 failed or skipped
+    double seconds = 0;
+};
+
+// Adds the deferred keys and foreign keys back once every row is loaded.
+// Each table gets one ALTER for its secondary keys and one for its foreign keys. A foreign
+// key job waits for the key jobs of its own table and of every table it references, and
+// jobs touching the same tables never run at the same time. Ready jobs of the largest tables start first.
+bool buildDeferredIndexes(const DeferredIndexPlan& plan, const std::string& db_host, const std::string& db_user, const std::string& db_password, const std::string& db_name, unsigned int port, size_t connections) {
+    std::vector<IndexBuildJob> jobs;
+    std::unordered_map<std::string, size_t> keyJobs;
+    for (size_t i = 0; i < plan.tables.size(); ++i) {
+        const DeferredTableIndexes& table = plan.tables[i];
+        if (table.keys.empty() && table.separateKeys.empty()) {
+            continue;
+        }
+        IndexBuildJob job(i, false);
+        std::string alter = "ALTER TABLE `" + table.table + "` ";
+        if (!table.keys.empty()) {
+            std::string sql = alter;
+            for (size_t k = 0; k < table.keys.size(); ++k) {
+                sql += (k > 0 ? ", ADD " : "ADD ") + table.keys[k];
+            }
+            job.statements.push_back(sql);
+        }
+        for (const auto& key : table.separateKeys) {
+            job.statements.push_back(alter + "ADD " + key);
+        }
+        job.locks.push_back(table.table);
+        keyJobs[table.table] = jobs.size();
+        jobs.push_back(std::move(job));
+    }
+    for (size_t i = 0; i < plan.tables.size(); ++i) {
+        const DeferredTableIndexes& table = plan.tables[i];
+        if (table.foreignKeys.empty()) {
+            continue;
+        }
+        IndexBuildJob job(i, true);
+        std::string sql = "ALTER TABLE `" + table.table + "` ";
+        for (size_t k = 0; k < table.foreignKeys.size(); ++k) {
+            sql += (k > 0 ? ", ADD " : "ADD ") + table.foreignKeys[k];
+        }
+        job.statements.push_back(sql);
+        job.locks.push_back(table.table);
+        job.locks.insert(job.locks.end(), table.referencedTables.begin(), table.referencedTables.end());
+
+        size_t index = jobs.size();
+        for (const auto& name : job.locks) {
+            auto it = keyJobs.find(name);
+            if (it != keyJobs.end()) {
+                jobs[it->second].dependents.push_back(index);
+                job.waitingOn++;
+            }
+        }
+        jobs.push_back(std::move(job));
+    }
+    if (jobs.empty()) {
+        return true;
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::unordered_map<std::string, int> lockedTables;
+    size_t finished = 0;
+    auto startTime = std::chrono::steady_clock::now();
+
+    // Picks the ready job of the largest table whose tables are not in use, or jobs.size()
+    auto nextJob = [&]() {
+        size_t best = jobs.size();
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            const IndexBuildJob& job = jobs[i];
+            if (job.state != 0 || job.waitingOn > 0) {
+                continue;
+            }
+            bool free = std::none_of(job.locks.begin(), job.locks.end(), [&](const std::string& name) {
+                return lockedTables[name] > 0;
+            });
+            if (free && (best == jobs.size() || plan.tables[job.table].dataBytes > plan.tables[jobs[best].table].dataBytes)) {
+                best = i;
+            }
+        }
+        return best;
+    };
+
+    // Marks a job and everything depending on it as not built
+    std::function<void(size_t)> skip = [&](size_t index) {
+        if (jobs[index].state == 3) {
+            return;
+        }
+        jobs[index].state = 3;
+        finished++;
+        for (size_t dependent : jobs[index].dependents) {
+            skip(dependent);
+        }
+    };
+
+    auto worker = [&]() {
+        mysql_thread_init();
+        MYSQL* conn = mysql_init(NULL);
+        if (conn == NULL || !mysql_real_connect(conn, db_host.c_str(), db_user.c_str(), db_password.c_str(), db_name.c_str(), port, NULL, 0)) {
+            std::cerr << "Failed to connect to MySQL server for index build: " << (conn ? mysql_error(conn) : "out of memory") << std::endl;
+            if (conn) {
+                mysql_close(conn);
+            }
+            mysql_thread_end();
+            return;
+        }
+        // The dump was consistent, so the foreign keys are added without checking every row again
+        mysql_query(conn, "SET NAMES utf8mb4");
+        mysql_query(conn, "SET FOREIGN_KEY_CHECKS=0");
+
+        while (true) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return finished == jobs.size() || nextJob() != jobs.size(); });
+                if (finished == jobs.size()) {
+                    break;
+                }
+                index = nextJob();
+                jobs[index].state = 1;
+                for (const auto& name : jobs[index].locks) {
+                    lockedTables[name]++;
+                }
+            }
+
+            IndexBuildJob& job = jobs[index];
+            auto jobStart = std::chrono::steady_clock::now();
+            bool ok = true;
+            for (const auto& sql : job.statements) {
+                if (mysql_real_query(conn, sql.c_str(), sql.size()) != 0) {
+                    std::cerr << "Failed to build " << (job.foreignKeys ? "foreign keys" : "keys") << " on table '"
+                              << plan.tables[job.table].table << "': " << mysql_error(conn) << std::endl;
+                    ok = false;
+                    break;
+                }
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - jobStart).count();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job.seconds = seconds;
+                for (const auto& name : job.locks) {
+                    lockedTables[name]--;
+                }
+                if (ok) {
+                    job.state = 2;
+                    finished++;
+                    for (size_t dependent : job.dependents) {
+                        jobs[dependent].waitingOn--;
+                    }
+                } else {
+                    job.state = 0;
+                    skip(index);
+                }
+            }
+            changed.notify_all();
+        }
+        mysql_close(conn);
+        mysql_thread_end();
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::min(std::max<size_t>(connections, 1), jobs.size()); ++i) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // Per table build times, slowest first
+    std::vector<size_t> order;
+    std::unordered_map<size_t, std::pair<double, double>> tableSeconds;
+    bool ok = true;
+    for (const auto& job : jobs) {
+        ok = ok && job.state == 2;
+        auto& seconds = tableSeconds[job.table];
+        (job.foreignKeys ? seconds.second : seconds.first) += job.seconds;
+    }
+    for (const auto& entry : tableSeconds) {
+        order.push_back(entry.first);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return tableSeconds[a].first + tableSeconds[a].second > tableSeconds[b].first + tableSeconds[b].second;
+    });
+    for (size_t table : order) {
+        const DeferredTableIndexes& indexes = plan.tables[table];
+        std::cout << "Index build for " << db_name << "." << indexes.table << ": "
+                  << indexes.keys.size() + indexes.separateKeys.size() << " keys in " << tableSeconds[table].first << " s, "
+                  << indexes.foreignKeys.size() << " foreign keys in " << tableSeconds[table].second << " s" << std::endl;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    std::cout << "Deferred index build of " << db_name << (ok ? " finished" : " failed") << ": " << jobs.size()
+              << " ALTER jobs on " << tableSeconds.size() << " tables in " << seconds << " s (" << threads.size() << " connections)" << std::endl;
+    return ok;
+}
+
+// Identifies what a dump file holds without reading all of it: its size, its modification time
+// and a hash of its first and last 64 KB, where a gzip file keeps its header and the CRC32 and
+// length of its last member. Empty when the file cannot be read.
+std::string dumpFileIdentity(const std::string& filename) {
+    std::error_code error;
+    uintmax_t size = fs::file_size(filename, error);
+    auto modified = error ? fs::file_time_type() : fs::last_write_time(filename, error);
+    std::ifstream in(filename, std::ios::binary);
+    if (error || !in) {
+        return "";
+    }
+    const size_t edge = 64 * 1024;
+    std::string head(std::min<uintmax_t>(size, edge), '\0');
+    std::string tail(std::min<uintmax_t>(size, edge), '\0');
+    in.read(&head[0], head.size());
+    in.seekg(static_cast<std::streamoff>(size - tail.size()));
+    in.read(&tail[0], tail.size());
+    if (!in) {
+        return "";
+    }
+    char identity[80];
+    std::snprintf(identity, sizeof(identity), "%ju:%lld:%016llx", size, static_cast<long long>(modified.time_since_epoch().count()),
+                  static_cast<unsigned long long>(hashBytes(head) ^ (hashBytes(tail) * 31)));
+    return identity;
+}
+
+const uint64_t GZIP_INDEX_SPAN = 32 * 1024 * 1024; // Output bytes between gzip access points
+const unsigned int GZIP_WINDOW_SIZE = 32768;       // Deflate history needed to resume inflating
+
+// A place in a gzip file where inflating can start without reading what comes before it
+struct GzipAccessPoint {
+    uint64_t input;                     // compressed offset
+    uint64_t output;                    // uncompressed offset
+    int bits;                           // bits of the byte before input that still belong to the stream
+    std::vector<unsigned char> window;  // empty when the point is the start of a gzip member
+};
+
+// Access points for a gzip dump, stored in a sidecar file in GZIP_INDEX_FOLDER
+struct GzipIndex {
+    std::vector<GzipAccessPoint> points;
+    uint64_t length = 0;      // total uncompressed size
+    size_t memberCount = 1;
+
+    // <dump name>-<hash of its full path>.gzidx, kept out of the dump folder the watcher and collectors scan
+    static std::string sidecarPath(const std::string& filename) {
+        std::error_code error;
+        fs::path full = fs::absolute(filename, error);
+        char suffix[32];
+        std::snprintf(suffix, sizeof(suffix), "-%016llx.gzidx", static_cast<unsigned long long>(hashBytes(full.string())));
+        return (fs::path(getEnvOrDefault("GZIP_INDEX_FOLDER", "gzip_index")) / (full.filename().string() + suffix)).string();
+    }
+
+    // Writes the index, windows are zlib compressed to keep the file small
+    bool save(const std::string& filename) const {
+        std::string path = sidecarPath(filename);
+        std::string identity = dumpFileIdentity(filename);
+        std::error_code error;
+        fs::create_directories(fs::path(path).parent_path(), error);
+        if (identity.empty()) {
+            std::cerr << "Failed to write gzip index: " << path << std::endl;
+            return false;
+        }
+        std::ostringstream out;
+        uint32_t identityLength = static_cast<uint32_t>(identity.size());
+        uint64_t count = points.size();
+        out.write("GZIDX2", 6);
+        out.write(reinterpret_cast<const char*>(&identityLength), sizeof(identityLength));
+        out.write(identity.data(), identityLength);
+        out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (const auto& point : points) {
+            uLongf packedSize = compressBound(point.window.size());
+            std::vector<Bytef> packed(packedSize);
+            compress2(packed.data(), &packedSize, point.window.data(), point.window.size(), Z_BEST_SPEED);
+            uint32_t windowSize = static_cast<uint32_t>(point.window.size());
+            uint32_t packedLength = static_cast<uint32_t>(packedSize);
+            int32_t bits = point.bits;
+            out.write(reinterpret_cast<const char*>(&point.input), sizeof(point.input));
+            out.write(reinterpret_cast<const char*>(&point.output), sizeof(point.output));
+            out.write(reinterpret_cast<const char*>(&bits), sizeof(bits));
+            out.write(reinterpret_cast<const char*>(&windowSize), sizeof(windowSize));
+            out.write(reinterpret_cast<const char*>(&packedLength), sizeof(packedLength));
+            out.write(reinterpret_cast<const char*>(packed.data()), packedLength);
+        }
+        return writeFileAtomically(path, out.str());
+    }
+
+    // Loads the sidecar index, ignoring it when it was built for a different file: one uploaded
+    // again under the same name and size still differs in modification time and content hash
+    bool load(const std::string& filename) {
+        std::ifstream in(sidecarPath(filename), std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        char magic[6];
+        uint32_t identityLength = 0;
+        uint64_t count = 0;
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char*>(&identityLength), sizeof(identityLength));
+        if (!in || std::memcmp(magic, "GZIDX2", 6) != 0 || identityLength > 256) {
+            return false;
+        }
+        std::string identity(identityLength, '\0');
+        in.read(&identity[0], identityLength);
+        in.read(reinterpret_cast<char*>(&length), sizeof(length));
+        in.read(reinterpret_cast<char*>(&count), sizeof(count));
+        if (!in || identity != dumpFileIdentity(filename)) {
+            return false;
+        }
+        points.clear();
+        for (uint64_t i = 0; i < count; ++i) {
+            GzipAccessPoint point;
+            int32_t bits = 0;
+            uint32_t windowSize = 0;
+            uint32_t packedLength = 0;
+            in.read(reinterpret_cast<char*>(&point.input), sizeof(point.input));
+            in.read(reinterpret_cast<char*>(&point.output), sizeof(point.output));
+            in.read(reinterpret_cast<char*>(&bits), sizeof(bits));
+            in.read(reinterpret_cast<char*>(&windowSize), sizeof(windowSize));
+            in.read(reinterpret_cast<char*>(&packedLength), sizeof(packedLength));
+            std::vector<Bytef> packed(packedLength);
+            in.read(reinterpret_cast<char*>(packed.data()), packedLength);
+            if (!in || windowSize > GZIP_WINDOW_SIZE) {
+                return false;
+            }
+            point.bits = bits;
+            point.window.resize(windowSize);
+            uLongf unpackedSize = windowSize;
+            if (windowSize > 0 && uncompress(point.window.data(), &unpackedSize, packed.data(), packedLength) != Z_OK) {
+                return false;
+            }
+            points.push_back(std::move(point));
+        }
+        return true;
+    }
+
+    // BGZF files (bgzip) are made of small gzip members that carry their compressed size in
+    // the header and their uncompressed size in the trailer, so they can be indexed by
+    // walking the headers without inflating anything
+    bool buildFromBgzf(const std::string& filename) {
+        std::ifstream in(filename, std::ios::binary);
+        uint64_t fileSize = fs::file_size(filename);
+        uint64_t input = 0;
+        uint64_t output = 0;
+        uint64_t lastPoint = 0;
+        points.clear();
+        memberCount = 0;
+        while (input < fileSize) {
+            unsigned char header[18];
+            in.seekg(static_cast<std::streamoff>(input));
+            in.read(reinterpret_cast<char*>(header), sizeof(header));
+            bool bgzf = in && header[0] == 0x1f && header[1] == 0x8b && (header[3] & 4) &&
+                        header[12] == 'B' && header[13] == 'C';
+            if (!bgzf) {
+                return input == fileSize && !points.empty();
+            }
+            uint64_t blockSize = static_cast<uint64_t>(header[16] | (header[17] << 8)) + 1;
+            unsigned char trailer[4];
+            in.seekg(static_cast<std::streamoff>(input + blockSize - 4));
+            in.read(reinterpret_cast<char*>(trailer), sizeof(trailer));
+            if (!in) {
+                return false;
+            }
+            if (points.empty() || output - lastPoint >= GZIP_INDEX_SPAN) {
+                points.push_back(GzipAccessPoint{input, output, 0, {}});
+                lastPoint = output;
+            }
+            output += trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (static_cast<uint64_t>(trailer[3]) << 24);
+            input += blockSize;
+            memberCount++;
+        }
+        length = output;
+        return !points.empty();
+    }
+};
+
+// Source of decompressed dump data for the restore stream
+class DumpReader {
+public:
+    virtual ~DumpReader() = default;
+
+    // Returns the number of bytes read, 0 at the end of the dump and -1 on error
+    virtual long read(char* buffer, size_t size) = 0;
+
+    // Starts again from the beginning of the dump
+    virtual bool rewind() = 0;
+
+    // The last place at or before the uncompressed offset where reading can start without
+    // inflating everything in front of it. Readers without random access return the start.
+    virtual GzipAccessPoint accessPointBefore(uint64_t offset) {
+        (void)offset;
+        return GzipAccessPoint{0, 0, 0, {}};
+    }
+
+    // Continues reading at the uncompressed offset, inflating from point when the reader can
+    virtual bool seek(uint64_t offset, const GzipAccessPoint& point) {
+        (void)point;
+        return rewind() && skip(offset);
+    }
+
+    // Bytes copied from buffers of the reader's own into the caller's, decompressing aside
+    virtual uint64_t bytesCopied() const {
+        return 0;
+    }
+
+    // Time spent decompressing so far, summed over the threads doing it, 0 for plain SQL
+    virtual double inflateSeconds() const {
+        return inflateNanoseconds / 1e9;
+    }
+
+    // Hands out the next part of the dump, in place when the reader holds it in memory already.
+    // data stays valid until the next call on the reader. Returns the size, 0 at the end and -1 on error.
+    virtual long borrow(const char*& data) {
+        borrowed.resize(BUFFER_SIZE);
+        data = borrowed.data();
+        return read(borrowed.data(), borrowed.size());
+    }
+
+protected:
+    std::vector<char> borrowed;
+    std::atomic<uint64_t> inflateNanoseconds{0};
+
+    // Adds the time since start to inflateSeconds, from whichever thread decompressed
+    void countInflate(std::chrono::steady_clock::time_point start) {
+        inflateNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Reads and drops count bytes
+    bool skip(uint64_t count) {
+        std::vector<char> buffer(BUFFER_SIZE);
+        while (count > 0) {
+            long bytesRead = read(buffer.data(), std::min<uint64_t>(count, BUFFER_SIZE));
+            if (bytesRead <= 0) {
+                return false;
+            }
+            count -= bytesRead;
+        }
+        return true;
+    }
+};
+
+// Reads a gzipped dump through zlib.
+// While inflating it records an access point every GZIP_INDEX_SPAN bytes of output: the
+// compressed position, the bit offset and the 32 KB window needed to start inflating there.
+// Gzip member boundaries are recorded as access points too. Once the whole dump has been read
+// the points are saved next to it, so later reads can inflate ranges on several threads.
+class GzipDumpReader : public DumpReader {
+public:
+    explicit GzipDumpReader(const std::string& filename) : filename(filename) {}
+
+    ~GzipDumpReader() override {
+        close();
+    }
+
+    bool open() {
+        file = fopen(filename.c_str(), "rb");
+        if (!file) {
+            std::cerr << "Error: Could not open file " << filename << std::endl;
+            return false;
+        }
+        input.resize(BUFFER_SIZE);
+        return start();
+    }
+
+    bool rewind() override {
+        inflateEnd(&strm);
+        std::rewind(file);
+        return start();
+    }
+
+    GzipAccessPoint accessPointBefore(uint64_t offset) override {
+        GzipAccessPoint best{0, 0, 0, {}};
+        for (const auto& point : index.points) {
+            if (point.output <= offset) {
+                best = point;
+            }
+        }
+        return best;
+    }
+
+    // Starts inflating at the access point instead of the beginning of the file
+    bool seek(uint64_t offset, const GzipAccessPoint& point) override {
+        if (point.output == 0 || point.output > offset) {
+            return DumpReader::seek(offset, point);
+        }
+        inflateEnd(&strm);
+        strm = z_stream();
+        bool memberStart = point.window.empty();
+        if (inflateInit2(&strm, memberStart ? 15 + 16 : -15) != Z_OK) {
+            std::cerr << "Error: Unable to initialize zlib for " << filename << std::endl;
+            return false;
+        }
+        inputOffset = point.input - (point.bits ? 1 : 0);
+        if (fseeko(file, static_cast<off_t>(inputOffset), SEEK_SET) != 0) {
+            return false;
+        }
+        if (point.bits) {
+            int ch = getc(file);
+            inputOffset++;
+            inflatePrime(&strm, point.bits, ch >> (8 - point.bits));
+        }
+        if (!memberStart) {
+            inflateSetDictionary(&strm, point.window.data(), static_cast<uInt>(point.window.size()));
+        }
+        rawDeflate = !memberStart;
+        outputOffset = point.output;
+        lastPointOutput = point.output;
+        finished = false;
+        // The points before this one were never seen, so this run cannot save a complete index
+        partialIndex = true;
+        index = GzipIndex();
+        index.points.push_back(point);
+        return skip(offset - point.output);
+    }
+
+    long read(char* buffer, size_t size) override {
+        if (finished) {
+            return 0;
+        }
+        strm.next_out = reinterpret_cast<Bytef*>(buffer);
+        strm.avail_out = static_cast<uInt>(size);
+        while (strm.avail_out > 0 && !finished) {
+            if (strm.avail_in == 0) {
+                size_t count = fread(input.data(), 1, input.size(), file);
+                if (count == 0) {
+                    std::cerr << "Error: Failed to decompress " << filename << ": unexpected end of file" << std::endl;
+                    return -1;
+                }
+                inputOffset += count;
+                strm.next_in = input.data();
+                strm.avail_in = static_cast<uInt>(count);
+            }
+
+            uInt outBefore = strm.avail_out;
+            auto inflateStart = std::chrono::steady_clock::now();
+            int ret = inflate(&strm, Z_BLOCK);
+            countInflate(inflateStart);
+            outputOffset += outBefore - strm.avail_out;
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                std::cerr << "Error: Failed to decompress " << filename << ": " << (strm.msg ? strm.msg : "inflate error") << std::endl;
+                return -1;
+            }
+
+            if (ret == Z_STREAM_END) {
+                if (!nextMember()) {
+                    finished = true;
+                    saveIndex();
+                }
+            } else if ((strm.data_type & 128) && !(strm.data_type & 64) && outputOffset - lastPointOutput >= GZIP_INDEX_SPAN) {
+                // At the end of a deflate block, a place where inflating can resume
+                addAccessPoint(strm.data_type & 7);
+            }
+        }
+        return static_cast<long>(size - strm.avail_out);
+    }
+
+private:
+    std::string filename;
+    FILE* file = nullptr;
+    z_stream strm = {};
+    std::vector<Bytef> input;
+    uint64_t inputOffset = 0;   // compressed bytes read from the file
+    uint64_t outputOffset = 0;  // bytes inflated so far
+    uint64_t lastPointOutput = 0;
+    bool finished = false;
+    bool rawDeflate = false;    // inflating from an access point inside a member, without its gzip header
+    bool partialIndex = false;
+    GzipIndex index;
+
+    bool start() {
+        strm = z_stream();
+        inputOffset = 0;
+        outputOffset = 0;
+        lastPointOutput = 0;
+        finished = false;
+        rawDeflate = false;
+        partialIndex = false;
+        index = GzipIndex();
+        // 15 + 16: gzip wrapper, members are handled by nextMember
+        if (inflateInit2(&strm, 15 + 16) != Z_OK) {
+            std::cerr << "Error: Unable to initialize zlib for " << filename << std::endl;
+            return false;
+        }
+        index.points.push_back(GzipAccessPoint{0, 0, 0, {}});
+        return true;
+    }
+
+    void close() {
+        if (file) {
+            inflateEnd(&strm);
+            fclose(file);
+            file = nullptr;
+        }
+    }
+
+    uint64_t compressedPosition() const {
+        return inputOffset - strm.avail_in;
+    }
+
+    // Makes sure at least count unread input bytes are buffered, unless the file ends first
+    void fillInput(size_t count) {
+        if (strm.avail_in < count) {
+            size_t kept = strm.avail_in;
+            std::memmove(input.data(), strm.next_in, kept);
+            size_t added = fread(input.data() + kept, 1, input.size() - kept, file);
+            inputOffset += added;
+            strm.next_in = input.data();
+            strm.avail_in = static_cast<uInt>(kept + added);
+        }
+    }
+
+    // Moves on to the next gzip member, as gzread does for concatenated files
+    bool nextMember() {
+        if (rawDeflate) {
+            // A raw deflate stream stops in front of the member's 8 byte gzip trailer
+            fillInput(8);
+            size_t trailer = std::min<size_t>(8, strm.avail_in);
+            strm.next_in += trailer;
+            strm.avail_in -= static_cast<uInt>(trailer);
+            rawDeflate = false;
+        }
+        fillInput(2);
+        // Trailing bytes that are not another gzip header are ignored like gzread does
+        if (strm.avail_in < 2 || strm.next_in[0] != 0x1f || strm.next_in[1] != 0x8b) {
+            return false;
+        }
+        inflateReset2(&strm, 15 + 16);
+        index.memberCount++;
+        if (outputOffset - lastPointOutput >= GZIP_INDEX_SPAN) {
+            index.points.push_back(GzipAccessPoint{compressedPosition(), outputOffset, 0, {}});
+            lastPointOutput = outputOffset;
+        }
+        return true;
+    }
+
+    void addAccessPoint(int bits) {
+        GzipAccessPoint point{compressedPosition(), outputOffset, bits, std::vector<unsigned char>(GZIP_WINDOW_SIZE)};
+        uInt length = GZIP_WINDOW_SIZE;
+        if (inflateGetDictionary(&strm, point.window.data(), &length) != Z_OK) {
+            return;
+        }
+        point.window.resize(length);
+        index.points.push_back(std::move(point));
+        lastPointOutput = outputOffset;
+    }
+
+    void saveIndex() {
+        index.length = outputOffset;
+        if (getEnvOrDefault("GZIP_INDEX", "1") != "0" && !partialIndex && index.points.size() > 1) {
+            index.save(filename);
+        }
+    }
+};
+
+// Inflates the ranges between the access points of a GzipIndex on several threads and hands
+// the output back in order. At most two chunks per thread are held in memory at a time.
+class ParallelGzipReader : public DumpReader {
+public:
+    ParallelGzipReader(const std::string& filename, GzipIndex index, size_t threads)
+        : filename(filename), index(std::move(index)), threadCount(std::max<size_t>(threads, 1)) {}
+
+    ~ParallelGzipReader() override {
+        stop();
+    }
+
+    // Starts handing out data skip bytes into the range of access point firstChunk
+    bool open(size_t firstChunk = 0, size_t skip = 0) {
+        chunks.clear();
+        chunks.resize(index.points.size());
+        nextChunk = firstChunk;
+        readChunk = firstChunk;
+        readOffset = skip;
+        failed = false;
+        stopping = false;
+        for (size_t i = 0; i < threadCount; ++i) {
+            threads.emplace_back(&ParallelGzipReader::run, this);
+        }
+        return true;
+    }
+
+    bool rewind() override {
+        stop();
+        return open();
+    }
+
+    GzipAccessPoint accessPointBefore(uint64_t offset) override {
+        return index.points[chunkFor(offset)];
+    }
+
+    // The index already has every access point, so the one passed in is not needed
+    bool seek(uint64_t offset, const GzipAccessPoint&) override {
+        stop();
+        size_t k = chunkFor(offset);
+        return open(k, offset - index.points[k].output);
+    }
+
+    long read(char* buffer, size_t size) override {
+        size_t copied = 0;
+        while (copied < size && readChunk < chunks.size()) {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return failed || chunks[readChunk].ready; });
+            if (failed) {
+                return -1;
+            }
+            Chunk& chunk = chunks[readChunk];
+            lock.unlock();
+
+            size_t count = std::min(size - copied, chunk.data.size() - readOffset);
+            std::memcpy(buffer + copied, chunk.data.data() + readOffset, count);
+            copied += count;
+            readOffset += count;
+            if (readOffset == chunk.data.size()) {
+                lock.lock();
+                std::vector<char>().swap(chunk.data);
+                readChunk++;
+                readOffset = 0;
+                changed.notify_all();
+            }
+        }
+        totalCopied += copied;
+        return static_cast<long>(copied);
+    }
+
+    uint64_t bytesCopied() const override {
+        return totalCopied;
+    }
+
+private:
+    struct Chunk {
+        std::vector<char> data;
+        bool ready = false;
+    };
+
+    std::string filename;
+    GzipIndex index;
+    size_t threadCount;
+    std::vector<Chunk> chunks;
+    std::vector<std::thread> threads;
+    size_t nextChunk = 0;
+    size_t readChunk = 0;
+    size_t readOffset = 0;
+    uint64_t totalCopied = 0;
+    bool failed = false;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    size_t chunkFor(uint64_t offset) const {
+        size_t k = 0;
+        while (k + 1 < index.points.size() && index.points[k + 1].output <= offset) {
+            k++;
+        }
+        return k;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            changed.notify_all();
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        threads.clear();
+    }
+
+    void run() {
+        FILE* file = fopen(filename.c_str(), "rb");
+        while (true) {
+            size_t k;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                // Back-pressure: stay at most two chunks per thread ahead of the reader
+                changed.wait(lock, [&] {
+                    return stopping || failed || nextChunk >= chunks.size() || nextChunk < readChunk + 2 * threadCount;
+                });
+                if (stopping || failed || nextChunk >= chunks.size()) {
+                    break;
+                }
+                k = nextChunk++;
+            }
+
+            std::vector<char> data;
+            auto inflateStart = std::chrono::steady_clock::now();
+            bool ok = file != nullptr && inflateRange(file, k, data);
+            countInflate(inflateStart);
+            if (!ok && file == nullptr) {
+                std::cerr << "Error: Could not open file " << filename << std::endl;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ok) {
+                failed = true;
+            } else {
+                chunks[k].data = std::move(data);
+                chunks[k].ready = true;
+            }
+            changed.notify_all();
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    // Inflates the output between access point k and the next one into data
+    bool inflateRange(FILE* file, size_t k, std::vector<char>& data) {
+        const GzipAccessPoint& point = index.points[k];
+        uint64_t end = k + 1 < index.points.size() ? index.points[k + 1].output : index.length;
+        data.resize(end - point.output);
+
+        z_stream strm = {};
+        bool memberStart = point.window.empty();
+        if (inflateInit2(&strm, memberStart ? 15 + 16 : -15) != Z_OK) {
+            return false;
+        }
+        fseeko(file, static_cast<off_t>(point.input - (point.bits ? 1 : 0)), SEEK_SET);
+        if (!memberStart) {
+            if (point.bits) {
+                int ch = getc(file);
+                inflatePrime(&strm, point.bits, ch >> (8 - point.bits));
+            }
+            inflateSetDictionary(&strm, point.window.data(), static_cast<uInt>(point.window.size()));
+        }
+
+        std::vector<Bytef> input(BUFFER_SIZE);
+        strm.next_out = reinterpret_cast<Bytef*>(data.data());
+        strm.avail_out = static_cast<uInt>(data.size());
+        bool rawDeflate = !memberStart;
+        int ret = Z_OK;
+        while (strm.avail_out > 0) {
+            if (strm.avail_in == 0) {
+                size_t count = fread(input.data(), 1, input.size(), file);
+                if (count == 0) {
+                    break;
+                }
+                strm.next_in = input.data();
+                strm.avail_in = static_cast<uInt>(count);
+            }
+            ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                // A member ended inside the range, the next one starts with a gzip header.
+                // A raw deflate stream stops before its gzip trailer, skip those 8 bytes first.
+                size_t trailer = rawDeflate ? 8 : 0;
+                while (trailer > 0) {
+                    if (strm.avail_in == 0) {
+                        size_t count = fread(input.data(), 1, input.size(), file);
+                        if (count == 0) {
+                            break;
+                        }
+                        strm.next_in = input.data();
+                        strm.avail_in = static_cast<uInt>(count);
+                    }
+                    size_t skip = std::min<size_t>(trailer, strm.avail_in);
+                    strm.next_in += skip;
+                    strm.avail_in -= static_cast<uInt>(skip);
+                    trailer -= skip;
+                }
+                inflateReset2(&strm, 15 + 16);
+                rawDeflate = false;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                break;
+            }
+        }
+        inflateEnd(&strm);
+        if (strm.avail_out != 0) {
+            std::cerr << "Error: Failed to decompress " << filename << " at offset " << point.input << std::endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Reads dumps compressed with zstd, xz or bzip2 through libarchive
+class ArchiveDumpReader : public DumpReader {
+public:
+    explicit ArchiveDumpReader(const std::string& filename) : filename(filename) {}
+
+    ~ArchiveDumpReader() override {
+        close();
+    }
+
+    bool open() {
+        a = archive_read_new();
+        archive_read_support_filter_all(a);
+        archive_read_support_format_raw(a);
+        struct archive_entry *entry;
+        if (archive_read_open_filename(a, filename.c_str(), BUFFER_SIZE) != ARCHIVE_OK ||
+            archive_read_next_header(a, &entry) != ARCHIVE_OK) {
+            std::cerr << "Error: Unable to open compressed dump file " << filename << ": " << archive_error_string(a) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool rewind() override {
+        close();
+        return open();
+    }
+
+    long read(char* buffer, size_t size) override {
+        auto inflateStart = std::chrono::steady_clock::now();
+        ssize_t bytesRead = archive_read_data(a, buffer, size);
+        countInflate(inflateStart);
+        if (bytesRead < 0) {
+            std::cerr << "Error: Failed to decompress " << filename << ": " << archive_error_string(a) << std::endl;
+            return -1;
+        }
+        return static_cast<long>(bytesRead);
+    }
+
+private:
+    std::string filename;
+    struct archive *a = nullptr;
+
+    void close() {
+        if (a) {
+            archive_read_close(a);
+            archive_read_free(a);
+            a = nullptr;
+        }
+    }
+};
+
+// A mapping the SIGBUS handler of MappedDumpReader may repair. A reader claims a free slot, fills
+// in size and only then sets start, so the handler never sees a start without its size.
+struct GuardedRange {
+    std::atomic<bool> claimed{false};
+    std::atomic<const char*> start{nullptr};
+    std::atomic<size_t> size{0};
+    std::atomic<bool> truncated{false};
+};
+
+// Reads an uncompressed .sql dump through a read-only mapping of the whole file. borrow() hands
+// out the mapped pages themselves, so the splitter tokenizes the dump where the kernel put it
+// instead of from a read buffer; each statement is still copied once into its DumpStatement.
+// A file truncated while mapped raises SIGBUS on the pages past its new end. The handler maps
+// zeros over the rest of the mapping instead, which never complete a statement, and the next
+// call on the reader fails the restore.
+class MappedDumpReader : public DumpReader {
+public:
+    explicit MappedDumpReader(const std::string& filename) : filename(filename) {}
+
+    ~MappedDumpReader() override {
+        if (data != nullptr) {
+            release();
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+
+    bool open() {
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            std::cerr << "Error: Unable to open dump file " << filename << ": " << std::strerror(errno) << std::endl;
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return false;
+        }
+        size = static_cast<size_t>(info.st_size);
+        if (size > 0) {
+            void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                std::cerr << "Error: Unable to map dump file " << filename << ": " << std::strerror(errno) << std::endl;
+                ::close(fd);
+                return false;
+            }
+            data = static_cast<const char*>(mapping);
+            if (!guard()) {
+                std::cerr << "Error: Too many dumps mapped at once to map " << filename << std::endl;
+                ::close(fd);
+                return false;
+            }
+            // Read ahead aggressively and let pages go once they are behind the reader
+            madvise(mapping, size, MADV_SEQUENTIAL);
+        }
+        ::close(fd);
+        return true;
+    }
+
+    long read(char* buffer, size_t count) override {
+        if (truncated()) {
+            return -1;
+        }
+        count = std::min(count, size - offset);
+        if (count == 0) {
+            return 0;
+        }
+        std::memcpy(buffer, data + offset, count);
+        offset += count;
+        totalCopied += count;
+        return static_cast<long>(count);
+    }
+
+    uint64_t bytesCopied() const override {
+        return totalCopied;
+    }
+
+    long borrow(const char*& out) override {
+        if (truncated()) {
+            return -1;
+        }
+        size_t count = std::min(MAPPED_CHUNK_BYTES, size - offset);
+        out = data + offset;
+        offset += count;
+        return static_cast<long>(count);
+    }
+
+    bool rewind() override {
+        offset = 0;
+        return true;
+    }
+
+    bool seek(uint64_t position, const GzipAccessPoint& point) override {
+        (void)point;
+        if (position > size) {
+            return false;
+        }
+        offset = static_cast<size_t>(position);
+        return true;
+    }
+
+private:
+    static inline GuardedRange guarded[64];
+    static inline size_t pageSize = 0;
+
+    std::string filename;
+    const char* data = nullptr;
+    size_t size = 0;
+    size_t offset = 0;
+    uint64_t totalCopied = 0;
+    GuardedRange* range = nullptr;
+
+    // Replacing the missing pages lets the faulting read go on; a fault outside every mapping gets
+    // the default action once the handler returns. POSIX does not list mmap as async-signal-safe,
+    // this relies on Linux, where it is a plain system call and safe to make from a handler.
+    static void onBusError(int signal, siginfo_t* info, void* context) {
+        (void)context;
+        const char* address = static_cast<const char*>(info->si_addr);
+        for (auto& slot : guarded) {
+            const char* start = slot.start;
+            size_t length = slot.size;
+            if (start != nullptr && address >= start && address < start + length) {
+                char* from = const_cast<char*>(start) + (address - start) / pageSize * pageSize;
+                if (mmap(from, start + length - from, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+                    slot.truncated = true;
+                    return;
+                }
+            }
+        }
+        std::signal(signal, SIG_DFL);
+    }
+
+    bool guard() {
+        static std::once_flag installed;
+        std::call_once(installed, [] {
+            pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            struct sigaction action = {};
+            action.sa_sigaction = onBusError;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGBUS, &action, nullptr);
+        });
+        for (auto& slot : guarded) {
+            bool expected = false;
+            if (slot.claimed.compare_exchange_strong(expected, true)) {
+                slot.truncated = false;
+                slot.size = size;
+                slot.start = data;
+                range = &slot;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void release() {
+        if (range) {
+            range->start = nullptr;
+            range->size = 0;
+            range->claimed = false;
+            range = nullptr;
+        }
+    }
+
+    bool truncated() const {
+        if (range && range->truncated) {
+            std::cerr << "Error: Dump file " << filename << " was truncated while it was being read" << std::endl;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Replays data an earlier stage already decompressed, then continues from the source.
+// The data is either held in prefix or, when there was too much of it, in a spill file,
+// which the reader closes once it has been replayed.
+class PrefixedDumpReader : public DumpReader {
+public:
+    PrefixedDumpReader(std::string prefix, DumpReader& source, std::FILE* spill = nullptr)
+        : prefix(std::move(prefix)), source(source), spill(spill) {}
+
+    ~PrefixedDumpReader() override {
+        closeSpill();
+    }
+
+    long read(char* buffer, size_t size) override {
+        if (spill) {
+            size_t count = std::fread(buffer, 1, size, spill);
+            if (count > 0) {
+                totalCopied += count;
+                return static_cast<long>(count);
+            }
+            if (std::ferror(spill)) {
+                std::cerr << "Error: Failed to read back the spilled start of the dump" << std::endl;
+                return -1;
+            }
+            closeSpill();
+        }
+        if (offset < prefix.size()) {
+            size_t count = std::min(size, prefix.size() - offset);
+            std::memcpy(buffer, prefix.data() + offset, count);
+            offset += count;
+            totalCopied += count;
+            if (offset == prefix.size()) {
+                // Release the buffered data as soon as it has been replayed
+                std::string().swap(prefix);
+                offset = 0;
+            }
+            return static_cast<long>(count);
+        }
+        return source.read(buffer, size);
+    }
+
+    uint64_t bytesCopied() const override {
+        return totalCopied + source.bytesCopied();
+    }
+
+    double inflateSeconds() const override {
+        return source.inflateSeconds();
+    }
+
+    long borrow(const char*& data) override {
+        if (spill) {
+            return DumpReader::borrow(data);
+        }
+        if (offset < prefix.size()) {
+            data = prefix.data() + offset;
+            long count = static_cast<long>(prefix.size() - offset);
+            offset = prefix.size();
+            return count;
+        }
+        // Released only now, the caller was still using it until this call
+        if (!prefix.empty()) {
+            std::string().swap(prefix);
+            offset = 0;
+        }
+        return source.borrow(data);
+    }
+
+    bool rewind() override {
+        std::string().swap(prefix);
+        offset = 0;
+        closeSpill();
+        return source.rewind();
+    }
+
+    // The prefix is the start of the source, so offsets are the same in both
+    GzipAccessPoint accessPointBefore(uint64_t position) override {
+        return source.accessPointBefore(position);
+    }
+
+    bool seek(uint64_t position, const GzipAccessPoint& point) override {
+        std::string().swap(prefix);
+        offset = 0;
+        closeSpill();
+        return source.seek(position, point);
+    }
+
+private:
+    std::string prefix;
+    size_t offset = 0;
+    uint64_t totalCopied = 0;
+    DumpReader& source;
+    std::FILE* spill;
+
+    void closeSpill() {
+        if (spill) {
+            std::fclose(spill);
+            spill = nullptr;
+        }
+    }
+};
+
+// Decompresses on a thread of its own while the caller parses and loads what came before.
+// Data moves through a fixed pool of buffers, so the decompressor stops once it is
+// buffers MB ahead of the reader and memory stays bounded. Statements and markers running
+// across buffers are not its concern, the splitter and the identity scan carry them over.
+class ReadAheadDumpReader : public DumpReader {
+public:
+    ReadAheadDumpReader(std::unique_ptr<DumpReader> source, size_t buffers)
+        : source(std::move(source)), pool(std::max<size_t>(buffers, 2)) {
+        for (auto& block : pool) {
+            block.data.resize(BUFFER_SIZE);
+        }
+    }
+
+    ~ReadAheadDumpReader() override {
+        stop();
+    }
+
+    void start() {
+        for (auto& block : pool) {
+            freeBlocks.push_back(&block);
+        }
+        thread = std::thread(&ReadAheadDumpReader::run, this);
+    }
+
+    long read(char* buffer, size_t size) override {
+        size_t copied = 0;
+        while (copied < size) {
+            if (current == nullptr) {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return !filled.empty() || finished; });
+                if (filled.empty()) {
+                    return copied > 0 ? static_cast<long>(copied) : result;
+                }
+                current = filled.front();
+                filled.pop_front();
+                currentOffset = 0;
+            }
+            size_t count = std::min(size - copied, current->size - currentOffset);
+            std::memcpy(buffer + copied, current->data.data() + currentOffset, count);
+            copied += count;
+            currentOffset += count;
+            totalCopied += count;
+            if (currentOffset == current->size) {
+                std::lock_guard<std::mutex> lock(mutex);
+                freeBlocks.push_back(current);
+                current = nullptr;
+                changed.notify_all();
+            }
+        }
+        return static_cast<long>(copied);
+    }
+
+    bool rewind() override {
+        stop();
+        bool ok = source->rewind();
+        start();
+        return ok;
+    }
+
+    // Asked once the dump has been read, when the decompressor no longer reads the source
+    uint64_t bytesCopied() const override {
+        return totalCopied + source->bytesCopied();
+    }
+
+    double inflateSeconds() const override {
+        return source->inflateSeconds();
+    }
+
+    GzipAccessPoint accessPointBefore(uint64_t offset) override {
+        std::lock_guard<std::mutex> lock(sourceMutex);
+        return source->accessPointBefore(offset);
+    }
+
+    bool seek(uint64_t offset, const GzipAccessPoint& point) override {
+        stop();
+        bool ok = source->seek(offset, point);
+        start();
+        return ok;
+    }
+
+private:
+    struct Block {
+        std::vector<char> data;
+        size_t size = 0;
+    };
+
+    std::unique_ptr<DumpReader> source;
+    std::vector<Block> pool;
+    std::vector<Block*> freeBlocks;
+    std::deque<Block*> filled;       // in dump order
+    Block* current = nullptr;        // being copied out by read
+    size_t currentOffset = 0;
+    uint64_t totalCopied = 0;
+    bool finished = false;
+    bool stopping = false;
+    long result = 0;                 // what read returns once the source is done, 0 or -1
+    std::thread thread;
+    std::mutex mutex;
+    std::mutex sourceMutex;          // the source is not safe to call from two threads
+    std::condition_variable changed;
+
+    void run() {
+        while (true) {
+            Block* block;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return stopping || !freeBlocks.empty(); });
+                if (stopping) {
+                    return;
+                }
+                block = freeBlocks.back();
+                freeBlocks.pop_back();
+            }
+            long bytesRead;
+            {
+                std::lock_guard<std::mutex> sourceLock(sourceMutex);
+                bytesRead = source->read(block->data.data(), block->data.size());
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (bytesRead <= 0) {
+                freeBlocks.push_back(block);
+                finished = true;
+                result = bytesRead;
+                changed.notify_all();
+                return;
+            }
+            block->size = static_cast<size_t>(bytesRead);
+            filled.push_back(block);
+            changed.notify_all();
+        }
+    }
+
+    // Ends the decompressor and forgets everything it read ahead
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            changed.notify_all();
+        }
+        if (thread.joinable()) {
+            thread.join();
+        }
+        freeBlocks.clear();
+        filled.clear();
+        current = nullptr;
+        finished = false;
+        stopping = false;
+        result = 0;
+    }
+};
+
+bool isCompressedDump(const fs::path& path) {
+    std::string extension = path.extension().string();
+    return extension == ".gz" || extension == ".zst" || extension == ".xz" || extension == ".bz2";
+}
+
+// Tar and zip files holding several dumps, each one restored on its own
+bool isDumpBundle(const fs::path& path) {
+    std::string name = path.filename().string();
+    auto endsWith = [&](const std::string& suffix) {
+        return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    return endsWith(".tar") || endsWith(".tgz") || endsWith(".zip") || name.find(".tar.") != std::string::npos;
+}
+
+// Files restored as one dump: compressed with one of the formats above, or plain SQL
+bool isDumpFile(const fs::path& path) {
+    return !isDumpBundle(path) && (isCompressedDump(path) || path.extension() == ".sql");
+}
+
+// How a dump is named in logs, checkpoints, metrics and the ledger: its path, followed by
+// #entry for a dump inside a bundle, with the entry flattened so the name stays one file name
+std::string dumpLabel(const fs::path& path, const std::string& entry) {
+    if (entry.empty()) {
+        return path.string();
+    }
+    std::string flat = entry;
+    std::replace(flat.begin(), flat.end(), '/', '_');
+    std::replace(flat.begin(), flat.end(), ' ', '_');
+    return path.string() + "#" + flat;
+}
+
+// Copies every dump in a bundle to the spool folder in one pass over the bundle and calls
+// onEntry(entry, spooled file) as soon as each is complete, so it can restore while the pass goes
+// on. An entry keeps the form it has in the bundle, site.sql.gz in a tar stays compressed. Entries
+// wanted turns down are passed over without being written.
+bool unpackBundle(const fs::path& bundle, const fs::path& spool, const std::function<bool(const std::string&)>& wanted,
+                  const std::function<void(const std::string&, const fs::path&)>& onEntry) {
+    std::error_code error;
+    fs::create_directories(spool, error);
+    struct archive* a = archive_read_new();
+    archive_read_support_filter_all(a);
+    archive_read_support_format_all(a);
+    bool ok = archive_read_open_filename(a, bundle.c_str(), BUFFER_SIZE) == ARCHIVE_OK;
+    if (!ok) {
+        std::cerr << "Error: Unable to open dump bundle " << bundle << ": " << archive_error_string(a) << std::endl;
+    }
+    struct archive_entry* header;
+    int status = ARCHIVE_OK;
+    while (ok && (status = archive_read_next_header(a, &header)) == ARCHIVE_OK) {
+        // No name comes back when the archive's one cannot be converted to the current locale
+        const char* name = archive_entry_pathname(header);
+        if (name == nullptr) {
+            std::cerr << "Warning: Skipping an entry without a readable name in dump bundle " << bundle << std::endl;
+            continue;
+        }
+        std::string entry = name;
+        if (archive_entry_filetype(header) != AE_IFREG || !isDumpFile(entry) || (wanted && !wanted(entry))) {
+            continue;
+        }
+        fs::path spooled = spool / dumpLabel(bundle.filename(), entry);
+        std::FILE* out = std::fopen(spooled.c_str(), "wb");
+        if (out == nullptr) {
+            std::cerr << "Error: Unable to write " << spooled << ": " << std::strerror(errno) << std::endl;
+            ok = false;
+            break;
+        }
+        const void* block;
+        size_t size;
+        la_int64_t offset;
+        while ((status = archive_read_data_block(a, &block, &size, &offset)) == ARCHIVE_OK) {
+            if (std::fwrite(block, 1, size, out) != size) {
+                status = ARCHIVE_FATAL;
+                break;
+            }
+        }
+        bool written = std::fclose(out) == 0 && status == ARCHIVE_EOF;
+        if (!written) {
+            std::cerr << "Error: Unable to unpack " << entry << " from dump bundle " << bundle << ": " << archive_error_string(a) << std::endl;
+            fs::remove(spooled, error);
+            ok = false;
+            break;
+        }
+        status = ARCHIVE_OK;
+        onEntry(entry, spooled);
+    }
+    if (ok && status != ARCHIVE_EOF) {
+        std::cerr << "Error: Unable to read dump bundle " << bundle << ": " << archive_error_string(a) << std::endl;
+        ok = false;
+    }
+    archive_read_close(a);
+    archive_read_free(a);
+    return ok;
+}
+
+// Opens the fastest reader available for a dump.
+// A gzip dump with a saved or quickly built index is inflated on DECOMPRESS_THREADS threads;
+// otherwise it is read on one thread and indexed on the way for the next time.
+std::unique_ptr<DumpReader> openDumpReader(const std::string& filename)
+{
+    // Sequential readers decompress on their own thread, READ_AHEAD_MB=0 keeps them on the caller's
+    size_t readAhead = std::stoul(getEnvOrDefault("READ_AHEAD_MB", "8"));
+    auto readingAhead = [&](std::unique_ptr<DumpReader> reader) -> std::unique_ptr<DumpReader> {
+        if (readAhead == 0) {
+            return reader;
+        }
+        auto ahead = std::make_unique<ReadAheadDumpReader>(std::move(reader), readAhead);
+        ahead->start();
+        return ahead;
+    };
+
+    // Nothing to decompress, and a thread copying ahead would only add a copy
+    if (fs::path(filename).extension() == ".sql") {
+        auto reader = std::make_unique<MappedDumpReader>(filename);
+        if (!reader->open()) {
+            return nullptr;
+        }
+        return reader;
+    }
+
+    if (fs::path(filename).extension() != ".gz") {
+        auto reader = std::make_unique<ArchiveDumpReader>(filename);
+        if (!reader->open()) {
+            return nullptr;
+        }
+        return readingAhead(std::move(reader));
+    }
+
+    size_t threads = std::stoul(getEnvOrDefault("DECOMPRESS_THREADS", "4"));
+    GzipIndex index;
+    if (threads > 1 && (index.load(filename) || index.buildFromBgzf(filename)) && index.points.size() > 1) {
+        std::cout << "Inflating " << filename << " on " << threads << " threads from " << index.points.size() << " access points" << std::endl;
+        auto reader = std::make_unique<ParallelGzipReader>(filename, std::move(index), threads);
+        reader->open();
+        return reader;
+    }
+
+    auto reader = std::make_unique<GzipDumpReader>(filename);
+    if (!reader->open()) {
+        return nullptr;
+    }
+    return readingAhead(std::move(reader));
+}
+
+const int64_t MANIFEST_CHUNK_KEYS = 10000; // primary key values per hashed chunk in the restore manifest
+
+// Spreads a row hash over all bits so row hashes can be summed without cancelling out
+uint64_t mixHash(uint64_t hash) {
+    hash += 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+// Calls onRow(std::string_view row, std::string_view key) for every tuple of INSERT values,
+// row being "(...)" and key the text of field keyIndex. Returns false if the values do not parse.
+template <typename Callback>
+bool forEachInsertRow(std::string_view values, size_t keyIndex, Callback onRow) {
+    std::string_view key;
+    return forEachInsertValue<false>(values,
+        [&](size_t field, InsertValueKind, std::string_view, std::string_view literal) {
+            if (field == keyIndex) {
+                key = literal;
+            }
+            return true;
+        },
+        [&](size_t, std::string_view row) {
+            bool keep = onRow(row, key);
+            key = std::string_view();
+            return keep;
+        });
+}
+
+// Position of `name` in a column list such as "(`a`,`b`)"
+size_t columnPosition(std::string_view columns, const std::string& name) {
+    size_t index = 0;
+    size_t pos = 0;
+    while ((pos = columns.find('`', pos)) != std::string_view::npos) {
+        size_t end = columns.find('`', pos + 1);
+        if (end == std::string_view::npos) {
+            break;
+        }
+        if (columns.substr(pos + 1, end - pos - 1) == name) {
+            return index;
+        }
+        index++;
+        pos = end + 1;
+    }
+    return SIZE_MAX;
+}
+
+// Content hashes of one table in a dump
+struct TableManifest {
+    uint64_t schemaHash = 0;              // hash of the CREATE TABLE statement
+    std::string keyColumn = "-";          // single integer primary key the chunks are cut on, "-" if none
+    size_t keyIndex = SIZE_MAX;           // position of keyColumn in the CREATE TABLE
+    uint64_t rows = 0;
+    uint64_t contentHash = 0;             // sum of the row hashes
+    std::map<int64_t, uint64_t> chunks;   // key / MANIFEST_CHUNK_KEYS -> sum of the row hashes in that range
+};
+
+// Per site record of what was last restored, kept in MANIFEST_FOLDER/<database>.manifest
+struct SiteManifest {
+    std::map<std::string, TableManifest> tables;
+
+    static std::string pathFor(const std::string& db_name) {
+        return getEnvOrDefault("MANIFEST_FOLDER", "manifests") + "/" + db_name + ".manifest";
+    }
+
+    bool save(const std::string& path) const {
+        std::error_code error;
+        fs::create_directories(fs::path(path).parent_path(), error);
+        std::ostringstream out;
+        out << "MANIFEST1\n";
+        for (const auto& entry : tables) {
+            const TableManifest& table = entry.second;
+            out << "table " << entry.first << " " << table.schemaHash << " " << table.keyColumn << " "
+                << table.rows << " " << table.contentHash << " " << table.chunks.size() << "\n";
+            for (const auto& chunk : table.chunks) {
+                out << chunk.first << " " << chunk.second << "\n";
+            }
+        }
+        return writeFileAtomically(path, out.str());
+    }
+
+    bool load(const std::string& path) {
+        std::ifstream in(path);
+        std::string magic;
+        if (!in || !std::getline(in, magic) || magic != "MANIFEST1") {
+            return false;
+        }
+        std::string word;
+        while (in >> word) {
+            std::string name;
+            TableManifest table;
+            size_t chunkCount = 0;
+            if (word != "table" || !(in >> name >> table.schemaHash >> table.keyColumn >> table.rows >> table.contentHash >> chunkCount)) {
+                return false;
+            }
+            for (size_t i = 0; i < chunkCount; ++i) {
+                int64_t chunk;
+                uint64_t hash;
+                if (!(in >> chunk >> hash)) {
+                    return false;
+                }
+                table.chunks[chunk] = hash;
+            }
+            tables[name] = std::move(table);
+        }
+        return true;
+    }
+};
+
+// Builds the manifest of a dump from its CREATE TABLE and INSERT statements
+class ManifestBuilder {
+public:
+    SiteManifest manifest;
+
+    void take(std::string_view sql) {
+        size_t pos = sql.find_first_not_of(" \t\r\n");
+        if (pos == std::string_view::npos) {
+            return;
+        }
+        InsertStatementParts parts;
+        if (sql.compare(pos, 6, "INSERT") == 0 && splitInsertStatement(sql, parts)) {
+            addRows(parts);
+        } else if (sql.compare(pos, 12, "CREATE TABLE") == 0) {
+            addTable(sql);
+        }
+    }
+
+    // Position of the chunk key in the values of an INSERT, SIZE_MAX if the table is not chunked
+    static size_t keyIndexFor(const TableManifest& table, const InsertStatementParts& parts) {
+        if (table.keyIndex == SIZE_MAX || parts.columns.empty()) {
+            return table.keyIndex;
+        }
+        return columnPosition(parts.columns, table.keyColumn);
+    }
+
+    static bool chunkOf(std::string_view key, int64_t& chunk) {
+        std::string text(key);
+        char* end = nullptr;
+        long long value = std::strtoll(text.c_str(), &end, 10);
+        if (text.empty() || *end != '\0') {
+            return false;
+        }
+        chunk = value >= 0 ? value / MANIFEST_CHUNK_KEYS : (value + 1) / MANIFEST_CHUNK_KEYS - 1;
+        return true;
+    }
+
+private:
+    void addTable(std::string_view sql) {
+        DumpStatement statement = classifyStatement(sql, false);
+        TableManifest& table = manifest.tables[statement.table];
+        table = TableManifest();
+        table.schemaHash = hashBytes(sql);
+        table.keyColumn = "-";
+
+        size_t bodyStart = 0;
+        size_t bodyEnd = 0;
+        std::vector<std::string> items;
+        if (!splitCreateDefinitions(statement.sql, bodyStart, bodyEnd, items)) {
+            return;
+        }
+        std::vector<std::string> columns;
+        std::vector<std::string> types;
+        std::string primaryKey;
+        for (const auto& item : items) {
+            size_t pos = item.find_first_not_of(" \t\r\n");
+            if (pos == std::string::npos) {
+                continue;
+            }
+            if (item[pos] == '`') {
+                size_t end = item.find('`', pos + 1);
+                columns.push_back(item.substr(pos + 1, end - pos - 1));
+                types.push_back(item.substr(item.find_first_not_of(' ', end + 1)));
+            } else if (startsWithWord(item, pos, "PRIMARY KEY")) {
+                primaryKey = item.substr(pos);
+            }
+        }
+        // Chunking needs a primary key on one integer column
+        size_t open = primaryKey.find('(');
+        if (open == std::string::npos || primaryKey.find(',', open) != std::string::npos) {
+            return;
+        }
+        std::string keyColumn = extractQuotedName(primaryKey, open);
+        for (size_t i = 0; i < columns.size(); ++i) {
+            const std::string& type = types[i];
+            bool integer = startsWithWord(type, 0, "int") || startsWithWord(type, 0, "bigint") || startsWithWord(type, 0, "smallint") ||
+                           startsWithWord(type, 0, "mediumint") || startsWithWord(type, 0, "tinyint");
+            if (columns[i] == keyColumn && integer) {
+                table.keyColumn = keyColumn;
+                table.keyIndex = i;
+            }
+        }
+    }
+
+    void addRows(const InsertStatementParts& parts) {
+        TableManifest& table = manifest.tables[std::string(parts.table)];
+        size_t keyIndex = keyIndexFor(table, parts);
+        bool parsed = forEachInsertRow(parts.values, keyIndex, [&](std::string_view row, std::string_view key) {
+            uint64_t hash = mixHash(hashBytes(row));
+            table.rows++;
+            table.contentHash += hash;
+            int64_t chunk;
+            if (table.keyIndex != SIZE_MAX) {
+                if (!chunkOf(key, chunk)) {
+                    return false;
+                }
+                table.chunks[chunk] += hash;
+            }
+            return true;
+        });
+        if (!parsed) {
+            // Keep only the table level hash, the table is reloaded in full when it changes
+            table.contentHash += mixHash(hashBytes(parts.values));
+            table.keyColumn = "-";
+            table.keyIndex = SIZE_MAX;
+            table.chunks.clear();
+        }
+    }
+};
+
+// What an incremental restore does with each table of the dump
+struct IncrementalTable {
+    enum Action { Reload, Skip, Chunks } action = Reload;
+    std::string keyColumn;
+    size_t keyIndex = SIZE_MAX;
+    std::set<int64_t> changedChunks;
+    bool started = false;
+};
+
+// Compares the manifest of the new dump with the one saved by the last restore
+// and rewrites the dump's statements so only changed tables and chunks are written.
+class IncrementalRestorePlan {
+public:
+    size_t skipped = 0;
+    size_t chunked = 0;
+    size_t reloaded = 0;
+
+    IncrementalRestorePlan(const SiteManifest& previous, const SiteManifest& current) {
+        for (const auto& entry : current.tables) {
+            const TableManifest& now = entry.second;
+            IncrementalTable& table = tables[entry.first];
+            auto it = previous.tables.find(entry.first);
+            if (it == previous.tables.end() || it->second.schemaHash != now.schemaHash) {
+                table.action = IncrementalTable::Reload;
+            } else if (it->second.rows == now.rows && it->second.contentHash == now.contentHash) {
+                table.action = IncrementalTable::Skip;
+            } else if (now.keyIndex != SIZE_MAX && it->second.keyColumn == now.keyColumn) {
+                for (const auto& chunk : now.chunks) {
+                    auto old = it->second.chunks.find(chunk.first);
+                    if (old == it->second.chunks.end() || old->second != chunk.second) {
+                        table.changedChunks.insert(chunk.first);
+                    }
+                }
+                for (const auto& chunk : it->second.chunks) {
+                    if (now.chunks.count(chunk.first) == 0) {
+                        table.changedChunks.insert(chunk.first);
+                    }
+                }
+                // Past half the chunks a reload is cheaper than deleting and inserting ranges
+                size_t total = std::max(now.chunks.size(), it->second.chunks.size());
+                table.action = table.changedChunks.size() * 2 > total ? IncrementalTable::Reload : IncrementalTable::Chunks;
+                table.keyColumn = now.keyColumn;
+                table.keyIndex = now.keyIndex;
+            }
+            skipped += table.action == IncrementalTable::Skip;
+            chunked += table.action == IncrementalTable::Chunks;
+            reloaded += table.action == IncrementalTable::Reload;
+        }
+    }
+
+    // Replaces statement with the statements to run for it, which may be none
+    void rewrite(DumpStatement statement, std::vector<DumpStatement>& out) {
+        auto it = tables.find(statement.table);
+        if (statement.kind != StatementKind::Table || it == tables.end() || it->second.action == IncrementalTable::Reload) {
+            out.push_back(std::move(statement));
+            return;
+        }
+        IncrementalTable& table = it->second;
+        if (table.action == IncrementalTable::Skip) {
+            return;
+        }
+
+        // The table is kept, the first statement for it clears the changed key ranges
+        if (!table.started) {
+            table.started = true;
+            auto chunk = table.changedChunks.begin();
+            while (chunk != table.changedChunks.end()) {
+                int64_t first = *chunk;
+                int64_t last = first;
+                while (++chunk != table.changedChunks.end() && *chunk == last + 1) {
+                    last = *chunk;
+                }
+                DumpStatement clear;
+                clear.kind = StatementKind::Table;
+                clear.table = statement.table;
+                clear.sql = "DELETE FROM `" + statement.table + "` WHERE `" + table.keyColumn + "` >= " +
+                            std::to_string(first * MANIFEST_CHUNK_KEYS) + " AND `" + table.keyColumn + "` < " +
+                            std::to_string((last + 1) * MANIFEST_CHUNK_KEYS);
+                out.push_back(std::move(clear));
+            }
+        }
+
+        InsertStatementParts parts;
+        if (!splitInsertStatement(statement.sql, parts)) {
+            return;  // DROP / CREATE / ALTER ... KEYS of a kept table
+        }
+        TableManifest keys;
+        keys.keyColumn = table.keyColumn;
+        keys.keyIndex = table.keyIndex;
+        size_t keyIndex = ManifestBuilder::keyIndexFor(keys, parts);
+
+        std::string sql(statement.sql.data(), parts.values.data() - statement.sql.data());
+        size_t prefixSize = sql.size();
+        forEachInsertRow(parts.values, keyIndex, [&](std::string_view row, std::string_view key) {
+            int64_t chunk;
+            if (ManifestBuilder::chunkOf(key, chunk) && table.changedChunks.count(chunk)) {
+                if (sql.size() > prefixSize) {
+                    sql += ',';
+                }
+                sql.append(row.data(), row.size());
+            }
+            return true;
+        });
+        if (sql.size() > prefixSize) {
+            statement.sql = std::move(sql);
+            out.push_back(std::move(statement));
+        }
+    }
+
+private:
+    std::unordered_map<std::string, IncrementalTable> tables;
+};
+
+// Reads the whole dump once to build its manifest, then rewinds it for the restore. The rows of
+// tables the filter excludes are left out, as they are from a manifest built while restoring.
+bool buildDumpManifest(DumpReader& dump, SiteManifest& manifest, TableFilter& tableFilter) {
+    ManifestBuilder builder;
+    SqlStatementSplitter reader;
+    std::vector<char> buffer(BUFFER_SIZE);
+    long bytesRead;
+    bool ok = true;
+    while (ok && (bytesRead = dump.read(buffer.data(), BUFFER_SIZE)) > 0) {
+        ok = reader.feed(buffer.data(), bytesRead, [&](std::string_view sql, bool insideDelimiter) {
+            InsertStatementParts parts;
+            if (!insideDelimiter &&
+                !(tableFilter.active() && splitInsertStatement(sql, parts) && tableFilter.excluded(std::string(parts.table)))) {
+                builder.take(sql);
+            }
+            return true;
+        });
+    }
+    if (!ok || bytesRead < 0 || !reader.finish() || !dump.rewind()) {
+        return false;
+    }
+    manifest = std::move(builder.manifest);
+    return true;
+}
+
+// Progress of an in-process restore, saved next to the dump as <dump>.ckpt and only used again
+// for a dump with the same dumpFileIdentity. Statements before ordinal are all committed, or are SET statements kept in session to be
+// replayed. Statements after it may be committed too, the ordinal of the last committed
+// statement of each table tells which. Reading resumes at offset, inflating from point.
+struct RestoreCheckpoint {
+    std::string database;
+    std::string dumpIdentity;
+    uint64_t ordinal = 0;
+    uint64_t offset = 0;
+    std::string delimiter = ";";
+    GzipAccessPoint point{0, 0, 0, {}};
+    std::vector<std::string> session;
+    std::unordered_map<std::string, uint64_t> tables;
+    std::vector<DeferredTableIndexes> deferredIndexes;
+
+    static std::string pathFor(const std::string& filename) {
+        return filename + ".ckpt";
+    }
+
+    // Written to a temporary file, synced and renamed, so a crash leaves the old or the new checkpoint
+    bool save(const std::string& filename) const {
+        std::string data("RCKPT2", 6);
+        putString(data, database);
+        putString(data, dumpIdentity);
+        putNumber(data, ordinal);
+        putNumber(data, offset);
+        putString(data, delimiter);
+        putNumber(data, point.input);
+        putNumber(data, point.output);
+        putNumber(data, static_cast<uint64_t>(point.bits));
+        putString(data, std::string(point.window.begin(), point.window.end()));
+        putList(data, session);
+        putNumber(data, tables.size());
+        for (const auto& entry : tables) {
+            putString(data, entry.first);
+            putNumber(data, entry.second);
+        }
+        putNumber(data, deferredIndexes.size());
+        for (const auto& indexes : deferredIndexes) {
+            putString(data, indexes.table);
+            putNumber(data, indexes.dataBytes);
+            putList(data, indexes.keys);
+            putList(data, indexes.separateKeys);
+            putList(data, indexes.foreignKeys);
+            putList(data, indexes.referencedTables);
+        }
+
+        return writeFileAtomically(pathFor(filename), data, true);
+    }
+
+    // Loads the checkpoint of an earlier run of the same dump into the same database
+    bool load(const std::string& filename, const std::string& expectedDatabase) {
+        std::ifstream in(pathFor(filename), std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        size_t pos = 6;
+        if (data.compare(0, 6, "RCKPT2") != 0) {
+            return false;
+        }
+        std::string window;
+        uint64_t bits = 0;
+        uint64_t count = 0;
+        bool ok = getString(data, pos, database) && getString(data, pos, dumpIdentity) && getNumber(data, pos, ordinal) &&
+                  getNumber(data, pos, offset) && getString(data, pos, delimiter) && getNumber(data, pos, point.input) &&
+                  getNumber(data, pos, point.output) && getNumber(data, pos, bits) && getString(data, pos, window) &&
+                  getList(data, pos, session) && getNumber(data, pos, count);
+        for (uint64_t i = 0; ok && i < count; ++i) {
+            std::string table;
+            uint64_t tableOrdinal = 0;
+            ok = getString(data, pos, table) && getNumber(data, pos, tableOrdinal);
+            tables[table] = tableOrdinal;
+        }
+        ok = ok && getNumber(data, pos, count);
+        for (uint64_t i = 0; ok && i < count; ++i) {
+            DeferredTableIndexes indexes;
+            uint64_t dataBytes = 0;
+            ok = getString(data, pos, indexes.table) && getNumber(data, pos, dataBytes) && getList(data, pos, indexes.keys) &&
+                 getList(data, pos, indexes.separateKeys) && getList(data, pos, indexes.foreignKeys) &&
+                 getList(data, pos, indexes.referencedTables);
+            indexes.dataBytes = dataBytes;
+            deferredIndexes.push_back(std::move(indexes));
+        }
+        point.bits = static_cast<int>(bits);
+        point.window.assign(window.begin(), window.end());
+        // A dump replaced by one of the same size, or touched since, starts over
+        return ok && database == expectedDatabase && !dumpIdentity.empty() && dumpIdentity == dumpFileIdentity(filename);
+    }
+
+private:
+    static void putNumber(std::string& data, uint64_t value) {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void putString(std::string& data, const std::string& value) {
+        putNumber(data, value.size());
+        data += value;
+    }
+
+    static void putList(std::string& data, const std::vector<std::string>& values) {
+        putNumber(data, values.size());
+        for (const auto& value : values) {
+            putString(data, value);
+        }
+    }
+
+    static bool getNumber(const std::string& data, size_t& pos, uint64_t& value) {
+        if (data.size() - pos < sizeof(value)) {
+            return false;
+        }
+        std::memcpy(&value, data.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    }
+
+    static bool getString(const std::string& data, size_t& pos, std::string& value) {
+        uint64_t length = 0;
+        if (!getNumber(data, pos, length) || data.size() - pos < length) {
+            return false;
+        }
+        value.assign(data, pos, length);
+        pos += length;
+        return true;
+    }
+
+    static bool getList(const std::string& data, size_t& pos, std::vector<std::string>& values) {
+        uint64_t count = 0;
+        if (!getNumber(data, pos, count)) {
+            return false;
+        }
+        for (uint64_t i = 0; i < count; ++i) {
+            std::string value;
+            if (!getString(data, pos, value)) {
+                return false;
+            }
+            values.push_back(std::move(value));
+        }
+        return true;
+    }
+};
+
+// Shares the concept dictionary between site databases. The statements of the dictionary tables
+// (DICTIONARY_TABLES) are held back in a spool file while they are fingerprinted. Once the dump is
+// read the fingerprint decides where they go:
+//  - a shared database openmrs_dictionary_<fingerprint> already holds that exact dictionary: the
+//    site gets views onto it and nothing is loaded;
+//  - fewer than DICTIONARY_MAX_SHARED shared dictionaries exist: the dictionary is loaded once into a
+//    new shared database, and the site gets views onto it;
+//  - otherwise the dictionary differs from every shared one and the site gets its own copy.
+// The spool is replayed in the session the dump had when the dictionary started, so foreign key
+// and character set settings are the ones mysqldump wrote for it. Views, routines and triggers
+// after the first dictionary statement are held back too and run once the dictionary is in place,
+// since they may select from it. Shared databases no view points at any more are dropped.
+class SharedDictionary {
+public:
+    SharedDictionary(const std::string& patterns, size_t maxShared, const std::string& site)
+        : filter("", patterns), maxShared(maxShared), site(site) {}
+
+    // Called once the site's views are in place, after the sink has finished
+    ~SharedDictionary() {
+        if (spool) {
+            std::fclose(spool);
+        }
+        if (!claimed.empty()) {
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            registry().inUse[claimed]--;
+        }
+    }
+
+    // Keeps track of the session, every SET is needed to replay the dictionary later
+    void remember(const DumpStatement& statement) {
+        if (statement.kind == StatementKind::Session) {
+            session.push_back(statement.sql);
+        }
+    }
+
+    // Holds back a statement of a dictionary table, or a barrier that may depend on one; returns
+    // false for every other statement
+    bool take(const DumpStatement& statement) {
+        if (statement.kind == StatementKind::Barrier && spool) {
+            barriers.emplace_back(session.size(), statement.sql);
+            return true;
+        }
+        if (statement.kind != StatementKind::Table || !filter.excluded(statement.table)) {
+            return false;
+        }
+        if (!spool) {
+            spool = std::tmpfile();
+            if (!spool) {
+                std::cerr << "Warning: Could not create a spool file, the dictionary is restored per site" << std::endl;
+                filter = TableFilter("", "");
+                return false;
+            }
+            sessionAtStart = session.size();
+        }
+        if (std::find(tables.begin(), tables.end(), statement.table) == tables.end()) {
+            tables.push_back(statement.table);
+        }
+        fingerprint = hashBytes(statement.sql, hashBytes(statement.table, fingerprint));
+        uint64_t header[4] = {static_cast<uint64_t>(statement.kind), statement.ordinal, statement.table.size(), statement.sql.size()};
+        if (std::fwrite(header, sizeof(header), 1, spool) != 1 ||
+            std::fwrite(statement.table.data(), 1, statement.table.size(), spool) != statement.table.size() ||
+            std::fwrite(statement.sql.data(), 1, statement.sql.size(), spool) != statement.sql.size()) {
+            spoolFailed = true;
+        }
+        spooledBytes += statement.sql.size();
+        return true;
+    }
+
+    // Called once the dump is read, puts the dictionary in place for the site through the site's
+    // own connections
+    bool finish(ParallelRestoreEngine& sink, StatementBufferPool& buffers) {
+        if (!spool) {
+            return true;
+        }
+        if (spoolFailed) {
+            std::cerr << "Error: Failed to spool the dictionary tables of " << site << std::endl;
+            return false;
+        }
+        char name[40];
+        std::snprintf(name, sizeof(name), "openmrs_dictionary_%016llx", static_cast<unsigned long long>(fingerprint));
+        std::string shared = name;
+
+        // Restores running side by side must not both load the same dictionary. Each dictionary has a
+        // lock of its own, held while it is checked and loaded; the registry lock only covers the
+        // counting and dropping of shared databases.
+        Registry& shares = registry();
+        std::shared_ptr<std::mutex> slot;
+        {
+            std::lock_guard<std::mutex> lock(shares.mutex);
+            std::shared_ptr<std::mutex>& entry = shares.slots[shared];
+            if (!entry) {
+                entry = std::make_shared<std::mutex>();
+            }
+            slot = entry;
+            shares.inUse[shared]++;
+            claimed = shared;
+        }
+        bool useShared = false;
+        {
+            std::lock_guard<std::mutex> slotLock(*slot);
+            bool room = false;
+            bool checked = sink.withConnection([&](MYSQL* conn) {
+                std::string complete = "SELECT COUNT(*) FROM information_schema.tables WHERE table_name = 'dictionary_complete' AND table_schema ";
+                long existing = count(conn, complete + "= '" + shared + "'");
+                if (existing == 0) {
+                    std::lock_guard<std::mutex> lock(shares.mutex);
+                    dropUnreferenced(conn, shares);
+                    long sharedCount = count(conn, complete + "LIKE 'openmrs\\\\_dictionary\\\\_%'");
+                    room = sharedCount >= 0 && static_cast<size_t>(sharedCount) + shares.loading.size() < maxShared;
+                    if (room) {
+                        shares.loading.insert(shared);
+                    }
+                }
+                useShared = existing > 0;
+                return true;
+            });
+            if (!checked) {
+                return false;
+            }
+            if (useShared) {
+                std::cout << "Dictionary of " << site << " matches " << shared << ", skipping " << spooledBytes / (1024.0 * 1024.0) << " MB" << std::endl;
+            } else if (room) {
+                std::cout << "Loading the dictionary of " << site << " into " << shared << std::endl;
+                useShared = loadShared(sink, shared, buffers);
+                std::lock_guard<std::mutex> lock(shares.mutex);
+                shares.loading.erase(shared);
+            } else {
+                std::cout << "Dictionary of " << site << " differs from the shared ones, restoring a copy of its own" << std::endl;
+            }
+            if (room && !useShared) {
+                return false;
+            }
+        }
+
+        // The dump has restored its session by now; go back to the one the dictionary was written in,
+        // where mysqldump turned foreign key checks off, so tables the rest of the site references can be dropped
+        if (!submitSession(sink, buffers, 0, sessionAtStart)) {
+            return false;
+        }
+        // Barriers run once everything queued before them has finished
+        for (const auto& table : tables) {
+            std::string view = useShared ? "DROP TABLE IF EXISTS `" + table + "`" : "DROP VIEW IF EXISTS `" + table + "`";
+            if (!sink.submit(statementOf(StatementKind::Barrier, view, buffers))) {
+                return false;
+            }
+            if (useShared &&
+                !sink.submit(statementOf(StatementKind::Barrier, "CREATE OR REPLACE VIEW `" + table + "` AS SELECT * FROM `" + shared + "`.`" + table + "`", buffers))) {
+                return false;
+            }
+        }
+        if (!useShared && !replay(sink, buffers)) {
+            return false;
+        }
+        // Then what was held back for the dictionary, each in the session the dump had for it
+        size_t replayed = sessionAtStart;
+        for (const auto& barrier : barriers) {
+            if (!submitSession(sink, buffers, replayed, barrier.first) ||
+                !sink.submit(statementOf(StatementKind::Barrier, barrier.second, buffers))) {
+                return false;
+            }
+            replayed = std::max(replayed, barrier.first);
+        }
+        return submitSession(sink, buffers, replayed, session.size());
+    }
+
+private:
+    // Shared databases restores of this process are loading or attaching to, which must not be
+    // dropped or counted out meanwhile, and the lock each one is loaded under
+    struct Registry {
+        std::mutex mutex;
+        std::map<std::string, std::shared_ptr<std::mutex>> slots;
+        std::map<std::string, size_t> inUse;
+        std::set<std::string> loading;
+    };
+
+    static Registry& registry() {
+        static Registry shares;
+        return shares;
+    }
+
+    TableFilter filter;   // matches the dictionary tables
+    size_t maxShared;
+    std::string site;
+    std::vector<std::string> session;
+    size_t sessionAtStart = 0;
+    std::vector<std::string> tables;
+    std::vector<std::pair<size_t, std::string>> barriers;  // held back, with the session size they came at
+    std::string claimed;                                   // the shared database this restore counts as in use
+    std::FILE* spool = nullptr;
+    bool spoolFailed = false;
+    size_t spooledBytes = 0;
+    uint64_t fingerprint = FNV_OFFSET_BASIS;
+
+    static DumpStatement statementOf(StatementKind kind, const std::string& sql, StatementBufferPool& buffers) {
+        DumpStatement statement;
+        statement.kind = kind;
+        buffers.assign(statement.sql, sql);
+        return statement;
+    }
+
+    static long count(MYSQL* conn, const std::string& query) {
+        if (mysql_query(conn, query.c_str()) != 0) {
+            std::cerr << "Error: " << mysql_error(conn) << std::endl;
+            return -1;
+        }
+        MYSQL_RES* result = mysql_store_result(conn);
+        MYSQL_ROW row = result ? mysql_fetch_row(result) : NULL;
+        long value = row && row[0] ? std::atol(row[0]) : -1;
+        if (result) {
+            mysql_free_result(result);
+        }
+        return value;
+    }
+
+    static std::vector<std::string> column(MYSQL* conn, const std::string& query) {
+        std::vector<std::string> values;
+        if (mysql_query(conn, query.c_str()) != 0) {
+            std::cerr << "Error: " << mysql_error(conn) << std::endl;
+            return values;
+        }
+        MYSQL_RES* result = mysql_store_result(conn);
+        MYSQL_ROW row;
+        while (result && (row = mysql_fetch_row(result)) != NULL) {
+            values.push_back(row[0] ? row[0] : "");
+        }
+        if (result) {
+            mysql_free_result(result);
+        }
+        return values;
+    }
+
+    // Drops the shared databases no restore of this process is using and no view outside them
+    // selects from, so versions every site has moved on from do not stay forever. Called with
+    // the registry locked.
+    static void dropUnreferenced(MYSQL* conn, Registry& shares) {
+        for (const auto& database : column(conn, "SELECT schema_name FROM information_schema.schemata WHERE schema_name LIKE 'openmrs\\\\_dictionary\\\\_%'")) {
+            if (shares.inUse[database] > 0 || shares.loading.count(database)) {
+                continue;
+            }
+            long views = count(conn, "SELECT COUNT(*) FROM information_schema.views WHERE table_schema <> '" + database +
+                                         "' AND view_definition LIKE '%`" + database + "`%'");
+            if (views != 0) {
+                continue;
+            }
+            std::string drop = "DROP DATABASE `" + database + "`";
+            if (mysql_query(conn, drop.c_str()) == 0) {
+                std::cout << "Dropped " << database << ", no site uses that dictionary any more" << std::endl;
+            } else {
+                std::cerr << "Warning: Could not drop " << database << ": " << mysql_error(conn) << std::endl;
+            }
+        }
+    }
+
+    bool submitSession(StatementSink& sink, StatementBufferPool& buffers, size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i) {
+            if (!sink.submit(statementOf(StatementKind::Session, session[i], buffers))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Sends the spooled statements in dump order
+    bool replay(StatementSink& sink, StatementBufferPool& buffers) {
+        std::rewind(spool);
+        uint64_t header[4];
+        while (std::fread(header, sizeof(header), 1, spool) == 1) {
+            DumpStatement statement;
+            statement.kind = static_cast<StatementKind>(header[0]);
+            statement.ordinal = header[1];
+            statement.table.resize(header[2]);
+            std::string sql(header[3], '\0');
+            if (std::fread(&statement.table[0], 1, header[2], spool) != header[2] || std::fread(&sql[0], 1, header[3], spool) != header[3]) {
+                std::cerr << "Error: Failed to read back the dictionary spool of " << site << std::endl;
+                return false;
+            }
+            buffers.assign(statement.sql, sql);
+            if (!sink.submit(std::move(statement))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Loads the spool into a new shared database over the site's connections, which switch to it
+    // for the load and back to the site afterwards. It is marked complete only once every table is
+    // in; one a failed load left unmarked is never used and a later restore drops it.
+    bool loadShared(StatementSink& sink, const std::string& shared, StatementBufferPool& buffers) {
+        bool ok = sink.submit(statementOf(StatementKind::Barrier, "CREATE DATABASE IF NOT EXISTS `" + shared + "`", buffers)) &&
+                  submitSession(sink, buffers, 0, sessionAtStart) &&
+                  sink.submit(statementOf(StatementKind::Session, "USE `" + shared + "`", buffers)) &&
+                  replay(sink, buffers) &&
+                  sink.submit(statementOf(StatementKind::Session, "USE `" + site + "`", buffers)) &&
+                  sink.submit(statementOf(StatementKind::Barrier, "CREATE TABLE `" + shared + "`.dictionary_complete (loaded_from VARCHAR(255), loaded_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP)", buffers)) &&
+                  sink.submit(statementOf(StatementKind::Barrier, "INSERT INTO `" + shared + "`.dictionary_complete (loaded_from) VALUES ('" + site + "')", buffers));
+        if (!ok) {
+            std::cerr << "Error: Could not load the shared dictionary " << shared << std::endl;
+        }
+        return ok;
+    }
+};
+
+// Column added to every table of the consolidated layout, holding the site database name
+const char* const CONSOLIDATED_SITE_COLUMN = "site_key";
+
+// Loads every site into one set of tables in CONSOLIDATED_DATABASE, LIST partitioned by site_key.
+// The dump is restored into the site database as usual, which serves as staging: each CREATE TABLE
+// gets the site_key column (defaulting to this site) added to its primary and unique keys, and
+// loses its foreign keys, FULLTEXT and SPATIAL keys, none of which partitioned InnoDB tables allow.
+// INSERTs without a column list get one, so the default fills site_key without touching the rows.
+// Once the load is done each staging table is swapped with the site's partition, which replaces
+// the previous snapshot of the site in one step, and the staging table is dropped.
+class ConsolidatedLoad {
+public:
+    // Partition names are cut to MySQL's 64 characters and lose everything but letters and digits,
+    // so sites that only differ there would share one; the hash of the full name keeps them apart
+    ConsolidatedLoad(const std::string& database, const std::string& site) : database(database), site(site) {
+        partition = "p_" + site.substr(0, 44);
+        for (char& c : partition) {
+            if (!std::isalnum(static_cast<unsigned char>(c))) {
+                c = '_';
+            }
+        }
+        char suffix[20];
+        std::snprintf(suffix, sizeof(suffix), "_%016llx", static_cast<unsigned long long>(hashBytes(site)));
+        partition += suffix;
+    }
+
+    void rewrite(DumpStatement& statement) {
+        if (statement.kind != StatementKind::Table) {
+            return;
+        }
+        size_t pos = statement.sql.find_first_not_of(" \t\r\n");
+        if (startsWithWord(statement.sql, pos, "CREATE TABLE")) {
+            rewriteCreateTable(statement);
+            return;
+        }
+        InsertStatementParts parts;
+        if (!splitInsertStatement(statement.sql, parts) || !parts.columns.empty()) {
+            return;
+        }
+        auto it = columns.find(statement.table);
+        if (it != columns.end()) {
+            size_t at = parts.table.data() + parts.table.size() + 1 - statement.sql.data();
+            statement.sql.insert(at, " " + it->second);
+        }
+    }
+
+    // Swaps every staging table of the site into its partition, creating the consolidated table
+    // or the partition the first time. Every table is checked against the consolidated one before
+    // anything is swapped, and when a swap fails the tables already swapped are swapped back, so
+    // the site's partitions hold either the new snapshot or the previous one, never a mix. The
+    // staging tables only go once all swaps succeeded. A table whose definition no longer matches
+    // the consolidated one fails the same way on every retry, schemaMismatch() tells the caller.
+    bool exchange(const std::string& host, const std::string& user, const std::string& password, unsigned int port, const std::string& staging) {
+        // Restores running side by side change the same consolidated tables
+        static std::mutex consolidatedMutex;
+        std::lock_guard<std::mutex> lock(consolidatedMutex);
+        MYSQL* conn = mysql_init(NULL);
+        if (conn == NULL || !mysql_real_connect(conn, host.c_str(), user.c_str(), password.c_str(), NULL, port, NULL, 0)) {
+            std::cerr << "Failed to connect to MySQL server: " << (conn ? mysql_error(conn) : "out of memory") << std::endl;
+            if (conn) {
+                mysql_close(conn);
+            }
+            return false;
+        }
+
+        auto run = [&](const std::string& query) {
+            if (mysql_query(conn, query.c_str()) != 0) {
+                std::cerr << "Error: " << query.substr(0, 200) << ": " << mysql_error(conn) << std::endl;
+                return false;
+            }
+            return true;
+        };
+        auto value = [&](const std::string& query) {
+            std::string text;
+            if (mysql_query(conn, query.c_str()) != 0) {
+                return text;
+            }
+            MYSQL_RES* result = mysql_store_result(conn);
+            MYSQL_ROW row = result ? mysql_fetch_row(result) : NULL;
+            if (row && row[0]) {
+                text = row[0];
+            }
+            if (result) {
+                mysql_free_result(result);
+            }
+            return text;
+        };
+        auto exists = [&](const std::string& query) {
+            return std::atol(value(query).c_str()) > 0;
+        };
+        // Columns and keys that only one of the two tables has, EXCHANGE PARTITION needs them identical
+        auto differs = [&](const std::string& table) {
+            std::string where = "WHERE table_schema IN ('" + database + "', '" + staging + "') AND table_name = '" + table + "' ";
+            return exists("SELECT COUNT(*) FROM (SELECT 1 FROM information_schema.columns " + where +
+                          "GROUP BY column_name, ordinal_position, column_type, is_nullable, collation_name HAVING COUNT(*) = 1) d") ||
+                   exists("SELECT COUNT(*) FROM (SELECT 1 FROM information_schema.statistics " + where +
+                          "GROUP BY index_name, seq_in_index, column_name, non_unique, sub_part HAVING COUNT(*) = 1) d");
+        };
+
+        bool ok = run("CREATE DATABASE IF NOT EXISTS `" + database + "`");
+        // Tables ready to swap, with the site's partition; one added before partition names
+        // carried a hash keeps its name
+        std::vector<std::pair<std::string, std::string>> checked;
+        for (const auto& table : tables) {
+            if (!ok) {
+                break;
+            }
+            std::string target = "`" + database + "`.`" + table + "`";
+            std::string source = "`" + staging + "`.`" + table + "`";
+            std::string values = "VALUES IN ('" + site + "')";
+            std::string name = partition;
+            ok = run("ALTER TABLE " + source + " ALTER COLUMN `" + CONSOLIDATED_SITE_COLUMN + "` DROP DEFAULT");
+            if (ok && !exists("SELECT COUNT(*) FROM information_schema.tables WHERE table_schema = '" + database + "' AND table_name = '" + table + "'")) {
+                ok = run("CREATE TABLE " + target + " LIKE " + source) &&
+                     run("ALTER TABLE " + target + " PARTITION BY LIST COLUMNS(`" + CONSOLIDATED_SITE_COLUMN + "`) (PARTITION " + partition + " " + values + ")");
+            } else if (ok && differs(table)) {
+                std::cerr << "Error: Table " << table << " of " << site << " no longer matches " << target
+                          << ", it stays in " << staging << " until the consolidated table is migrated" << std::endl;
+                mismatch = true;
+                ok = false;
+            } else if (ok) {
+                name = value("SELECT partition_name FROM information_schema.partitions WHERE table_schema = '" + database + "' AND table_name = '" +
+                             table + "' AND partition_description = '''" + site + "'''");
+                if (name.empty()) {
+                    name = partition;
+                    ok = run("ALTER TABLE " + target + " ADD PARTITION (PARTITION " + partition + " " + values + ")");
+                }
+            }
+            if (ok) {
+                checked.emplace_back(table, name);
+            }
+        }
+
+        // Every row carries this site's key, so MySQL need not check them
+        auto swap = [&](const std::pair<std::string, std::string>& table) {
+            return "ALTER TABLE `" + database + "`.`" + table.first + "` EXCHANGE PARTITION `" + table.second + "` WITH TABLE `" + staging + "`.`" +
+                   table.first + "` WITHOUT VALIDATION";
+        };
+        size_t swapped = 0;
+        while (ok && swapped < checked.size()) {
+            if (run(swap(checked[swapped]))) {
+                swapped++;
+            } else {
+                // ER_TABLES_DIFFERENT_METADATA, a difference the check above did not see
+                mismatch = mysql_errno(conn) == 1736;
+                ok = false;
+            }
+        }
+        if (!ok) {
+            while (swapped > 0) {
+                if (!run(swap(checked[--swapped]))) {
+                    std::cerr << "Error: Table " << checked[swapped].first << " of " << site << " keeps the new snapshot, the previous one is in "
+                              << staging << std::endl;
+                }
+            }
+            mysql_close(conn);
+            std::cerr << "Error: " << site << " was not consolidated into " << database << ", its partitions keep the previous snapshot" << std::endl;
+            return false;
+        }
+        // After the swap the staging tables hold the previous snapshot
+        for (const auto& table : checked) {
+            ok = run("DROP TABLE `" + staging + "`.`" + table.first + "`") && ok;
+        }
+        mysql_close(conn);
+        std::cout << "Consolidated " << checked.size() << " tables of " << site << " into " << database << ", partition " << partition << std::endl;
+        return ok;
+    }
+
+    bool schemaMismatch() const {
+        return mismatch;
+    }
+
+private:
+    std::string database;
+    std::string site;
+    std::string partition;
+    std::vector<std::string> tables;                        // in dump order
+    std::unordered_map<std::string, std::string> columns;   // "(`a`,`b`)" per table, without site_key
+    bool mismatch = false;
+
+    // Appends site_key to a key definition such as PRIMARY KEY (`id`) or UNIQUE KEY `u` (`a`,`b`) USING BTREE
+    static std::string withSiteKey(const std::string& definition) {
+        size_t close = definition.rfind(')');
+        if (close == std::string::npos) {
+            return definition;
+        }
+        return definition.substr(0, close) + ",`" + CONSOLIDATED_SITE_COLUMN + "`" + definition.substr(close);
+    }
+
+    void rewriteCreateTable(DumpStatement& statement) {
+        size_t bodyStart = 0;
+        size_t bodyEnd = 0;
+        std::vector<std::string> items;
+        if (!splitCreateDefinitions(statement.sql, bodyStart, bodyEnd, items)) {
+            return;
+        }
+        std::vector<std::string> kept;
+        std::string names;
+        size_t lastColumn = 0;
+        for (const auto& item : items) {
+            size_t pos = item.find_first_not_of(" \t\r\n");
+            std::string definition = pos == std::string::npos ? "" : item.substr(pos);
+            if (!definition.empty() && definition[0] == '`') {
+                names += (names.empty() ? "(" : ",") + definition.substr(0, definition.find('`', 1) + 1);
+                kept.push_back(item);
+                lastColumn = kept.size();
+            } else if (startsWithWord(definition, 0, "PRIMARY KEY") || startsWithWord(definition, 0, "UNIQUE ")) {
+                kept.push_back(item.substr(0, pos) + withSiteKey(definition));
+            } else if (startsWithWord(definition, 0, "CONSTRAINT ") || startsWithWord(definition, 0, "FOREIGN KEY") ||
+                       startsWithWord(definition, 0, "FULLTEXT ") || startsWithWord(definition, 0, "SPATIAL ")) {
+                continue;
+            } else {
+                kept.push_back(item);
+            }
+        }
+        if (names.empty()) {
+            return;
+        }
+        kept.insert(kept.begin() + lastColumn, "\n  `" + std::string(CONSOLIDATED_SITE_COLUMN) + "` varchar(128) NOT NULL DEFAULT '" + site + "'");
+
+        std::string rewritten = statement.sql.substr(0, bodyStart + 1);
+        for (size_t i = 0; i < kept.size(); ++i) {
+            rewritten += (i > 0 ? "," : "") + kept[i];
+        }
+        if (rewritten.back() != '\n') {
+            rewritten += "\n";
+        }
+        rewritten += statement.sql.substr(bodyEnd);
+        statement.sql = std::move(rewritten);
+
+        columns[statement.table] = names + ")";
+        if (std::find(tables.begin(), tables.end(), statement.table) == tables.end()) {
+            tables.push_back(statement.table);
+        }
+    }
+};
+
+// What the dump holds for one table, and what the server had once the restore finished
+struct TableVerification {
+    uint64_t rows = 0;
+    uint64_t checksum = 0;      // sum over the rows of CRC32 of their values joined by '#', NULLs left out
+    std::string columns;        // column list of the INSERTs, empty when they have none
+    bool inserted = false;      // an INSERT of the table was seen
+    bool parsed = true;         // every INSERT of the table could be read
+    bool sameColumns = true;    // every INSERT used the same column list
+    uint64_t restoredRows = 0;
+    uint64_t restoredChecksum = 0;
+    std::string status;         // ok, row_count_mismatch, checksum_mismatch, not_parsed or error
+};
+
+// Counts the rows of every table while the dump streams past, then asks the server for the same
+// numbers once the restore is done. The checksum is what SUM(CRC32(CONCAT_WS('#', col, ...)))
+// returns on the server, so it does not depend on the order rows were loaded in and is
+// computed without reading the dump a second time.
+class RestoreVerifier {
+public:
+    explicit RestoreVerifier(bool checksums) : checksums(checksums) {}
+
+    // Takes a statement as the splitter hands it out, before any rewriting
+    void take(std::string_view sql) {
+        InsertStatementParts parts;
+        if (splitInsertStatement(sql, parts)) {
+            TableVerification& table = tables[std::string(parts.table)];
+            if (!table.inserted) {
+                table.columns = std::string(parts.columns);
+                table.inserted = true;
+            } else if (parts.columns != table.columns) {
+                table.sameColumns = false;
+            }
+            if (!checksums) {
+                // Counting only needs the tuples, not their unescaped values
+                auto countRow = [&](std::string_view, std::string_view) {
+                    table.rows++;
+                    return true;
+                };
+                if (!forEachInsertRow(parts.values, 0, countRow)) {
+                    table.parsed = false;
+                }
+                return;
+            }
+            uLong crc = 0;
+            bool rowHasValue = false;
+            bool ok = forEachInsertValue(parts.values,
+                [&](size_t, InsertValueKind kind, std::string_view value, std::string_view) {
+                    if (kind == InsertValueKind::Null) {
+                        return true;
+                    }
+                    if (rowHasValue) {
+                        crc = crc32(crc, reinterpret_cast<const Bytef*>("#"), 1);
+                    }
+                    crc = crc32(crc, reinterpret_cast<const Bytef*>(value.data()), static_cast<uInt>(value.size()));
+                    rowHasValue = true;
+                    return true;
+                },
+                [&](size_t, std::string_view) {
+                    table.rows++;
+                    table.checksum += crc;
+                    crc = 0;
+                    rowHasValue = false;
+                    return true;
+                });
+            if (!ok) {
+                table.parsed = false;
+            }
+            return;
+        }
+
+        size_t pos = sql.find_first_not_of(" \t\r\n");
+        if (pos == std::string_view::npos) {
+            return;
+        }
+        if (sql.compare(pos, 12, "CREATE TABLE") == 0) {
+            // A table created again starts out empty, and one without INSERTs is expected to stay so
+            std::string name = extractQuotedName(std::string(sql.substr(pos, 256)), 0);
+            if (!name.empty()) {
+                tables[name] = TableVerification();
+            }
+        } else if (sql.size() < 256) {
+            // mysqldump writes TIMESTAMP values in UTC and says so with /*!40103 SET TIME_ZONE='+00:00' */
+            // The dump puts back @OLD_TIME_ZONE at its end, which means nothing to another session
+            size_t zone = sql.find("SET TIME_ZONE=");
+            if (zone != std::string_view::npos && sql.compare(zone + 14, 1, "@") != 0) {
+                size_t end = sql.find_first_of(" */", zone + 14);
+                timeZone = std::string(sql.substr(zone + 14, end == std::string_view::npos ? std::string_view::npos : end - zone - 14));
+            }
+        }
+    }
+
+    // Runs the count (and checksum) queries for every table over connections at once, largest
+    // tables first, and writes <folder>/<database>.json. Tables in skipped were left out of the
+    // restore on purpose; addedColumn is a column the restore added to tables, not in the dump.
+    // Returns whether every table matched.
+    bool verify(const std::string& host, const std::string& user, const std::string& password, const std::string& database,
+                unsigned int port, size_t connections, const std::set<std::string>& skipped, const std::string& addedColumn,
+                const fs::path& folder, const std::string& label) {
+        auto startTime = std::chrono::steady_clock::now();
+        std::vector<std::pair<const std::string, TableVerification>*> order;
+        for (auto& entry : tables) {
+            if (skipped.count(entry.first) == 0) {
+                order.push_back(&entry);
+            }
+        }
+        std::sort(order.begin(), order.end(), [](const auto* a, const auto* b) { return a->second.rows > b->second.rows; });
+
+        std::atomic<size_t> next{0};
+        auto worker = [&]() {
+            mysql_thread_init();
+            MYSQL* conn = mysql_init(NULL);
+            if (conn == NULL || !mysql_real_connect(conn, host.c_str(), user.c_str(), password.c_str(), database.c_str(), port, NULL, 0)) {
+                std::cerr << "Failed to connect to MySQL server for verification: " << (conn ? mysql_error(conn) : "out of memory") << std::endl;
+                if (conn) {
+                    mysql_close(conn);
+                }
+                mysql_thread_end();
+                return;
+            }
+            mysql_query(conn, "SET NAMES utf8mb4");
+            if (!timeZone.empty()) {
+                mysql_query(conn, ("SET TIME_ZONE=" + timeZone).c_str());
+            }
+            for (size_t i = next++; i < order.size(); i = next++) {
+                check(conn, order[i]->first, order[i]->second, addedColumn);
+            }
+            mysql_close(conn);
+            mysql_thread_end();
+        };
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < std::min(std::max<size_t>(connections, 1), order.size()); ++i) {
+            threads.emplace_back(worker);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        size_t matched = 0;
+        std::vector<std::string> failures;
+        for (const auto* entry : order) {
+            const TableVerification& table = entry->second;
+            if (table.status == "ok") {
+                matched++;
+            } else if (table.status != "not_parsed") {
+                failures.push_back(entry->first + " (" + (table.status.empty() ? "error" : table.status) + ")");
+            }
+        }
+        bool passed = failures.empty();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        std::cout << "Verification of " << database << (passed ? " passed" : " failed") << ": " << matched << " of "
+                  << order.size() << " tables match the dump by row count" << (checksums ? " and checksum" : "")
+                  << " in " << seconds << " s" << std::endl;
+        for (const auto& failure : failures) {
+            std::cerr << "Verification mismatch in " << database << ": " << failure << std::endl;
+        }
+        writeReport(folder, database, label, order, passed);
+        return passed;
+    }
+
+private:
+    bool checksums;
+    std::string timeZone;
+    std::map<std::string, TableVerification> tables;
+
+    // Fills in the restored numbers and the status of one table
+    void check(MYSQL* conn, const std::string& name, TableVerification& table, const std::string& addedColumn) {
+        bool withChecksum = checksums && table.parsed && table.sameColumns;
+        std::string select = "SELECT COUNT(*)";
+        if (withChecksum) {
+            std::string values;
+            if (!checksumValues(conn, name, table.columns, addedColumn, values)) {
+                table.status = "error";
+                return;
+            }
+            select += ", COALESCE(SUM(CRC32(CONCAT_WS('#', " + values + "))), 0)";
+        }
+        select += " FROM `" + name + "`";
+        if (mysql_real_query(conn, select.c_str(), select.size()) != 0) {
+            std::cerr << "Failed to verify table '" << name << "': " << mysql_error(conn) << std::endl;
+            table.status = "error";
+            return;
+        }
+        MYSQL_RES* result = mysql_store_result(conn);
+        MYSQL_ROW row = result ? mysql_fetch_row(result) : NULL;
+        if (row == NULL || row[0] == NULL) {
+            table.status = "error";
+        } else {
+            table.restoredRows = std::strtoull(row[0], nullptr, 10);
+            table.restoredChecksum = withChecksum && row[1] ? std::strtoull(row[1], nullptr, 10) : 0;
+            if (!table.parsed) {
+                table.status = "not_parsed";
+            } else if (table.restoredRows != table.rows) {
+                table.status = "row_count_mismatch";
+            } else if (withChecksum && table.restoredChecksum != table.checksum) {
+                table.status = "checksum_mismatch";
+            } else {
+                table.status = "ok";
+            }
+        }
+        if (result) {
+            mysql_free_result(result);
+        }
+    }
+
+    // The CONCAT_WS arguments giving each column the text the dump has for it: the INSERTs'
+    // column list or every stored column in table order. BIT columns are dumped as numbers and
+    // the dump is utf8mb4, whatever character set a column keeps its text in.
+    bool checksumValues(MYSQL* conn, const std::string& name, const std::string& columnList, const std::string& addedColumn, std::string& values) {
+        std::string query = "SELECT COLUMN_NAME, DATA_TYPE, CHARACTER_SET_NAME, EXTRA FROM information_schema.COLUMNS "
+                            "WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = '" + name + "' ORDER BY ORDINAL_POSITION";
+        if (mysql_query(conn, query.c_str()) != 0) {
+            std::cerr << "Failed to read the columns of table '" << name << "': " << mysql_error(conn) << std::endl;
+            return false;
+        }
+        MYSQL_RES* result = mysql_store_result(conn);
+        if (result == NULL) {
+            return false;
+        }
+        std::vector<std::string> stored;
+        std::unordered_map<std::string, std::string> expressions;
+        while (MYSQL_ROW row = mysql_fetch_row(result)) {
+            std::string column = row[0] ? row[0] : "";
+            std::string type = row[1] ? row[1] : "";
+            std::string charset = row[2] ? row[2] : "";
+            std::string expression = "`" + column + "`";
+            if (type == "bit") {
+                expression = "CAST(" + expression + " AS UNSIGNED)";
+            } else if (!charset.empty() && charset.compare(0, 4, "utf8") != 0 && charset != "binary") {
+                expression = "CONVERT(" + expression + " USING utf8mb4)";
+            }
+            expressions[column] = expression;
+            if (column != addedColumn && (row[3] == NULL || std::strstr(row[3], "GENERATED") == NULL)) {
+                stored.push_back(column);
+            }
+        }
+        mysql_free_result(result);
+
+        std::vector<std::string> columns;
+        if (columnList.empty()) {
+            columns = stored;
+        } else {
+            for (size_t start = columnList.find('`'); start != std::string::npos; start = columnList.find('`', start + 1)) {
+                size_t end = columnList.find('`', start + 1);
+                if (end == std::string::npos) {
+                    break;
+                }
+                columns.push_back(columnList.substr(start + 1, end - start - 1));
+                start = end;
+            }
+        }
+        values.clear();
+        for (const auto& column : columns) {
+            auto it = expressions.find(column);
+            if (it == expressions.end()) {
+                std::cerr << "Failed to verify table '" << name << "': no column " << column << std::endl;
+                return false;
+            }
+            values += (values.empty() ? "" : ", ") + it->second;
+        }
+        return !values.empty();
+    }
+
+    void writeReport(const fs::path& folder, const std::string& database, const std::string& label,
+                     const std::vector<std::pair<const std::string, TableVerification>*>& order, bool passed) {
+        std::ostringstream json;
+        json << "{\n  \"site\": " << RestoreMetrics::quoted(database) << ",\n  \"dump\": " << RestoreMetrics::quoted(label)
+             << ",\n  \"passed\": " << (passed ? "true" : "false") << ",\n  \"checksums\": " << (checksums ? "true" : "false")
+             << ",\n  \"tables\": [";
+        for (size_t i = 0; i < order.size(); ++i) {
+            const TableVerification& table = order[i]->second;
+            json << (i > 0 ? "," : "") << "\n    {\"table\": " << RestoreMetrics::quoted(order[i]->first)
+                 << ", \"status\": " << RestoreMetrics::quoted(table.status.empty() ? "error" : table.status)
+                 << ", \"dump_rows\": " << table.rows << ", \"restored_rows\": " << table.restoredRows;
+            if (checksums) {
+                json << ", \"dump_checksum\": " << table.checksum << ", \"restored_checksum\": " << table.restoredChecksum;
+            }
+            json << "}";
+        }
+        json << "\n  ]\n}\n";
+
+        std::error_code error;
+        fs::create_directories(folder, error);
+        std::string fileName = database;
+        std::replace(fileName.begin(), fileName.end(), '/', '_');
+        writeFileAtomically(folder / (fileName + ".json"), json.str());
+    }
+};
+
+// Works out whether statement drops or creates a table or a stored routine, naming it in key
+// as "TABLE `x`", "FUNCTION `x`" or "PROCEDURE `x`"
+bool schemaObjectOf(const DumpStatement& statement, std::string& key, bool& create) {
+    const std::string& text = statement.sql;
+    size_t pos = text.find_first_not_of(" \t\r\n");
+    if (pos == std::string::npos) {
+        return false;
+    }
+    if (statement.kind == StatementKind::Table) {
+        create = startsWithWord(text, pos, "CREATE TABLE");
+        if (!create && !startsWithWord(text, pos, "DROP TABLE")) {
+            return false;
+        }
+        key = "TABLE `" + statement.table + "`";
+        return true;
+    }
+    if (statement.kind != StatementKind::Barrier) {
+        return false;
+    }
+    // mysqldump writes the DROP of a routine as /*!50003 DROP FUNCTION IF EXISTS `x` */
+    if (startsWithWord(text, pos, "/*!")) {
+        pos += 3;
+        while (pos < text.size() && std::isdigit(static_cast<unsigned char>(text[pos]))) {
+            pos++;
+        }
+        pos = text.find_first_not_of(" \t\r\n", pos);
+        if (pos == std::string::npos) {
+            return false;
+        }
+    }
+    create = startsWithWord(text, pos, "CREATE ");
+    if (!create && !startsWithWord(text, pos, "DROP FUNCTION") && !startsWithWord(text, pos, "DROP PROCEDURE")) {
+        return false;
+    }
+    // The name follows FUNCTION or PROCEDURE, after the DEFINER and before the parameter list.
+    // Triggers and views can call routines in their body, those are left alone.
+    size_t header = std::min(text.find('(', pos), text.size());
+    size_t function = text.find("FUNCTION ", pos);
+    size_t procedure = text.find("PROCEDURE ", pos);
+    size_t at = std::min(function, procedure);
+    if (at >= header || text.find("TRIGGER", pos) < at) {
+        return false;
+    }
+    key = std::string(function < procedure ? "FUNCTION" : "PROCEDURE") + " `" + extractQuotedName(text, at) + "`";
+    return true;
+}
+
+// Splits the AUTO_INCREMENT=N table option off a CREATE TABLE into autoIncrement. It is the only
+// table option mysqldump writes differently for every dump of the same schema, the next value of
+// the counter, so templates compare and hash the CREATE without it.
+std::string withoutAutoIncrement(const std::string& sql, std::string& autoIncrement) {
+    autoIncrement.clear();
+    size_t bodyStart = 0;
+    size_t bodyEnd = 0;
+    std::vector<std::string> items;
+    if (!splitCreateDefinitions(sql, bodyStart, bodyEnd, items)) {
+        return sql;
+    }
+    size_t option = sql.find(" AUTO_INCREMENT=", bodyEnd);
+    size_t digits = option == std::string::npos ? option : option + 16;
+    size_t end = digits == std::string::npos ? digits : std::min(sql.find_first_not_of("0123456789", digits), sql.size());
+    if (digits == std::string::npos || end == digits) {
+        return sql;
+    }
+    autoIncrement = sql.substr(digits, end - digits);
+    return sql.substr(0, option) + sql.substr(end);
+}
+
+// One table or stored routine of a schema: its DROP, the session settings mysqldump puts
+// around it and its CREATE, each with whether it was written inside a DELIMITER block
+struct SchemaObject {
+    std::string key;
+    std::string create;
+    std::vector<std::pair<DumpStatement, bool>> statements;
+};
+
+// The tables and stored routines a dump creates, in dump order. Views and triggers are left out,
+// they depend on the data and run where the dump has them. A saved template is itself a small
+// dump of these objects, so it is read back through the same splitter.
+class SchemaTemplate {
+public:
+    std::vector<SchemaObject> objects;
+
+    // Collects the DDL among the statements of a dump, ignoring everything else
+    void take(const DumpStatement& statement, bool insideDelimiter) {
+        if (statement.kind == StatementKind::Session) {
+            // Settings before the CREATE, and the ones putting the @saved_ values back after it
+            if (building && (!created || statement.sql.find("@saved_") != std::string::npos)) {
+                current.statements.emplace_back(statement, insideDelimiter);
+            }
+            return;
+        }
+        std::string key;
+        bool create = false;
+        if (!schemaObjectOf(statement, key, create)) {
+            finish();
+            return;
+        }
+        if (!building || created || key != current.key) {
+            finish();
+            building = true;
+            current.key = key;
+        }
+        current.statements.emplace_back(statement, insideDelimiter);
+        if (create) {
+            if (statement.kind == StatementKind::Table) {
+                std::string autoIncrement;
+                current.statements.back().first.sql = withoutAutoIncrement(statement.sql, autoIncrement);
+            }
+            current.create = current.statements.back().first.sql;
+            created = true;
+        }
+    }
+
+    // Ends the object being collected, one that was dropped but never created is not kept
+    void finish() {
+        if (building && created) {
+            objects.push_back(std::move(current));
+        }
+        current = SchemaObject();
+        building = false;
+        created = false;
+    }
+
+    // FNV-1a of every statement, the name the template is saved under
+    std::string hash() const {
+        uint64_t value = FNV_OFFSET_BASIS;
+        for (const auto& object : objects) {
+            for (const auto& statement : object.statements) {
+                value = hashBytes(std::string_view(statement.second ? "\1" : "\0", 1), value);
+                value = hashBytes(statement.first.sql, value);
+            }
+        }
+        char name[17];
+        std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(value));
+        return name;
+    }
+
+    bool save(const fs::path& path, const std::string& label) const {
+        std::string sql = "-- Schema template " + hash() + ", taken from " + label + "\n";
+        for (const auto& object : objects) {
+            for (const auto& statement : object.statements) {
+                sql += statement.second ? "DELIMITER ;;\n" + statement.first.sql + ";;\nDELIMITER ;\n" : statement.first.sql + ";\n";
+            }
+        }
+        std::error_code error;
+        fs::create_directories(path.parent_path(), error);
+        return writeFileAtomically(path, sql);
+    }
+
+    bool load(const fs::path& path) {
+        std::ifstream in(path, std::ios::binary);
+        std::string sql((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (!in.good() && !in.eof()) {
+            return false;
+        }
+        SqlStatementSplitter reader;
+        bool ok = reader.feed(sql.data(), sql.size(), [&](std::string_view text, bool insideDelimiter) {
+            take(classifyStatement(text, insideDelimiter), insideDelimiter);
+            return true;
+        });
+        ok = ok && reader.finish();
+        finish();
+        return ok && !objects.empty();
+    }
+
+private:
+    SchemaObject current;
+    bool building = false;
+    bool created = false;
+};
+
+// Creates the tables and routines of a site database from a saved schema template instead of
+// the DDL spread through its dump. Templates live in SCHEMA_TEMPLATE_FOLDER as <hash>.sql, the
+// hash being that of the dump's DDL. The hash of a dump is only known once it has been read, so
+// the template is the one this site had last, or the newest one for a site seen the first time.
+// At the first DDL statement of the dump every object of the template is queued in one go: the
+// tables spread over all connections, the routines with the session settings they were made in.
+// From then on a CREATE the template already ran is skipped together with its DROP. A CREATE that
+// differs runs as the dump has it, replacing the template's object, and objects of the template
+// the dump never creates are dropped at the end. The dump's own DDL is saved as a new template
+// when no template has its hash yet. Using a template touches it, and only the most recently used
+// templates are kept, at most SCHEMA_TEMPLATE_MAX of them.
+class SchemaTemplateCache {
+public:
+    SchemaTemplateCache(const fs::path& folder, const std::string& site, size_t maxTemplates)
+        : folder(folder), site(site), maxTemplates(std::max<size_t>(maxTemplates, 1)) {}
+
+    // Picks the template to clone, returns false when there is none yet
+    bool choose() {
+        std::ifstream pointer(folder / (site + ".template"));
+        std::string hash;
+        std::error_code error;
+        if (!(pointer >> hash) || !fs::exists(folder / (hash + ".sql"), error)) {
+            hash.clear();
+            fs::file_time_type newest;
+            for (fs::directory_iterator it(folder, error), end; !error && it != end; it.increment(error)) {
+                if (it->path().extension() == ".sql" && (hash.empty() || it->last_write_time() > newest)) {
+                    hash = it->path().stem().string();
+                    newest = it->last_write_time();
+                }
+            }
+        }
+        if (hash.empty() || !chosen.load(folder / (hash + ".sql"))) {
+            return false;
+        }
+        chosenHash = hash;
+        for (const auto& object : chosen.objects) {
+            creates[object.key] = object.create;
+        }
+        std::cout << "Creating the schema of " << site << " from template " << chosenHash << ", " << chosen.objects.size()
+                  << " tables and routines" << std::endl;
+        return true;
+    }
+
+    // Replaces statement with the statements to run for it, which may be none
+    void rewrite(DumpStatement statement, bool insideDelimiter, std::vector<DumpStatement>& out) {
+        own.take(statement, insideDelimiter);
+        if (chosenHash.empty() || statement.kind == StatementKind::Session || statement.kind == StatementKind::Skip ||
+            statement.kind == StatementKind::Lock) {
+            out.push_back(std::move(statement));
+            return;
+        }
+        // By now the dump has set up its session, foreign key checks are off for the tables
+        if (!cloned) {
+            cloned = true;
+            for (const auto& object : chosen.objects) {
+                for (const auto& entry : object.statements) {
+                    out.push_back(entry.first);
+                }
+            }
+        }
+
+        std::string key;
+        bool create = false;
+        if (!schemaObjectOf(statement, key, create)) {
+            flushDrop(out);
+            out.push_back(std::move(statement));
+            return;
+        }
+        // The DROP waits for the CREATE that follows, both go if the template made the same object
+        if (!create) {
+            flushDrop(out);
+            pendingDrop = std::move(statement);
+            pendingKey = key;
+            return;
+        }
+        created.insert(key);
+        auto it = creates.find(key);
+        std::string autoIncrement;
+        if (it != creates.end() && it->second == (statement.kind == StatementKind::Table ? withoutAutoIncrement(statement.sql, autoIncrement) : statement.sql)) {
+            skippedStatements += pendingKey == key ? 2 : 1;
+            pendingKey.clear();
+            // The template made the table without a counter, it starts where the dump's did
+            if (!autoIncrement.empty()) {
+                statement.sql = "ALTER TABLE `" + statement.table + "` AUTO_INCREMENT=" + autoIncrement;
+                out.push_back(std::move(statement));
+            }
+            return;
+        }
+        if (it != creates.end() && pendingKey != key) {
+            DumpStatement drop = statement;
+            drop.sql = "DROP " + key.substr(0, key.find(' ')) + " IF EXISTS " + key.substr(key.find(' ') + 1);
+            out.push_back(std::move(drop));
+        }
+        changedObjects += it != creates.end();
+        flushDrop(out);
+        out.push_back(std::move(statement));
+    }
+
+    // Called once the dump is read, drops what the template made and the dump does not have
+    void finish(std::vector<DumpStatement>& out) {
+        own.finish();
+        flushDrop(out);
+        for (const auto& object : chosen.objects) {
+            if (cloned && created.count(object.key) == 0) {
+                DumpStatement drop;
+                drop.kind = object.key.compare(0, 6, "TABLE ") == 0 ? StatementKind::Table : StatementKind::Barrier;
+                drop.table = drop.kind == StatementKind::Table ? object.statements.front().first.table : "";
+                drop.sql = "DROP " + object.key.substr(0, object.key.find(' ')) + " IF EXISTS " + object.key.substr(object.key.find(' ') + 1);
+                if (drop.kind == StatementKind::Table) {
+                    droppedObjects.push_back(drop.table);
+                }
+                out.push_back(std::move(drop));
+            }
+        }
+    }
+
+    // Tables the template created that the dump does not have
+    const std::vector<std::string>& droppedTables() const {
+        return droppedObjects;
+    }
+
+    // Once the restore succeeded: keeps the dump's schema as a template and remembers it for the site
+    void save(const std::string& label) {
+        if (own.objects.empty()) {
+            return;
+        }
+        std::string hash = own.hash();
+        std::error_code error;
+        if (hash == chosenHash) {
+            std::cout << "Schema of " << label << " matches template " << hash << ", skipped " << skippedStatements << " DDL statements" << std::endl;
+        } else if (!fs::exists(folder / (hash + ".sql"), error) && !own.save(folder / (hash + ".sql"), label)) {
+            return;
+        } else {
+            std::cout << "Schema of " << label << " is template " << hash;
+            if (!chosenHash.empty()) {
+                std::cout << ", " << changedObjects << " tables and routines differed from template " << chosenHash
+                          << ", skipped " << skippedStatements << " DDL statements";
+            }
+            std::cout << std::endl;
+        }
+        std::ofstream pointer(folder / (site + ".template"), std::ios::trunc);
+        pointer << hash << "\n";
+        pointer.close();
+        fs::last_write_time(folder / (hash + ".sql"), fs::file_time_type::clock::now(), error);
+        prune();
+    }
+
+private:
+    fs::path folder;
+    std::string site;
+    size_t maxTemplates;
+    SchemaTemplate own;     // built from this dump
+    SchemaTemplate chosen;  // cloned into the site
+    std::string chosenHash;
+    std::unordered_map<std::string, std::string> creates;
+    std::set<std::string> created;
+    bool cloned = false;
+    DumpStatement pendingDrop;
+    std::string pendingKey;
+    size_t skippedStatements = 0;
+    size_t changedObjects = 0;
+    std::vector<std::string> droppedObjects;
+
+    void flushDrop(std::vector<DumpStatement>& out) {
+        if (!pendingKey.empty()) {
+            out.push_back(std::move(pendingDrop));
+            pendingKey.clear();
+        }
+    }
+
+    // Removes the templates used the longest time ago beyond maxTemplates. A site whose template
+    // is gone starts again from the newest one.
+    void prune() {
+        std::vector<std::pair<fs::file_time_type, fs::path>> templates;
+        std::error_code error;
+        for (fs::directory_iterator it(folder, error), end; !error && it != end; it.increment(error)) {
+            if (it->path().extension() == ".sql") {
+                templates.emplace_back(it->last_write_time(), it->path());
+            }
+        }
+        if (templates.size() <= maxTemplates) {
+            return;
+        }
+        std::sort(templates.begin(), templates.end());
+        for (size_t i = 0; i + maxTemplates < templates.size(); ++i) {
+            if (fs::remove(templates[i].second, error)) {
+                std::cout << "Removed schema template " << templates[i].second.stem().string() << ", only the " << maxTemplates
+                          << " used most recently are kept" << std::endl;
+            }
+        }
+    }
+};
+
+// Function to restore a dump stream in-process over a pool of connections. permanentFailure,
+// when given, is set for a failure that retrying the same dump cannot fix.
+bool restoreMySQLDumpParallel(DumpReader& dump, const std::string& label, const std::string& db_host, const std::string& db_user, const std::string& db_password, const std::string& db_name, unsigned int port, size_t connections,
+                              bool* permanentFailure = nullptr) {
+    bool useInfile = getEnvOrDefault("LOAD_MODE", "insert") == "infile";
+    CommitPolicy policy;
+    policy.bulkSession = getEnvOrDefault("SESSION_PROFILE", "dump") == "bulk";
+    policy.rows = std::stoul(getEnvOrDefault("COMMIT_ROWS", "50000"));
+    policy.bytes = std::stoul(getEnvOrDefault("COMMIT_MB", "64")) * 1024 * 1024;
+    // STATEMENT_BATCH_KB 0, the default, sends every statement on its own, and the queue keeps its fixed size
+    PipelinePolicy pipeline;
+    pipeline.batchBytes = std::stoul(getEnvOrDefault("STATEMENT_BATCH_KB", "0")) * 1024;
+    if (pipeline.batchBytes > 0) {
+        pipeline.queueBytes = std::max<size_t>(std::stoul(getEnvOrDefault("BATCHES_IN_FLIGHT", "16")), 1) * pipeline.batchBytes;
+    }
+    // Index builds, manifests and checkpoints all describe the database, they only apply when loading one
+    std::string sinkName = getEnvOrDefault("RESTORE_SINK", "mysql");
+    bool toServer = sinkLoadsServer(sinkName);
+    bool deferIndexes = toServer && getEnvOrDefault("INDEX_MODE", "inline") == "deferred";
+    DeferredIndexPlan indexPlan;
+
+    // The consolidated layout uses the site database as staging and empties it at the end
+    std::unique_ptr<ConsolidatedLoad> consolidated;
+    if (toServer && getEnvOrDefault("RESTORE_LAYOUT", "per_site") == "consolidated") {
+        consolidated = std::make_unique<ConsolidatedLoad>(getEnvOrDefault("CONSOLIDATED_DATABASE", "openmrs_consolidated"), db_name);
+    }
+
+    // Rows of excluded tables are dropped straight off the splitter's view, never copied or sent.
+    // With EXCLUDED_TABLE_SCHEMA the tables are still created, so views and triggers on them load.
+    TableFilter tableFilter(getEnvOrDefault("TABLE_INCLUDE", ""), getEnvOrDefault("TABLE_EXCLUDE", ""));
+    bool excludedSchema = getEnvOrDefault("EXCLUDED_TABLE_SCHEMA", "true") == "true";
+
+    // Incremental restores compare the dump with the manifest saved by the last restore of this database
+    bool incremental = toServer && !consolidated && getEnvOrDefault("RESTORE_STRATEGY", "full") == "incremental";
+    std::string manifestPath = SiteManifest::pathFor(db_name);
+    std::unique_ptr<IncrementalRestorePlan> incrementalPlan;
+    ManifestBuilder manifestBuilder;
+    bool buildManifestWhileRestoring = false;
+    if (incremental) {
+        SiteManifest previous;
+        if (previous.load(manifestPath)) {
+            if (!buildDumpManifest(dump, manifestBuilder.manifest, tableFilter)) {
+                std::cerr << "Error: Failed to read " << label << " for the incremental restore." << std::endl;
+                return false;
+            }
+            incrementalPlan = std::make_unique<IncrementalRestorePlan>(previous, manifestBuilder.manifest);
+            std::cout << "Incremental restore of " << label << ": " << incrementalPlan->skipped << " tables unchanged, "
+                      << incrementalPlan->chunked << " with changed chunks, " << incrementalPlan->reloaded << " reloaded" << std::endl;
+        } else {
+            std::cout << "No restore manifest for " << db_name << ", restoring " << label << " in full" << std::endl;
+            buildManifestWhileRestoring = true;
+        }
+        // Until this restore succeeds the database no longer matches the saved manifest
+        std::error_code error;
+        fs::remove(manifestPath, error);
+    }
+
+    // Dictionary tables shared between sites are decided once the whole dump is read
+    std::unique_ptr<SharedDictionary> dictionary;
+    if (toServer && !incremental && !consolidated && getEnvOrDefault("DICTIONARY_SHARING", "false") == "true") {
+        dictionary = std::make_unique<SharedDictionary>(getEnvOrDefault("DICTIONARY_TABLES", "concept,concept_*"),
+                                                        std::stoul(getEnvOrDefault("DICTIONARY_MAX_SHARED", "2")), db_name);
+    }
+
+    // Checkpoints let a restore that stopped part way continue from its last committed statements
+    double checkpointSeconds = toServer ? std::stod(getEnvOrDefault("CHECKPOINT_SECONDS", "0")) : 0;
+    if (checkpointSeconds > 0 && incremental) {
+        std::cout << "Checkpoints are not written for incremental restores, " << label << " starts over if it stops" << std::endl;
+        checkpointSeconds = 0;
+    }
+    if (checkpointSeconds > 0 && dictionary) {
+        std::cout << "Checkpoints are not written while sharing the dictionary, " << label << " starts over if it stops" << std::endl;
+        checkpointSeconds = 0;
+    }
+    // A checkpoint is only taken up again for the same dump file. A dump inside a bundle is read from
+    // a spool copy its label does not name, so a checkpoint of it could never be used.
+    std::string dumpIdentity = checkpointSeconds > 0 ? dumpFileIdentity(label) : "";
+    if (checkpointSeconds > 0 && dumpIdentity.empty()) {
+        std::cout << "Checkpoints are not written for " << label << ", it is not a file a resumed restore could recognise" << std::endl;
+        checkpointSeconds = 0;
+    }
+    RestoreCheckpoint checkpoint;
+    bool resuming = checkpointSeconds > 0 && checkpoint.load(label, db_name);
+
+    // A schema template takes the place of the DDL in the dump. The consolidated and shared dictionary
+    // tables are rewritten from that DDL, and a restore resumed from a checkpoint would not drop what
+    // the template made and the dump does not have.
+    std::unique_ptr<SchemaTemplateCache> schemaTemplates;
+    if (toServer && !incremental && !consolidated && !dictionary && getEnvOrDefault("SCHEMA_TEMPLATES", "false") == "true") {
+        if (checkpointSeconds > 0) {
+            std::cout << "Schema templates are not used with checkpoints, " << label << " runs the DDL of its dump" << std::endl;
+        } else {
+            schemaTemplates = std::make_unique<SchemaTemplateCache>(getEnvOrDefault("SCHEMA_TEMPLATE_FOLDER", "schema_templates"), db_name,
+                                                                    std::stoul(getEnvOrDefault("SCHEMA_TEMPLATE_MAX", "50")));
+            schemaTemplates->choose();
+        }
+    }
+
+    // Rows counted while parsing are compared with the server once everything is loaded.
+    // A resumed restore never sees the statements before its checkpoint, so it has nothing to compare.
+    std::string verifyMode = toServer ? getEnvOrDefault("VERIFY_RESTORE", "count") : "off";
+    std::unique_ptr<RestoreVerifier> verifier;
+    if (verifyMode != "off" && resuming) {
+        std::cout << "Not verifying " << label << ", it continues from a checkpoint" << std::endl;
+    } else if (verifyMode != "off") {
+        verifier = std::make_unique<RestoreVerifier>(verifyMode == "checksum");
+    }
+
+    // Every statement queued on a connection holds one buffer, so that much is worth keeping idle.
+    // Declared before the sink, whose connections give buffers back until they stop.
+    StatementBufferPool buffers(pipeline.queueBytes * (toServer ? connections : 1));
+    RestoreMetrics metrics(db_name, label);
+    // An empty METRICS_FOLDER turns the metric files off, METRICS_SECONDS 0 only writes them at the end
+    fs::path metricsFolder = getEnvOrDefault("METRICS_FOLDER", "metrics");
+    if (!metricsFolder.empty()) {
+        metrics.start(metricsFolder, std::stod(getEnvOrDefault("METRICS_SECONDS", "10")));
+    }
+    std::unique_ptr<StatementSink> sink;
+    ParallelRestoreEngine* engine = nullptr;
+    if (sinkName == "null") {
+        sink = std::make_unique<NullStatementSink>();
+    } else if (sinkName == "split") {
+        sink = std::make_unique<TableFileSink>(fs::path(getEnvOrDefault("SPLIT_FOLDER", "split")) / db_name);
+    } else if (sinkName == "columnar") {
+        size_t rowGroupBytes = std::stoul(getEnvOrDefault("COLUMNAR_ROW_GROUP_MB", "64")) * 1024 * 1024;
+        sink = std::make_unique<ColumnarExportSink>(getEnvOrDefault("COLUMNAR_FOLDER", "columnar"), db_name, rowGroupBytes);
+    } else {
+        auto pool = std::make_unique<ParallelRestoreEngine>(connections, useInfile, policy, pipeline);
+        if (!pool->open(db_host, db_user, db_password, db_name, port)) {
+            return false;
+        }
+        engine = pool.get();
+        sink = std::move(pool);
+    }
+    sink->recycleInto(&buffers);
+    sink->reportInto(&metrics);
+
+    // Where each statement starts, from the oldest one that may not be committed yet
+    struct StatementStart {
+        uint64_t ordinal;
+        uint64_t offset;
+        std::string delimiter;
+    };
+    std::deque<StatementStart> starts;
+    std::vector<std::pair<uint64_t, std::string>> sessionHistory;
+    SqlStatementSplitter reader;
+    uint64_t nextOrdinal = 0;
+    uint64_t savedOrdinal = 0;
+    size_t skippedStatements = 0;
+    if (resuming) {
+        std::cout << "Resuming restore of " << label << " at statement " << checkpoint.ordinal << ", "
+                  << checkpoint.offset / (1024 * 1024) << " MB into the dump" << std::endl;
+        if (!dump.seek(checkpoint.offset, checkpoint.point)) {
+            std::cerr << "Error: Could not continue reading " << label << " at the checkpoint." << std::endl;
+            return false;
+        }
+        reader.resumeAt(checkpoint.offset, checkpoint.delimiter);
+        nextOrdinal = checkpoint.ordinal;
+        savedOrdinal = checkpoint.ordinal;
+        // Put every connection back in the session the dump had set up by then
+        for (const auto& sql : checkpoint.session) {
+            sessionHistory.emplace_back(0, sql);
+            DumpStatement statement = classifyStatement(sql, false);
+            statement.ordinal = checkpoint.ordinal;
+            sink->submit(std::move(statement));
+        }
+        for (auto& indexes : checkpoint.deferredIndexes) {
+            indexPlan.add(std::move(indexes));
+        }
+    }
+    starts.push_back(StatementStart{nextOrdinal, checkpoint.offset, checkpoint.delimiter});
+
+    auto lastCheckpoint = std::chrono::steady_clock::now();
+    auto writeCheckpoint = [&]() {
+        RestoreCheckpoint next;
+        uint64_t frontier = std::max(engine->committedBefore(nextOrdinal, next.tables), savedOrdinal);
+        while (starts.size() > 1 && starts.front().ordinal < frontier) {
+            starts.pop_front();
+        }
+        lastCheckpoint = std::chrono::steady_clock::now();
+        if (starts.front().ordinal != frontier) {
+            return;
+        }
+        next.database = db_name;
+        next.dumpIdentity = dumpIdentity;
+        next.ordinal = frontier;
+        next.offset = starts.front().offset;
+        next.delimiter = starts.front().delimiter;
+        next.point = dump.accessPointBefore(next.offset);
+        for (const auto& entry : sessionHistory) {
+            if (entry.first < frontier) {
+                next.session.push_back(entry.second);
+            }
+        }
+        // Tables finished by the run this one resumed keep their progress
+        for (const auto& entry : checkpoint.tables) {
+            next.tables.emplace(entry);
+        }
+        next.deferredIndexes = indexPlan.tables;
+        if (next.save(label)) {
+            savedOrdinal = frontier;
+        }
+    };
+
+    auto startTime = std::chrono::steady_clock::now();
+    size_t totalBytes = 0;
+    size_t statementCount = 0;
+    std::vector<DumpStatement> statements;
+    std::set<std::string> excludedTables;
+    size_t excludedBytes = 0;
+    size_t excludedStatements = 0;
+    // Time since the last statement was handed on or the last read returned, i.e. spent parsing
+    auto parseStart = std::chrono::steady_clock::now();
+    auto onStatement = [&](std::string_view sql, bool insideDelimiter) {
+        statementCount++;
+        uint64_t ordinal = nextOrdinal++;
+        statements.clear();
+        InsertStatementParts parts;
+        bool dropped = tableFilter.active() && !insideDelimiter && splitInsertStatement(sql, parts) && tableFilter.excluded(std::string(parts.table));
+        if (dropped) {
+            excludedTables.insert(std::string(parts.table));
+            excludedBytes += sql.size();
+            excludedStatements++;
+            metrics.skipped(std::string(parts.table), sql.size());
+        } else if (incrementalPlan) {
+            incrementalPlan->rewrite(classifyStatement(sql, insideDelimiter, &buffers), statements);
+        } else if (schemaTemplates) {
+            schemaTemplates->rewrite(classifyStatement(sql, insideDelimiter, &buffers), insideDelimiter, statements);
+        } else {
+            statements.push_back(classifyStatement(sql, insideDelimiter, &buffers));
+        }
+        // A dropped table is left out of the manifest too, so it reloads if the filter changes
+        if (buildManifestWhileRestoring && !insideDelimiter && !dropped) {
+            manifestBuilder.take(sql);
+        }
+        if (verifier && !insideDelimiter && !dropped) {
+            verifier->take(sql);
+        }
+        auto parsedAt = std::chrono::steady_clock::now();
+        double parseSeconds = std::chrono::duration<double>(parsedAt - parseStart).count();
+        for (auto& statement : statements) {
+            if (consolidated) {
+                consolidated->rewrite(statement);
+            }
+            metrics.parsed(statement.kind == StatementKind::Table ? statement.table : "", statement.sql.size(), parseSeconds);
+            parseSeconds = 0;
+            statement.ordinal = ordinal;
+            if (!excludedSchema && statement.kind == StatementKind::Table && tableFilter.active() && tableFilter.excluded(statement.table)) {
+                excludedTables.insert(statement.table);
+                buffers.release(statement.sql);
+                continue;
+            }
+            if (dictionary) {
+                dictionary->remember(statement);
+                if (dictionary->take(statement)) {
+                    buffers.release(statement.sql);
+                    continue;
+                }
+            }
+            if (deferIndexes) {
+                indexPlan.take(statement);
+            }
+            if (checkpointSeconds > 0) {
+                if (statement.kind == StatementKind::Session) {
+                    sessionHistory.emplace_back(ordinal, statement.sql);
+                }
+                // Already committed by the run that wrote the checkpoint
+                auto it = checkpoint.tables.find(statement.table);
+                if (statement.kind == StatementKind::Table && it != checkpoint.tables.end() && ordinal <= it->second) {
+                    skippedStatements++;
+                    buffers.release(statement.sql);
+                    continue;
+                }
+            }
+            if (!sink->submit(std::move(statement))) {
+                return false;
+            }
+        }
+        if (checkpointSeconds > 0) {
+            starts.push_back(StatementStart{nextOrdinal, reader.statementEnd(), reader.currentDelimiter()});
+            if (std::chrono::duration<double>(std::chrono::steady_clock::now() - lastCheckpoint).count() >= checkpointSeconds) {
+                writeCheckpoint();
+            }
+        }
+        parseStart = std::chrono::steady_clock::now();
+        return true;
+    };
+
+    // Mapped dumps are split where they lie, the others from the reader's own buffer
+    const char* data;
+    bool ok = true;
+    long bytesRead;
+    auto readStart = std::chrono::steady_clock::now();
+    while (ok && (bytesRead = dump.borrow(data)) > 0) {
+        parseStart = std::chrono::steady_clock::now();
+        metrics.decompressed(bytesRead, std::chrono::duration<double>(parseStart - readStart).count(), dump.inflateSeconds());
+        totalBytes += bytesRead;
+        ok = reader.feed(data, bytesRead, onStatement);
+        readStart = std::chrono::steady_clock::now();
+    }
+    if (ok && bytesRead < 0) {
+        ok = false;
+    }
+
+    ok = ok && reader.finish();
+    if (ok && schemaTemplates) {
+        statements.clear();
+        schemaTemplates->finish(statements);
+        for (auto& statement : statements) {
+            statement.ordinal = nextOrdinal;
+            ok = ok && sink->submit(std::move(statement));
+        }
+        for (const auto& table : schemaTemplates->droppedTables()) {
+            indexPlan.forget(table);
+        }
+    }
+    ok = ok && (!dictionary || (engine && dictionary->finish(*engine, buffers)));
+    ok = sink->finish() && ok;
+    if (checkpointSeconds > 0) {
+        if (ok) {
+            std::error_code error;
+            fs::remove(RestoreCheckpoint::pathFor(label), error);
+        } else {
+            // Record how far the connections got before the failure so a rerun continues there
+            writeCheckpoint();
+        }
+        if (resuming) {
+            std::cout << "Skipped " << skippedStatements << " statements committed before the checkpoint" << std::endl;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    double megabytes = totalBytes / (1024.0 * 1024.0);
+    std::cout << "Restore of " << label << " into " << db_name << (ok ? " finished" : " failed")
+              << ": " << megabytes << " MB, " << statementCount << " statements in " << seconds << " s ("
+              << (seconds > 0 ? megabytes / seconds : 0) << " MB/s, " << sink->describe() << ")" << std::endl;
+    if (!excludedTables.empty()) {
+        std::string names;
+        for (const auto& table : excludedTables) {
+            names += (names.empty() ? "" : ", ") + table;
+        }
+        std::cout << "Skipped " << excludedBytes / (1024.0 * 1024.0) << " MB in " << excludedStatements << " INSERTs of excluded tables"
+                  << (excludedSchema ? ", created with their schema only" : "") << ": " << names << std::endl;
+    }
+    std::cout << "Statement buffers: " << buffers.allocations() << " allocations for " << buffers.statements()
+              << " statements, " << buffers.bytesCopied() / (1024 * 1024) << " MB copied, and "
+              << dump.bytesCopied() / (1024 * 1024) << " MB copied by the dump reader" << std::endl;
+    if (!metricsFolder.empty()) {
+        metrics.finish(ok);
+    }
+    if (engine && policy.bulkSession) {
+        size_t commits;
+        double commitSeconds;
+        size_t rowsPerCommit;
+        engine->commitStats(commits, commitSeconds, rowsPerCommit);
+        std::cout << "Bulk session: " << commits << " commits taking " << commitSeconds << " s, last batch size "
+                  << rowsPerCommit << " rows" << std::endl;
+    }
+    if (engine) {
+        double parserWait;
+        double connectionIdle;
+        double connectionBusy;
+        size_t statementsRun;
+        size_t roundTrips;
+        engine->pipelineStats(parserWait, connectionIdle, connectionBusy, statementsRun, roundTrips);
+        double connectionSeconds = connectionIdle + connectionBusy;
+        std::cout << "Pipeline: " << statementsRun << " statements in " << roundTrips << " round trips, parser waited "
+                  << parserWait << " s for queue space, connections idle " << connectionIdle << " s ("
+                  << (connectionSeconds > 0 ? 100 * connectionIdle / connectionSeconds : 0) << "% of their time)" << std::endl;
+    }
+
+    if (ok && deferIndexes) {
+        ok = buildDeferredIndexes(indexPlan, db_host, db_user, db_password, db_name, port, connections);
+    }
+    // The consolidated layout is checked in its staging tables, before they are exchanged
+    if (ok && verifier) {
+        ok = verifier->verify(db_host, db_user, db_password, db_name, port, connections, excludedTables,
+                              consolidated ? CONSOLIDATED_SITE_COLUMN : "", getEnvOrDefault("VERIFY_FOLDER", "verification"), label);
+    }
+    if (ok && incremental) {
+        manifestBuilder.manifest.save(manifestPath);
+    }
+    if (ok && schemaTemplates) {
+        schemaTemplates->save(label);
+    }
+    if (ok && consolidated) {
+        ok = consolidated->exchange(db_host, db_user, db_password, port, db_name);
+        if (!ok && permanentFailure) {
+            *permanentFailure = consolidated->schemaMismatch();
+        }
+    }
+    return ok;
+}
+
+
+
+// Reads the site name and id from a NUL terminated global_property INSERT
+void searchInBuffer(const string &searchString1, const string &searchString2, const char *buffer, size_t bytesRead, SiteIdentity &identity)
+{
+    // The value is read the way it always has been, as the second comma separated field of the
+    // 60 bytes from the match with its quotes taken out, so existing sites keep their database
+    // names. strstr stays, this runs on one line of the dump. An empty search string would match
+    // everywhere, it finds nothing instead.
+    const char *end = buffer + bytesRead;
+    auto secondField = [&](const char *at, std::string &word)
+    {
+        std::string_view window(at, std::min<size_t>(60, end - at));
+        size_t fieldStart = window.find(',');
+        if (fieldStart == std::string_view::npos || fieldStart + 1 >= window.size())
+            return false;
+        size_t fieldEnd = window.find(',', fieldStart + 1);
+        std::string_view field = window.substr(fieldStart + 1, fieldEnd == std::string_view::npos ? std::string_view::npos : fieldEnd - fieldStart - 1);
+        for (char c : field)
+        {
+            if (c != '\'')
+                word += c;
+        }
+        return true;
+    };
+
+    for (const char *pos = buffer; !searchString1.empty() && (pos = strstr(pos, searchString1.c_str())) != NULL; pos += searchString1.size())
+    {
+        std::string word;
+        secondField(pos, word);
+        removeSubstring(word, "name\\n");
+        for (char &c : word)
+        {
+            c = c == ' ' ? '_' : static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        identity.siteName = word;
+    }
+    for (const char *pos = buffer; !searchString2.empty() && (pos = strstr(pos, searchString2.c_str())) != NULL; pos += searchString2.size())
+    {
+        std::string word;
+        if (secondField(pos, word))
+            identity.siteId = word;
+    }
+}
+
+// Decompresses only as far as the global_property INSERTs to find the site identity.
+// Everything read on the way is kept in prefix so the restore can continue from it instead
+// of inflating the start of the dump a second time. Past IDENTITY_BUFFER_MB the data moves to
+// a spill file and only the part the scan still needs stays in memory; prefix is then empty
+// and spill holds the data, rewound. Only when no spill file can be written is prefixComplete
+// cleared, the caller then has to rewind the dump.
+bool detectSiteIdentity(DumpReader& dump, const string &searchString1, const string &searchString2, SiteIdentity &identity, std::string &prefix, std::FILE *&spill, bool &prefixComplete)
+{
+    const std::string marker = "INSERT INTO `global_property`";
+    const size_t bufferLimit = std::stoul(getEnvOrDefault("IDENTITY_BUFFER_MB", "256")) * 1024 * 1024;
+
+    std::vector<char> buffer(BUFFER_SIZE);
+    size_t scanFrom = 0;
+    size_t markerPos = std::string::npos;
+    bool following = false; // markerPos is the line after a global_property INSERT
+    prefixComplete = true;
+    spill = nullptr;
+    auto stopSpilling = [&]()
+    {
+        std::cerr << "Warning: Could not spill the start of the dump, it is decompressed again" << std::endl;
+        if (spill)
+            std::fclose(spill);
+        spill = nullptr;
+        prefixComplete = false;
+    };
+    // Once the global_property INSERTs end: hands the data read so far over through spill
+    auto finish = [&]()
+    {
+        if (spill && !identity.complete())
+        {
+            std::fclose(spill);
+            spill = nullptr;
+        }
+        if (spill)
+        {
+            prefix.clear();
+            if (std::fflush(spill) != 0 || std::fseek(spill, 0, SEEK_SET) != 0)
+                stopSpilling();
+        }
+        return identity.complete();
+    };
+
+    long bytesRead;
+    while ((bytesRead = dump.read(buffer.data(), BUFFER_SIZE)) > 0)
+    {
+        prefix.append(buffer.data(), bytesRead);
+        if (spill && std::fwrite(buffer.data(), 1, bytesRead, spill) != static_cast<size_t>(bytesRead))
+            stopSpilling();
+
+        if (markerPos == std::string::npos)
+        {
+            markerPos = prefix.find(marker, scanFrom);
+            if (markerPos == std::string::npos)
+            {
+                // Keep enough of the tail to find a marker split across reads
+                scanFrom = prefix.size() >= marker.size() ? prefix.size() - marker.size() + 1 : 0;
+            }
+        }
+
+        // One global_property INSERT per line. A dump made with --skip-extended-insert has one per
+        // row, and a long table is split over several, so the identity can be in any of them.
+        while (markerPos != std::string::npos)
+        {
+            if (following)
+            {
+                if (prefix.size() - markerPos < marker.size())
+                    break;
+                if (prefix.compare(markerPos, marker.size(), marker) != 0)
+                    return finish();
+            }
+            size_t lineEnd = prefix.find('\n', markerPos);
+            if (lineEnd == std::string::npos)
+                break;
+            std::string line = prefix.substr(markerPos, lineEnd - markerPos);
+            searchInBuffer(searchString1, searchString2, line.c_str(), line.size(), identity);
+            if (identity.complete())
+                return finish();
+            markerPos = lineEnd + 1;
+            following = true;
+        }
+
+        if (prefix.size() > bufferLimit)
+        {
+            if (!spill && prefixComplete)
+            {
+                spill = std::tmpfile();
+                if (!spill || std::fwrite(prefix.data(), 1, prefix.size(), spill) != prefix.size())
+                    stopSpilling();
+            }
+            // Stop keeping data in memory, only hold on to what the scan still needs
+            size_t keepFrom = markerPos != std::string::npos ? markerPos : scanFrom;
+            prefix.erase(0, keepFrom);
+            scanFrom -= std::min(scanFrom, keepFrom);
+            if (markerPos != std::string::npos)
+            {
+                markerPos = 0;
+            }
+        }
+    }
+    if (spill)
+        std::fclose(spill);
+    spill = nullptr;
+    return false;
+}
+
+// Creates the site database and loads the dump stream into it
+bool restoreSiteDump(const std::string &gzFileName, const SiteIdentity &identity, DumpReader &dump, size_t connections, bool *permanentFailure = nullptr)
+{
+    // Retrieve database connection parameters from environment variables
+    std::string db_host = std::getenv("DB_HOST");
+    std::string db_user = std::getenv("DB_USER");
+    std::string db_password = std::getenv("DB_PASSWORD");
+    std::string db_port = std::getenv("DB_PORT");
+
+    std::string db_name = identity.database();
+    std::cout << "instance_name:" << db_name << std::endl;
+
+    // Construct the command to restore the database from the SQL dump
+    std::string db_hostb = "0.0.0.0";
+    bool shell = getEnvOrDefault("RESTORE_MODE", "parallel") == "shell";
+    if (!shell && !sinkLoadsServer(getEnvOrDefault("RESTORE_SINK", "mysql"))) {
+        // Nothing is sent to the server, the statements only go to the sink
+        return restoreMySQLDumpParallel(dump, gzFileName, db_hostb, db_user, db_password, db_name, std::stoi(db_port), connections, permanentFailure);
+    }
+
+    MYSQL *conn;
+    conn = mysql_init(NULL);
+
+    if (!mysql_real_connect(conn, db_hostb.c_str(), db_user.c_str(), db_password.c_str(), NULL, std::stoi(db_port), NULL, 0)) {
+
+        std::cerr << "Failed to connect to MySQL server: " << mysql_error(conn) << std::endl;
+        return false;
+    }
+
+    // Check if the database exists
+    if (mysql_select_db(conn, db_name.c_str()) != 0) {
+        // Database does not exist, create it
+        if (mysql_query(conn, ("CREATE DATABASE " + db_name).c_str()) != 0) {
+            std::cerr << "Failed to create database: " << mysql_error(conn) << std::endl;
+            mysql_close(conn);
+            return false;
+        } else {
+            std::cout << "Database created: " << db_name << std::endl;
+            // A manifest left from an earlier copy of this database does not describe the new one
+            std::error_code error;
+            fs::remove(SiteManifest::pathFor(db_name), error);
+        }
+    }
+
+    // Close the connection
+    mysql_close(conn);
+
+
+    std::cout << "start loading data......... " << std::endl;
+
+    bool restored = false;
+    if (shell) {
+        // Feed the already decompressed stream to the mysql client instead of running gunzip again
+        std::string restoreCommand = "mysql -u " + db_user +" -h "+db_hostb+ " -p" + db_password  + " -P" + db_port + " " + db_name;
+        FILE *pipe = popen(restoreCommand.c_str(), "w");
+        if (pipe) {
+            const char* data;
+            long bytesRead = 0;
+            bool written = true;
+            // The stream is split into statements on its way to the client, only to count the rows for verification
+            std::string verifyMode = getEnvOrDefault("VERIFY_RESTORE", "count");
+            std::unique_ptr<RestoreVerifier> verifier;
+            if (verifyMode != "off") {
+                verifier = std::make_unique<RestoreVerifier>(verifyMode == "checksum");
+            }
+            SqlStatementSplitter splitter;
+            auto onStatement = [&](std::string_view sql, bool insideDelimiter) {
+                if (!insideDelimiter) {
+                    verifier->take(sql);
+                }
+                return true;
+            };
+            if (getEnvOrDefault("SESSION_PROFILE", "dump") == "bulk") {
+                // The client session ends with the pipe, so nothing has to be put back afterwards.
+                // sql_log_bin is left alone here since an error would stop the mysql client.
+                const std::string profile = "SET SESSION unique_checks = 0;\nSET SESSION foreign_key_checks = 0;\n";
+                written = fwrite(profile.data(), 1, profile.size(), pipe) == profile.size();
+            }
+            while (written && (bytesRead = dump.borrow(data)) > 0) {
+                written = fwrite(data, 1, bytesRead, pipe) == static_cast<size_t>(bytesRead);
+                if (verifier) {
+                    splitter.feed(data, bytesRead, onStatement);
+                }
+            }
+            // Execute the command
+            int returnValue = pclose(pipe);
+            restored = written && bytesRead == 0 && returnValue == 0;
+            // The client's exit status says nothing about rows it never received
+            if (restored && verifier) {
+                std::set<std::string> skipped;
+                restored = verifier->verify(db_hostb, db_user, db_password, db_name, std::stoi(db_port), connections, skipped, "",
+                                            getEnvOrDefault("VERIFY_FOLDER", "verification"), gzFileName);
+            }
+        }
+    } else {
+        restored = restoreMySQLDumpParallel(dump, gzFileName, db_hostb, db_user, db_password, db_name, std::stoi(db_port), connections, permanentFailure);
+    }
+
+    // Check if the restore finished successfully
+    if (restored) {
+        std::cout << "Database restore from " << gzFileName << " successful." << std::endl;
+    } else {
+        std::cerr << "Error: Database restore from " << gzFileName << " failed." << std::endl;
+    }
+    return restored;
+}
+
+// Dumps already restored by the watch mode, one line per dump: "<content hash> <database> <time> <file>".
+// Lines are only ever appended and flushed right away, so a restart never loses a finished restore.
+class DumpLedger {
+public:
+    explicit DumpLedger(const fs::path& path) : path(path) {
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string hash, database;
+            if (fields >> hash >> database) {
+                restored.insert(hash + " " + database);
+            }
+        }
+    }
+
+    bool contains(const std::string& hash, const std::string& database) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return restored.count(hash + " " + database) > 0;
+    }
+
+    bool record(const std::string& hash, const std::string& database, const fs::path& dump) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(path, std::ios::app);
+        out << hash << " " << database << " " << std::time(nullptr) << " " << dump.filename().string() << "\n";
+        out.flush();
+        if (!out) {
+            std::cerr << "Error: Could not write to the dump ledger " << path << std::endl;
+            return false;
+        }
+        restored.insert(hash + " " + database);
+        return true;
+    }
+
+    // Size and CRC-32 of the compressed file, the same upload under another name hashes the same
+    static std::string contentHash(const fs::path& dump) {
+        std::ifstream in(dump, std::ios::binary);
+        std::vector<char> buffer(BUFFER_SIZE);
+        uLong crc = crc32(0L, Z_NULL, 0);
+        uintmax_t size = 0;
+        while (in) {
+            in.read(buffer.data(), buffer.size());
+            std::streamsize count = in.gcount();
+            crc = crc32(crc, reinterpret_cast<const Bytef*>(buffer.data()), static_cast<uInt>(count));
+            size += count;
+        }
+        if (in.bad()) {
+            return "";
+        }
+        char text[40];
+        std::snprintf(text, sizeof(text), "%ju-%08lx", size, static_cast<unsigned long>(crc));
+        return text;
+    }
+
+private:
+    fs::path path;
+    std::mutex mutex;
+    std::unordered_set<std::string> restored;
+};
+
+// Per dump state of a scheduled restore. A bundle is a job of its own until it is unpacked,
+// then each dump in it is one, read from the spool folder.
+struct DumpJob {
+    fs::path path;
+    std::string entry;       // the dump inside path when path is a bundle, empty otherwise
+    fs::path spooled;        // where the entry was unpacked to
+    std::string bundleHash;  // ledger hash of the bundle, taken once for all its entries
+    uintmax_t size = 0;
+    size_t priority = 0;     // lower runs earlier, set from DUMP_PRIORITY
+    bool restored = false;
+    double seconds = 0;
+};
+
+// With a ledger, a dump whose content was already restored into the same site database is skipped.
+// permanentFailure is set when the restore failed in a way that retrying the same dump cannot fix.
+bool searchInGzipFile(const DumpJob &job, const string &searchString1, const string &searchString2, size_t connections, DumpLedger *ledger = nullptr,
+                      bool *permanentFailure = nullptr)
+{
+    // A dump inside a bundle is known by the bundle's content and its own name
+    std::string gzFileName = job.path.string();
+    std::string label = dumpLabel(job.path, job.entry);
+    std::string hash;
+    if (ledger)
+    {
+        hash = job.entry.empty() ? DumpLedger::contentHash(gzFileName) : job.bundleHash;
+        if (hash.empty())
+        {
+            cerr << "Error: Could not read file " << gzFileName << endl;
+            return false;
+        }
+        if (!job.entry.empty())
+            hash += label.substr(gzFileName.size());
+    }
+
+    std::unique_ptr<DumpReader> file = openDumpReader(job.entry.empty() ? gzFileName : job.spooled.string());
+    if (!file)
+    {
+        return false;
+    }
+
+    // Identity detection is the first stage of the restore stream
+    SiteIdentity identity;
+    std::string prefix;
+    std::FILE *spill = nullptr;
+    bool prefixComplete = true;
+    if (!detectSiteIdentity(*file, searchString1, searchString2, identity, prefix, spill, prefixComplete))
+    {
+        cerr << "Error: No site identity found in " << label << endl;
+        return false;
+    }
+
+    if (!prefixComplete)
+    {
+        // The identity came after more data than we are willing to hold, start over
+        cout << "Site identity found past IDENTITY_BUFFER_MB, decompressing " << label << " again" << endl;
+        prefix.clear();
+        if (!file->rewind())
+        {
+            cerr << "Error: Could not rewind " << label << endl;
+            return false;
+        }
+    }
+    else if (spill)
+    {
+        cout << "Site identity found past IDENTITY_BUFFER_MB, replaying the start of " << label << " from a spill file" << endl;
+    }
+
+    PrefixedDumpReader dump(std::move(prefix), *file, spill);
+    if (ledger && ledger->contains(hash, identity.database()))
+    {
+        cout << "Skipping " << label << ", already restored into " << identity.database() << endl;
+        return true;
+    }
+
+    if (!restoreSiteDump(label, identity, dump, connections, permanentFailure))
+    {
+        return false;
+    }
+    return !ledger || ledger->record(hash, identity.database(), label);
+}
+
+
+
+
+
+
+// Caps the MySQL connections held by all concurrent restores together
+class ConnectionBudget {
+public:
+    explicit ConnectionBudget(size_t total) : total(std::max<size_t>(total, 1)), available(this->total) {}
+
+    // Waits for count connections, asking for more than the whole budget gets the whole budget
+    size_t acquire(size_t count) {
+        count = std::min(std::max<size_t>(count, 1), total);
+        std::unique_lock<std::mutex> lock(mutex);
+        released.wait(lock, [&] { return available >= count; });
+        available -= count;
+        return count;
+    }
+
+    void release(size_t count) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            available += count;
+        }
+        released.notify_all();
+    }
+
+private:
+    size_t total;
+    size_t available;
+    std::mutex mutex;
+    std::condition_variable released;
+};
+
+// Lists the dumps in the folder in the order they should start.
+// DUMP_PRIORITY is a comma separated list of file name fragments that go first, in that order.
+// The rest follow DUMP_ORDER: largest (default) so a big dump never holds up the batch at the end, smallest or name.
+// Files accept turns down are left out. A bundle is one job, its dumps follow once it is unpacked.
+std::vector<DumpJob> collectDumpJobs(const string &folderPath, const std::function<bool(const fs::path &)> &accept = nullptr)
+{
+    std::vector<std::string> priorities = splitString(getEnvOrDefault("DUMP_PRIORITY", ""), ',');
+    std::string order = getEnvOrDefault("DUMP_ORDER", "largest");
+
+    std::vector<DumpJob> jobs;
+    auto addJob = [&](const fs::path &path, uintmax_t size)
+    {
+        DumpJob job;
+        job.path = path;
+        job.size = size;
+        job.priority = priorities.size();
+        std::string fileName = path.filename().string();
+        for (size_t i = 0; i < priorities.size(); ++i)
+        {
+            if (!priorities[i].empty() && fileName.find(priorities[i]) != std::string::npos)
+            {
+                job.priority = i;
+                break;
+            }
+        }
+        jobs.push_back(job);
+    };
+    for (const auto &entry : fs::directory_iterator(folderPath))
+    {
+        if (!fs::is_regular_file(entry.path()) || (accept && !accept(entry.path())))
+            continue;
+        if (isDumpFile(entry.path()) || isDumpBundle(entry.path()))
+            addJob(entry.path(), fs::file_size(entry.path()));
+    }
+
+    std::sort(jobs.begin(), jobs.end(), [&](const DumpJob &a, const DumpJob &b) {
+        if (a.priority != b.priority)
+            return a.priority < b.priority;
+        if (order == "smallest" && a.size != b.size)
+            return a.size < b.size;
+        if (order == "largest" && a.size != b.size)
+            return a.size > b.size;
+        return a.path < b.path;
+    });
+    return jobs;
+}
+
+// A bundle job that has not been unpacked yet
+bool isBundleJob(const DumpJob &job)
+{
+    return job.entry.empty() && isDumpBundle(job.path);
+}
+
+// Restores the dumps of a folder, several at a time.
+// MAX_CONCURRENT_RESTORES limits the dumps in flight and MAX_DB_CONNECTIONS the connections they hold together.
+// A bundle is unpacked to BUNDLE_SPOOL_FOLDER by one of the restore threads, and each dump in it
+// joins the jobs as soon as it is out, so the other threads restore it while the bundle is still read.
+void searchInFolder(const string &folderPath, const string &searchString1, const string &searchString2)
+{
+    std::vector<DumpJob> found = collectDumpJobs(folderPath);
+    std::deque<DumpJob> jobs(found.begin(), found.end());  // grows while bundles are unpacked, without moving the jobs
+    size_t maxRestores = std::stoul(getEnvOrDefault("MAX_CONCURRENT_RESTORES", "4"));
+    size_t connectionsPerRestore = std::stoul(getEnvOrDefault("RESTORE_CONNECTIONS", "4"));
+    ConnectionBudget budget(std::stoul(getEnvOrDefault("MAX_DB_CONNECTIONS", "16")));
+    fs::path spool = getEnvOrDefault("BUNDLE_SPOOL_FOLDER", "bundle_spool");
+
+    auto startTime = std::chrono::steady_clock::now();
+    size_t nextJob = 0;
+    size_t unpacking = 0;
+    std::mutex dispatchMutex;
+    std::condition_variable jobAdded;
+    auto restoreJobs = [&]() {
+        mysql_thread_init();
+        while (true)
+        {
+            size_t index;
+            size_t connections = 0;
+            {
+                // Claim the next job and its connections together so dumps start in the planned order
+                std::unique_lock<std::mutex> lock(dispatchMutex);
+                jobAdded.wait(lock, [&] { return nextJob < jobs.size() || unpacking == 0; });
+                if (nextJob >= jobs.size())
+                    break;
+                index = nextJob++;
+                if (isBundleJob(jobs[index]))
+                    unpacking++;
+                else
+                    connections = budget.acquire(connectionsPerRestore);
+            }
+            DumpJob &job = jobs[index];
+            auto jobStart = std::chrono::steady_clock::now();
+            if (isBundleJob(job))
+            {
+                cout << "Unpacking bundle: " << job.path << " (" << job.size / (1024 * 1024) << " MB)" << endl;
+                job.restored = unpackBundle(job.path, spool, nullptr, [&](const std::string &entry, const fs::path &spooled) {
+                    DumpJob entryJob;
+                    entryJob.path = job.path;
+                    entryJob.entry = entry;
+                    entryJob.spooled = spooled;
+                    std::error_code error;
+                    entryJob.size = fs::file_size(spooled, error);
+                    std::lock_guard<std::mutex> lock(dispatchMutex);
+                    jobs.push_back(entryJob);
+                    jobAdded.notify_one();
+                });
+                std::lock_guard<std::mutex> lock(dispatchMutex);
+                unpacking--;
+                jobAdded.notify_all();
+                continue;
+            }
+            cout << "Searching in file: " << dumpLabel(job.path, job.entry) << " (" << job.size / (1024 * 1024) << " MB, " << connections << " connections)" << endl;
+            job.restored = searchInGzipFile(job, searchString1, searchString2, connections);
+            job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - jobStart).count();
+            budget.release(connections);
+            if (!job.spooled.empty())
+            {
+                std::error_code error;
+                fs::remove(job.spooled, error);
+            }
+        }
+        mysql_thread_end();
+    };
+
+    // A bundle brings jobs of its own, the threads have to be there for them
+    size_t threadCount = std::max<size_t>(maxRestores, 1);
+    if (std::none_of(jobs.begin(), jobs.end(), isBundleJob))
+        threadCount = std::min(threadCount, jobs.size());
+    vector<thread> threads;
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back(restoreJobs);
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    size_t dumps = 0;
+    size_t failures = 0;
+    for (const auto &job : jobs)
+    {
+        // A bundle is only listed when it could not be unpacked, its dumps are listed on their own
+        if (isBundleJob(job) && job.restored)
+            continue;
+        cout << (job.restored ? "restored " : "failed   ") << dumpLabel(job.path.filename(), job.entry) << " in " << job.seconds << " s" << endl;
+        dumps++;
+        failures += job.restored ? 0 : 1;
+    }
+    cout << "Restored " << dumps - failures << " of " << dumps << " dumps in " << seconds << " s" << endl;
+}
+
+
+volatile std::sig_atomic_t watchStopRequested = 0;
+
+void requestWatchStop(int)
+{
+    watchStopRequested = 1;
+}
+
+// Runs as a daemon: restores the dumps already in the folder, then every dump that finishes
+// uploading into it. On Linux inotify reports a file once it is closed after writing or renamed
+// into the folder; the folder is also rescanned every WATCH_RESCAN_SECONDS, which is all other
+// systems get and which catches anything inotify dropped. A scan only takes a file it found with
+// the same size and modification time the scan before, so a dump still uploading is left alone;
+// while a scan leaves one out the next follows after WATCH_SETTLE_SECONDS. The ledger in LEDGER_FILE keeps a dump
+// from being restored twice, across restarts too. A failed dump is not recorded, so the next
+// rescan tries it again, unless the failure is one a retry cannot fix, such as a site whose tables
+// no longer match the consolidated ones; that dump waits until it is replaced. SIGINT or SIGTERM stop the watch once the running restores finish.
+void watchFolder(const string &folderPath, const string &searchString1, const string &searchString2)
+{
+    size_t maxRestores = std::max<size_t>(std::stoul(getEnvOrDefault("MAX_CONCURRENT_RESTORES", "4")), 1);
+    size_t connectionsPerRestore = std::stoul(getEnvOrDefault("RESTORE_CONNECTIONS", "4"));
+    ConnectionBudget budget(std::stoul(getEnvOrDefault("MAX_DB_CONNECTIONS", "16")));
+    double rescanSeconds = std::stod(getEnvOrDefault("WATCH_RESCAN_SECONDS", "300"));
+    double settleSeconds = std::stod(getEnvOrDefault("WATCH_SETTLE_SECONDS", "10"));
+    DumpLedger ledger(getEnvOrDefault("LEDGER_FILE", "restored_dumps.ledger"));
+    fs::path spool = getEnvOrDefault("BUNDLE_SPOOL_FOLDER", "bundle_spool");
+
+    std::deque<DumpJob> queue;
+    std::set<std::string> pending;   // labels of the dumps queued or being restored, so a dump is never in the queue twice
+    // Size and modification time of the dumps this run restored or found in the ledger,
+    // so a rescan does not hash them again while they stay unchanged. A bundle is done
+    // once all of its dumps are.
+    std::map<std::string, std::pair<uintmax_t, fs::file_time_type>> done;
+    // Bundles whose dumps are still restoring: the parts left, the unpacking counting as one,
+    // whether one failed, and the version of the bundle they came from
+    struct BundleRestore {
+        size_t parts = 1;
+        bool failed = false;
+        std::pair<uintmax_t, fs::file_time_type> version;
+    };
+    std::map<std::string, BundleRestore> bundleRestores;
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    bool stopping = false;
+
+    auto fileVersion = [](const fs::path &path) {
+        std::error_code error;
+        return std::make_pair(fs::file_size(path, error), fs::last_write_time(path, error));
+    };
+    auto enqueueDump = [&](const fs::path &path) {
+        std::string label = dumpLabel(path, "");
+        auto version = fileVersion(path);
+        std::lock_guard<std::mutex> lock(queueMutex);
+        auto it = done.find(label);
+        if (it != done.end() && it->second == version)
+            return;
+        if (pending.insert(label).second)
+        {
+            DumpJob job;
+            job.path = path;
+            queue.push_back(job);
+            queueChanged.notify_one();
+        }
+    };
+    auto enqueue = [&](const fs::path &path) {
+        if (isDumpFile(path) || isDumpBundle(path))
+            enqueueDump(path);
+    };
+    // Called with queueMutex held when a dump of a bundle or its unpacking ends
+    auto finishBundlePart = [&](const std::string &bundleLabel, bool ok) {
+        BundleRestore &bundle = bundleRestores[bundleLabel];
+        bundle.failed = bundle.failed || !ok;
+        if (--bundle.parts > 0)
+            return;
+        pending.erase(bundleLabel);
+        if (!bundle.failed)
+            done[bundleLabel] = bundle.version;
+        bundleRestores.erase(bundleLabel);
+    };
+    // Size and modification time of every file the last scan saw
+    std::map<fs::path, std::pair<uintmax_t, fs::file_time_type>> lastSeen;
+    // Returns whether a file was left out because it changed since the last scan
+    auto rescan = [&]() {
+        std::error_code error;
+        if (!fs::is_directory(folderPath, error))
+        {
+            cerr << "Error: Dump folder " << folderPath << " not found" << endl;
+            return false;
+        }
+        std::map<fs::path, std::pair<uintmax_t, fs::file_time_type>> seen;
+        bool unsettled = false;
+        auto settled = [&](const fs::path &path) {
+            if (!isDumpFile(path) && !isDumpBundle(path))
+                return false;
+            auto version = fileVersion(path);
+            seen[path] = version;
+            auto it = lastSeen.find(path);
+            bool same = it != lastSeen.end() && it->second == version;
+            unsettled = unsettled || !same;
+            return same;
+        };
+        for (const auto &job : collectDumpJobs(folderPath, settled))
+            enqueueDump(job.path);
+        lastSeen = std::move(seen);
+        return unsettled;
+    };
+
+    auto restoreJobs = [&]() {
+        mysql_thread_init();
+        while (true)
+        {
+            DumpJob job;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueChanged.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (stopping)
+                    break;
+                job = queue.front();
+                queue.pop_front();
+            }
+            std::string label = dumpLabel(job.path, job.entry);
+            auto version = fileVersion(job.path);
+            if (isBundleJob(job))
+            {
+                // One pass over the bundle, its dumps join the queue as they come out of it.
+                // Those this run already restored from the same bundle are left in it.
+                {
+                    std::lock_guard<std::mutex> lock(queueMutex);
+                    bundleRestores[label].version = version;
+                }
+                cout << "Unpacking new bundle: " << label << endl;
+                std::string bundleHash = DumpLedger::contentHash(job.path);
+                if (bundleHash.empty())
+                    cerr << "Error: Could not read file " << label << endl;
+                auto wanted = [&](const std::string &entry) {
+                    std::lock_guard<std::mutex> lock(queueMutex);
+                    auto it = done.find(dumpLabel(job.path, entry));
+                    return it == done.end() || it->second != version;
+                };
+                bool unpacked = !bundleHash.empty() && unpackBundle(job.path, spool, wanted, [&](const std::string &entry, const fs::path &spooled) {
+                    DumpJob entryJob;
+                    entryJob.path = job.path;
+                    entryJob.entry = entry;
+                    entryJob.spooled = spooled;
+                    entryJob.bundleHash = bundleHash;
+                    std::lock_guard<std::mutex> lock(queueMutex);
+                    pending.insert(dumpLabel(job.path, entry));
+                    bundleRestores[label].parts++;
+                    queue.push_back(entryJob);
+                    queueChanged.notify_one();
+                });
+                std::lock_guard<std::mutex> lock(queueMutex);
+                finishBundlePart(label, unpacked);
+                continue;
+            }
+            size_t connections = budget.acquire(connectionsPerRestore);
+            cout << "Restoring new dump: " << label << " (" << connections << " connections)" << endl;
+            bool permanent = false;
+            bool restored = searchInGzipFile(job, searchString1, searchString2, connections, &ledger, &permanent);
+            budget.release(connections);
+            cout << (restored ? "restored " : "failed   ") << dumpLabel(job.path.filename(), job.entry) << endl;
+            if (permanent)
+                cerr << "Error: " << label << " is not retried until it changes" << endl;
+            std::error_code error;
+            if (!job.spooled.empty())
+                fs::remove(job.spooled, error);
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                pending.erase(label);
+                if (restored || permanent)
+                    done[label] = version;
+                if (!job.entry.empty())
+                    finishBundlePart(dumpLabel(job.path, ""), restored || permanent);
+            }
+        }
+        mysql_thread_end();
+    };
+
+    std::signal(SIGINT, requestWatchStop);
+    std::signal(SIGTERM, requestWatchStop);
+
+    int watchFd = -1;
+#if defined(__linux__)
+    watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watchFd < 0 || inotify_add_watch(watchFd, folderPath.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        cerr << "Warning: Could not watch " << folderPath << " with inotify, rescanning every " << rescanSeconds << " s instead" << endl;
+        if (watchFd >= 0)
+            close(watchFd);
+        watchFd = -1;
+    }
+#endif
+
+    vector<thread> threads;
+    for (size_t i = 0; i < maxRestores; ++i)
+        threads.emplace_back(restoreJobs);
+
+    cout << "Watching " << folderPath << " for new dumps" << endl;
+    bool unsettled = rescan();
+    auto lastScan = std::chrono::steady_clock::now();
+    while (!watchStopRequested)
+    {
+        bool overflowed = false;
+#if defined(__linux__)
+        if (watchFd >= 0)
+        {
+            // Wake up once a second to notice a stop request
+            struct pollfd pfd = {watchFd, POLLIN, 0};
+            if (poll(&pfd, 1, 1000) > 0)
+            {
+                alignas(struct inotify_event) char events[64 * 1024];
+                ssize_t length;
+                while ((length = read(watchFd, events, sizeof(events))) > 0)
+                {
+                    for (char *p = events; p < events + length;)
+                    {
+                        const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(p);
+                        if (event->mask & IN_Q_OVERFLOW)
+                            overflowed = true;
+                        else if (event->len > 0 && !(event->mask & IN_ISDIR))
+                            enqueue(fs::path(folderPath) / event->name);
+                        p += sizeof(struct inotify_event) + event->len;
+                    }
+                }
+            }
+        }
+        else
+#endif
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        double sinceScan = std::chrono::duration<double>(std::chrono::steady_clock::now() - lastScan).count();
+        if (overflowed || sinceScan >= (unsettled ? std::min(settleSeconds, rescanSeconds) : rescanSeconds))
+        {
+            unsettled = rescan();
+            lastScan = std::chrono::steady_clock::now();
+        }
+    }
+
+    cout << "Stopping the watch of " << folderPath << ", waiting for running restores" << endl;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    for (auto &t : threads)
+        t.join();
+    for (const auto &job : queue)
+    {
+        std::error_code error;
+        if (!job.spooled.empty())
+            fs::remove(job.spooled, error);
+    }
+    if (watchFd >= 0)
+        close(watchFd);
 }
 
 int main()
 {
     loadEnvironmentFromFile("env.txt");
+    // Initialize the client library once before restore threads open connections
+    mysql_library_init(0, NULL, NULL);
     // Path to the folder containing dump files
     const string folderPath = std::getenv("DUMP_FOLDER");
     const string searchString1 = std::getenv("SITENAME");
     const string searchString2 = std::getenv("SITEID");
 
-    searchInFolder(folderPath, searchString1, searchString2);
+    if (getEnvOrDefault("WATCH_DUMP_FOLDER", "false") == "true")
+        watchFolder(folderPath, searchString1, searchString2);
+    else
+        searchInFolder(folderPath, searchString1, searchString2);
 
+    mysql_library_end();
     return 0;
 }
@@ -0,0 +1,733 @@
+// Generates synthetic OpenMRS dumps and measures how fast each restore path handles them.
+// Built from the same source as the restore tool so it measures exactly the code that ships.
+#define main openmrs_dump_restoration_main
+#include "openmrs_dump_restoration.cpp"
+#undef main
+
+#include <random>
+#include <ctime>
+#include <csignal>
+
+const size_t BENCH_STATEMENT_BYTES = 1024 * 1024; // extended INSERT size, mysqldump's default net_buffer_length
+
+// Row counts of the generated dump, obs and encounter dominate real site dumps
+struct GeneratorOptions {
+    size_t persons = 20000;
+    size_t encounters = 100000;
+    size_t obs = 2000000;
+    size_t concepts = 5000;
+    size_t locations = 50;
+    size_t users = 100;
+    std::string siteName = "Bench Clinic";
+    std::string siteId = "9001";
+    int level = 6;
+};
+
+// Column layout of one generated table
+struct BenchColumn {
+    const char* name;
+    const char* type;
+};
+
+struct BenchTable {
+    const char* name;
+    std::vector<BenchColumn> columns;
+    const char* keys;   // everything after the column list, mysqldump style
+};
+
+// A subset of the OpenMRS 2.x schema with its keys and foreign keys
+std::vector<BenchTable> benchmarkSchema() {
+    return {
+        {"location", {{"location_id", "int NOT NULL AUTO_INCREMENT"}, {"name", "varchar(255) NOT NULL DEFAULT ''"},
+                      {"description", "varchar(255) DEFAULT NULL"}, {"city_village", "varchar(255) DEFAULT NULL"},
+                      {"country", "varchar(50) DEFAULT NULL"}, {"creator", "int NOT NULL DEFAULT '0'"},
+                      {"date_created", "datetime NOT NULL"}, {"retired", "tinyint(1) NOT NULL DEFAULT '0'"},
+                      {"uuid", "char(38) NOT NULL"}},
+         "  PRIMARY KEY (`location_id`),\n  UNIQUE KEY `location_uuid_index` (`uuid`),\n  KEY `name_of_location` (`name`)"},
+        {"users", {{"user_id", "int NOT NULL AUTO_INCREMENT"}, {"system_id", "varchar(50) NOT NULL DEFAULT ''"},
+                   {"username", "varchar(50) DEFAULT NULL"}, {"password", "varchar(128) DEFAULT NULL"},
+                   {"salt", "varchar(128) DEFAULT NULL"}, {"creator", "int NOT NULL DEFAULT '0'"},
+                   {"date_created", "datetime NOT NULL"}, {"person_id", "int NOT NULL"},
+                   {"retired", "tinyint(1) NOT NULL DEFAULT '0'"}, {"uuid", "char(38) NOT NULL"}},
+         "  PRIMARY KEY (`user_id`),\n  UNIQUE KEY `users_uuid_index` (`uuid`),\n  KEY `person_id_for_user` (`person_id`)"},
+        {"concept", {{"concept_id", "int NOT NULL AUTO_INCREMENT"}, {"retired", "tinyint(1) NOT NULL DEFAULT '0'"},
+                     {"short_name", "varchar(255) DEFAULT NULL"}, {"description", "text"},
+                     {"datatype_id", "int NOT NULL DEFAULT '0'"}, {"class_id", "int NOT NULL DEFAULT '0'"},
+                     {"is_set", "tinyint(1) NOT NULL DEFAULT '0'"}, {"creator", "int NOT NULL DEFAULT '0'"},
+                     {"date_created", "datetime NOT NULL"}, {"uuid", "char(38) NOT NULL"}},
+         "  PRIMARY KEY (`concept_id`),\n  UNIQUE KEY `concept_uuid_index` (`uuid`),\n  KEY `concept_classes` (`class_id`),\n"
+         "  CONSTRAINT `concept_creator` FOREIGN KEY (`creator`) REFERENCES `users` (`user_id`)"},
+        {"person", {{"person_id", "int NOT NULL AUTO_INCREMENT"}, {"gender", "varchar(50) DEFAULT ''"},
+                    {"birthdate", "date DEFAULT NULL"}, {"birthdate_estimated", "tinyint(1) NOT NULL DEFAULT '0'"},
+                    {"dead", "tinyint(1) NOT NULL DEFAULT '0'"}, {"death_date", "datetime DEFAULT NULL"},
+                    {"creator", "int DEFAULT NULL"}, {"date_created", "datetime NOT NULL"},
+                    {"voided", "tinyint(1) NOT NULL DEFAULT '0'"}, {"uuid", "char(38) NOT NULL"}},
+         "  PRIMARY KEY (`person_id`),\n  UNIQUE KEY `person_uuid_index` (`uuid`),\n  KEY `person_birthdate` (`birthdate`),\n"
+         "  CONSTRAINT `person_creator` FOREIGN KEY (`creator`) REFERENCES `users` (`user_id`)"},
+        {"patient", {{"patient_id", "int NOT NULL"}, {"creator", "int NOT NULL DEFAULT '0'"},
+                     {"date_created", "datetime NOT NULL"}, {"voided", "tinyint(1) NOT NULL DEFAULT '0'"}},
+         "  PRIMARY KEY (`patient_id`),\n  KEY `user_who_created_patient` (`creator`),\n"
+         "  CONSTRAINT `person_id_for_patient` FOREIGN KEY (`patient_id`) REFERENCES `person` (`person_id`) ON UPDATE CASCADE"},
+        {"encounter", {{"encounter_id", "int NOT NULL AUTO_INCREMENT"}, {"encounter_type", "int NOT NULL"},
+                       {"patient_id", "int NOT NULL DEFAULT '0'"}, {"location_id", "int DEFAULT NULL"},
+                       {"form_id", "int DEFAULT NULL"}, {"encounter_datetime", "datetime NOT NULL"},
+                       {"creator", "int NOT NULL DEFAULT '0'"}, {"date_created", "datetime NOT NULL"},
+                       {"voided", "tinyint(1) NOT NULL DEFAULT '0'"}, {"visit_id", "int DEFAULT NULL"},
+                       {"uuid", "char(38) NOT NULL"}},
+         "  PRIMARY KEY (`encounter_id`),\n  UNIQUE KEY `encounter_uuid_index` (`uuid`),\n  KEY `encounter_datetime_idx` (`encounter_datetime`),\n"
+         "  KEY `encounter_patient` (`patient_id`),\n  KEY `encounter_location` (`location_id`),\n"
+         "  CONSTRAINT `encounter_location` FOREIGN KEY (`location_id`) REFERENCES `location` (`location_id`),\n"
+         "  CONSTRAINT `encounter_patient` FOREIGN KEY (`patient_id`) REFERENCES `patient` (`patient_id`) ON UPDATE CASCADE"},
+        {"obs", {{"obs_id", "int NOT NULL AUTO_INCREMENT"}, {"person_id", "int NOT NULL"},
+                 {"concept_id", "int NOT NULL DEFAULT '0'"}, {"encounter_id", "int DEFAULT NULL"},
+                 {"order_id", "int DEFAULT NULL"}, {"obs_datetime", "datetime NOT NULL"},
+                 {"location_id", "int DEFAULT NULL"}, {"obs_group_id", "int DEFAULT NULL"},
+                 {"value_coded", "int DEFAULT NULL"}, {"value_datetime", "datetime DEFAULT NULL"},
+                 {"value_numeric", "double DEFAULT NULL"}, {"value_text", "text"},
+                 {"comments", "varchar(255) DEFAULT NULL"}, {"creator", "int NOT NULL DEFAULT '0'"},
+                 {"date_created", "datetime NOT NULL"}, {"voided", "tinyint(1) NOT NULL DEFAULT '0'"},
+                 {"uuid", "char(38) NOT NULL"}, {"status", "varchar(16) NOT NULL DEFAULT 'FINAL'"}},
+         "  PRIMARY KEY (`obs_id`),\n  UNIQUE KEY `obs_uuid_index` (`uuid`),\n  KEY `obs_concept` (`concept_id`),\n"
+         "  KEY `obs_datetime_idx` (`obs_datetime`),\n  KEY `obs_enc` (`encounter_id`),\n  KEY `patient_obs` (`person_id`),\n"
+         "  CONSTRAINT `encounter_observations` FOREIGN KEY (`encounter_id`) REFERENCES `encounter` (`encounter_id`),\n"
+         "  CONSTRAINT `obs_concept` FOREIGN KEY (`concept_id`) REFERENCES `concept` (`concept_id`),\n"
+         "  CONSTRAINT `person_obs` FOREIGN KEY (`person_id`) REFERENCES `person` (`person_id`) ON UPDATE CASCADE"},
+        {"global_property", {{"property", "varchar(255) NOT NULL DEFAULT ''"}, {"property_value", "text"},
+                             {"description", "text"}, {"uuid", "char(38) NOT NULL"}},
+         "  PRIMARY KEY (`property`),\n  UNIQUE KEY `global_property_uuid_index` (`uuid`)"},
+    };
+}
+
+// Writes the values of generated rows in mysqldump's text format
+class BenchRowWriter {
+public:
+    explicit BenchRowWriter(uint64_t seed) : random(seed) {}
+
+    std::string row;
+
+    void begin() {
+        row = "(";
+    }
+
+    void end() {
+        row.back() = ')';
+    }
+
+    void number(uint64_t value) {
+        row += std::to_string(value);
+        row += ',';
+    }
+
+    void maybeNumber(uint64_t limit, int nullPercent) {
+        if (chance(nullPercent)) {
+            null();
+        } else {
+            number(1 + random() % limit);
+        }
+    }
+
+    void decimal() {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.2f,", (random() % 100000) / 100.0);
+        row += text;
+    }
+
+    void null() {
+        row += "NULL,";
+    }
+
+    void text(const std::string& value) {
+        row += '\'';
+        for (char c : value) {
+            if (c == '\'' || c == '\\') {
+                row += '\\';
+                row += c;
+            } else if (c == '\n') {
+                row += "\\n";
+            } else {
+                row += c;
+            }
+        }
+        row += "',";
+    }
+
+    void datetime() {
+        char text[32];
+        uint64_t r = random();
+        std::snprintf(text, sizeof(text), "'%04d-%02d-%02d %02d:%02d:%02d',", 2010 + static_cast<int>(r % 14), 1 + static_cast<int>((r >> 8) % 12),
+                      1 + static_cast<int>((r >> 16) % 28), static_cast<int>((r >> 24) % 24), static_cast<int>((r >> 32) % 60),
+                      static_cast<int>((r >> 40) % 60));
+        row += text;
+    }
+
+    void date() {
+        char text[16];
+        uint64_t r = random();
+        std::snprintf(text, sizeof(text), "'%04d-%02d-%02d',", 1940 + static_cast<int>(r % 80), 1 + static_cast<int>((r >> 8) % 12),
+                      1 + static_cast<int>((r >> 16) % 28));
+        row += text;
+    }
+
+    void uuid() {
+        static const char hex[] = "0123456789abcdef";
+        char text[40];
+        uint64_t a = random();
+        uint64_t b = random();
+        int pos = 0;
+        text[pos++] = '\'';
+        for (int i = 0; i < 32; ++i) {
+            if (i == 8 || i == 12 || i == 16 || i == 20) {
+                text[pos++] = '-';
+            }
+            uint64_t& bits = i < 16 ? a : b;
+            text[pos++] = hex[bits & 15];
+            bits >>= 4;
+        }
+        text[pos++] = '\'';
+        text[pos++] = ',';
+        row.append(text, pos);
+    }
+
+    // Free text as clinicians type it: words, quotes, newlines and the odd semicolon
+    void clinicalText() {
+        static const char* words[] = {"patient", "reports", "pain", "fever", "cough", "on", "ART", "since", "2019;", "review",
+                                      "in", "2 weeks", "CD4", "count", "normal", "O'Brien", "referred", "to", "clinic", "\n"};
+        std::string value;
+        size_t count = 3 + random() % 12;
+        for (size_t i = 0; i < count; ++i) {
+            if (i > 0) {
+                value += ' ';
+            }
+            value += words[random() % (sizeof(words) / sizeof(words[0]))];
+        }
+        text(value);
+    }
+
+    bool chance(int percent) {
+        return static_cast<int>(random() % 100) < percent;
+    }
+
+    uint64_t next() {
+        return random();
+    }
+
+private:
+    std::mt19937_64 random;
+};
+
+// Writes one table in mysqldump's layout, calling fillRow(writer, id) for ids 1..rows
+template <typename FillRow>
+bool writeBenchTable(gzFile out, const BenchTable& table, size_t rows, FillRow fillRow) {
+    std::string text = "--\n-- Table structure for table `" + std::string(table.name) + "`\n--\n\n";
+    text += "DROP TABLE IF EXISTS `" + std::string(table.name) + "`;\n";
+    text += "/*!40101 SET @saved_cs_client     = @@character_set_client */;\n/*!50503 SET character_set_client = utf8mb4 */;\n";
+    text += "CREATE TABLE `" + std::string(table.name) + "` (\n";
+    for (const auto& column : table.columns) {
+        text += "  `" + std::string(column.name) + "` " + column.type + ",\n";
+    }
+    // mysqldump writes the next value of the counter, so it changes with every row a site adds
+    bool counted = rows > 0 && std::strstr(table.columns.front().type, "AUTO_INCREMENT") != nullptr;
+    text += std::string(table.keys) + "\n) ENGINE=InnoDB" + (counted ? " AUTO_INCREMENT=" + std::to_string(rows + 1) : "") +
+            " DEFAULT CHARSET=utf8mb3;\n";
+    text += "/*!40101 SET character_set_client = @saved_cs_client */;\n\n";
+    text += "--\n-- Dumping data for table `" + std::string(table.name) + "`\n--\n\n";
+    text += "LOCK TABLES `" + std::string(table.name) + "` WRITE;\n/*!40000 ALTER TABLE `" + std::string(table.name) + "` DISABLE KEYS */;\n";
+
+    BenchRowWriter writer(std::hash<std::string>()(table.name));
+    std::string statement;
+    std::string prefix = "INSERT INTO `" + std::string(table.name) + "` VALUES ";
+    for (size_t id = 1; id <= rows; ++id) {
+        writer.begin();
+        fillRow(writer, id);
+        writer.end();
+        if (!statement.empty() && statement.size() + writer.row.size() + 2 > BENCH_STATEMENT_BYTES) {
+            text += statement + ";\n";
+            statement.clear();
+        }
+        statement += statement.empty() ? prefix : ",";
+        statement += writer.row;
+        if (text.size() >= BENCH_STATEMENT_BYTES) {
+            if (gzwrite(out, text.data(), static_cast<unsigned>(text.size())) != static_cast<int>(text.size())) {
+                return false;
+            }
+            text.clear();
+        }
+    }
+    if (!statement.empty()) {
+        text += statement + ";\n";
+    }
+    text += "/*!40000 ALTER TABLE `" + std::string(table.name) + "` ENABLE KEYS */;\nUNLOCK TABLES;\n\n";
+    return gzwrite(out, text.data(), static_cast<unsigned>(text.size())) == static_cast<int>(text.size());
+}
+
+// Function to generate a mysqldump formatted, gzip compressed OpenMRS site dump
+bool generateBenchmarkDump(const std::string& filename, const GeneratorOptions& options) {
+    gzFile out = gzopen(filename.c_str(), ("wb" + std::to_string(options.level)).c_str());
+    if (out == NULL) {
+        std::cerr << "Error: Could not create " << filename << std::endl;
+        return false;
+    }
+    std::string header =
+        "-- MySQL dump 10.13  Distrib 8.0.36, for Linux (x86_64)\n--\n-- Host: localhost    Database: openmrs\n"
+        "-- ------------------------------------------------------\n-- Server version\t8.0.36\n\n"
+        "/*!40101 SET @OLD_CHARACTER_SET_CLIENT=@@CHARACTER_SET_CLIENT */;\n/*!40101 SET @OLD_CHARACTER_SET_RESULTS=@@CHARACTER_SET_RESULTS */;\n"
+        "/*!50503 SET NAMES utf8mb4 */;\n/*!40103 SET @OLD_TIME_ZONE=@@TIME_ZONE */;\n/*!40103 SET TIME_ZONE='+00:00' */;\n"
+        "/*!40014 SET @OLD_UNIQUE_CHECKS=@@UNIQUE_CHECKS, UNIQUE_CHECKS=0 */;\n"
+        "/*!40014 SET @OLD_FOREIGN_KEY_CHECKS=@@FOREIGN_KEY_CHECKS, FOREIGN_KEY_CHECKS=0 */;\n"
+        "/*!40101 SET @OLD_SQL_MODE=@@SQL_MODE, SQL_MODE='NO_AUTO_VALUE_ON_ZERO' */;\n\n";
+    bool ok = gzwrite(out, header.data(), static_cast<unsigned>(header.size())) == static_cast<int>(header.size());
+
+    std::vector<BenchTable> schema = benchmarkSchema();
+    const GeneratorOptions& o = options;
+    ok = ok && writeBenchTable(out, schema[0], o.locations, [&](BenchRowWriter& w, size_t id) {
+        w.number(id); w.text("Site " + std::to_string(id)); w.null(); w.text("Lilongwe"); w.text("Malawi");
+        w.number(1); w.datetime(); w.number(0); w.uuid();
+    });
+    ok = ok && writeBenchTable(out, schema[1], o.users, [&](BenchRowWriter& w, size_t id) {
+        w.number(id); w.text(std::to_string(id) + "-" + std::to_string(id % 10)); w.text("user" + std::to_string(id));
+        w.text(std::string(128, 'a' + id % 26)); w.text(std::string(128, 'b' + id % 24)); w.number(1); w.datetime();
+        w.number(1 + id % std::max<size_t>(o.persons, 1)); w.number(0); w.uuid();
+    });
+    ok = ok && writeBenchTable(out, schema[2], o.concepts, [&](BenchRowWriter& w, size_t id) {
+        w.number(id); w.number(w.chance(5) ? 1 : 0); w.text("C" + std::to_string(id)); w.clinicalText();
+        w.maybeNumber(12, 0); w.maybeNumber(20, 0); w.number(w.chance(10) ? 1 : 0); w.maybeNumber(o.users, 0);
+        w.datetime(); w.uuid();
+    });
+    ok = ok && writeBenchTable(out, schema[3], o.persons, [&](BenchRowWriter& w, size_t id) {
+        w.number(id); w.text(w.chance(50) ? "F" : "M"); w.date(); w.number(0); w.number(w.chance(3) ? 1 : 0);
+        w.null(); w.maybeNumber(o.users, 0); w.datetime(); w.number(0); w.uuid();
+    });
+    ok = ok && writeBenchTable(out, schema[4], o.persons, [&](BenchRowWriter& w, size_t id) {
+        w.number(id); w.maybeNumber(o.users, 0); w.datetime(); w.number(0);
+    });
+    ok = ok && writeBenchTable(out, schema[5], o.encounters, [&](BenchRowWriter& w, size_t id) {
+        w.number(id); w.maybeNumber(40, 0); w.maybeNumber(std::max<size_t>(o.persons, 1), 0); w.maybeNumber(o.locations, 2);
+        w.maybeNumber(60, 20); w.datetime(); w.maybeNumber(o.users, 0); w.datetime(); w.number(w.chance(2) ? 1 : 0);
+        w.maybeNumber(id, 30); w.uuid();
+    });
+    ok = ok && writeBenchTable(out, schema[6], o.obs, [&](BenchRowWriter& w, size_t id) {
+        // Most observations are coded or numeric answers, a few are free text
+        int kind = static_cast<int>(w.next() % 100);
+        w.number(id); w.maybeNumber(std::max<size_t>(o.persons, 1), 0); w.maybeNumber(o.concepts, 0);
+        w.maybeNumber(std::max<size_t>(o.encounters, 1), 3); w.null(); w.datetime(); w.maybeNumber(o.locations, 2);
+        w.maybeNumber(id, 85);
+        if (kind < 55) { w.maybeNumber(o.concepts, 0); } else { w.null(); }
+        if (kind >= 55 && kind < 60) { w.datetime(); } else { w.null(); }
+        if (kind >= 60 && kind < 90) { w.decimal(); } else { w.null(); }
+        if (kind >= 90) { w.clinicalText(); } else { w.null(); }
+        w.null(); w.maybeNumber(o.users, 0); w.datetime(); w.number(w.chance(2) ? 1 : 0); w.uuid(); w.text("FINAL");
+    });
+
+    std::vector<std::pair<std::string, std::string>> properties = {
+        {"application.name", "OpenMRS"}, {"current_health_center_id", o.siteId}, {"current_health_center_name", o.siteName},
+        {"default_locale", "en_GB"}, {"visits.enabled", "true"}};
+    ok = ok && writeBenchTable(out, schema[7], properties.size(), [&](BenchRowWriter& w, size_t id) {
+        w.text(properties[id - 1].first); w.text(properties[id - 1].second); w.text("id"); w.uuid();
+    });
+
+    std::string footer =
+        "/*!40103 SET TIME_ZONE=@OLD_TIME_ZONE */;\n\n/*!40101 SET SQL_MODE=@OLD_SQL_MODE */;\n"
+        "/*!40014 SET FOREIGN_KEY_CHECKS=@OLD_FOREIGN_KEY_CHECKS */;\n/*!40014 SET UNIQUE_CHECKS=@OLD_UNIQUE_CHECKS */;\n"
+        "/*!40101 SET CHARACTER_SET_CLIENT=@OLD_CHARACTER_SET_CLIENT */;\n/*!40101 SET CHARACTER_SET_RESULTS=@OLD_CHARACTER_SET_RESULTS */;\n\n"
+        "-- Dump completed\n";
+    ok = ok && gzwrite(out, footer.data(), static_cast<unsigned>(footer.size())) == static_cast<int>(footer.size());
+    ok = gzclose(out) == Z_OK && ok;
+    if (!ok) {
+        std::cerr << "Error: Failed to write " << filename << std::endl;
+    }
+    return ok;
+}
+
+// One measured run of a stage or restore path
+struct BenchResult {
+    std::string stage;
+    std::string path;
+    bool ok = true;
+    uint64_t bytes = 0;
+    uint64_t rows = 0;
+    uint64_t statements = 0;
+    double seconds = 0;
+};
+
+// Appends the result as one JSON object per line, so runs can be compared over time
+void writeBenchResult(std::ofstream& out, const std::string& dump, const BenchResult& result) {
+    char timestamp[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    double megabytes = result.bytes / (1024.0 * 1024.0);
+    out << "{\"time\":\"" << timestamp << "\",\"dump\":\"" << dump << "\",\"stage\":\"" << result.stage
+        << "\",\"path\":\"" << result.path << "\",\"ok\":" << (result.ok ? "true" : "false")
+        << ",\"bytes\":" << result.bytes << ",\"rows\":" << result.rows << ",\"statements\":" << result.statements
+        << ",\"seconds\":" << result.seconds << ",\"mb_per_s\":" << (result.seconds > 0 ? megabytes / result.seconds : 0)
+        << ",\"rows_per_s\":" << (result.seconds > 0 ? result.rows / result.seconds : 0) << "}" << std::endl;
+
+    std::cout << result.stage << " " << result.path << ": " << (result.ok ? "" : "FAILED ") << megabytes << " MB in "
+              << result.seconds << " s (" << (result.seconds > 0 ? megabytes / result.seconds : 0) << " MB/s, "
+              << (result.seconds > 0 ? result.rows / result.seconds : 0) << " rows/s)" << std::endl;
+}
+
+// Decompression alone, through the same reader the restore uses
+BenchResult benchmarkDecompress(const std::string& filename) {
+    BenchResult result{"decompress", "reader"};
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<DumpReader> dump = openDumpReader(filename);
+    std::vector<char> buffer(BUFFER_SIZE);
+    long bytesRead = -1;
+    while (dump && (bytesRead = dump->read(buffer.data(), BUFFER_SIZE)) > 0) {
+        result.bytes += bytesRead;
+    }
+    result.ok = dump && bytesRead == 0;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// Statement splitting and classification, timed without the decompression feeding it.
+// Rows are counted on the way and their cost is taken out of the timing.
+BenchResult benchmarkTokenize(const std::string& filename) {
+    BenchResult result{"tokenize", "splitter"};
+    std::unique_ptr<DumpReader> dump = openDumpReader(filename);
+    if (!dump) {
+        result.ok = false;
+        return result;
+    }
+    SqlStatementSplitter reader;
+    double countingSeconds = 0;
+    auto onStatement = [&](std::string_view sql, bool insideDelimiter) {
+        DumpStatement statement = classifyStatement(sql, insideDelimiter);
+        result.statements++;
+        auto countStart = std::chrono::steady_clock::now();
+        InsertStatementParts parts;
+        if (statement.kind == StatementKind::Table && splitInsertStatement(sql, parts)) {
+            forEachInsertRow(parts.values, SIZE_MAX, [&](std::string_view, std::string_view) {
+                result.rows++;
+                return true;
+            });
+        }
+        countingSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - countStart).count();
+        return true;
+    };
+
+    std::vector<char> buffer(BUFFER_SIZE);
+    long bytesRead;
+    while ((bytesRead = dump->read(buffer.data(), BUFFER_SIZE)) > 0) {
+        auto start = std::chrono::steady_clock::now();
+        result.ok = reader.feed(buffer.data(), bytesRead, onStatement) && result.ok;
+        result.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.bytes += bytesRead;
+    }
+    result.ok = result.ok && bytesRead == 0 && reader.finish();
+    result.seconds -= countingSeconds;
+    return result;
+}
+
+// Drops and creates the benchmark database so every path starts from the same state
+bool resetBenchmarkDatabase(const std::string& db_name) {
+    MYSQL* conn = mysql_init(NULL);
+    if (!mysql_real_connect(conn, getEnvOrDefault("DB_HOST", "127.0.0.1").c_str(), getEnvOrDefault("DB_USER", "root").c_str(),
+                            getEnvOrDefault("DB_PASSWORD", "").c_str(), NULL, std::stoi(getEnvOrDefault("DB_PORT", "3306")), NULL, 0)) {
+        std::cerr << "Failed to connect to MySQL server: " << mysql_error(conn) << std::endl;
+        mysql_close(conn);
+        return false;
+    }
+    bool ok = mysql_query(conn, ("DROP DATABASE IF EXISTS " + db_name).c_str()) == 0 &&
+              mysql_query(conn, ("CREATE DATABASE " + db_name).c_str()) == 0;
+    if (!ok) {
+        std::cerr << "Failed to reset database " << db_name << ": " << mysql_error(conn) << std::endl;
+    }
+    mysql_close(conn);
+    return ok;
+}
+
+// Restores the dump through one of the restore paths into a fresh database
+BenchResult benchmarkLoad(const std::string& filename, const std::string& path, const BenchResult& tokenized, size_t connections) {
+    BenchResult result{"load", path};
+    result.bytes = tokenized.bytes;
+    result.rows = tokenized.rows;
+    result.statements = tokenized.statements;
+
+    // The in-process paths name the database after the site identity in the dump
+    std::unique_ptr<DumpReader> dump = openDumpReader(filename);
+    SiteIdentity identity;
+    std::string prefix;
+    std::FILE* spill = nullptr;
+    bool prefixComplete = true;
+    if (!dump || !detectSiteIdentity(*dump, getEnvOrDefault("SITENAME", "current_health_center_name"),
+                                     getEnvOrDefault("SITEID", "current_health_center_id"), identity, prefix, spill, prefixComplete)) {
+        std::cerr << "Error: No site identity found in " << filename << std::endl;
+        result.ok = false;
+        return result;
+    }
+    if (!prefixComplete) {
+        prefix.clear();
+        dump->rewind();
+    }
+    // The null, split and columnar sinks never reach the server
+    bool toServer = sinkLoadsServer(path);
+    std::string db_name = identity.database();
+    if (toServer && !resetBenchmarkDatabase(db_name)) {
+        result.ok = false;
+        return result;
+    }
+
+    std::string host = getEnvOrDefault("DB_HOST", "127.0.0.1");
+    std::string user = getEnvOrDefault("DB_USER", "root");
+    std::string password = getEnvOrDefault("DB_PASSWORD", "");
+    unsigned int port = std::stoi(getEnvOrDefault("DB_PORT", "3306"));
+    PrefixedDumpReader stream(std::move(prefix), *dump, spill);
+    auto start = std::chrono::steady_clock::now();
+    if (path == "parallel" || path == "shell" || !toServer) {
+        setenv("RESTORE_MODE", path == "shell" ? "shell" : "parallel", 1);
+        setenv("RESTORE_SINK", toServer ? "mysql" : path.c_str(), 1);
+        result.ok = restoreSiteDump(filename, identity, stream, connections);
+    } else if (path == "legacy") {
+        result.ok = restoreMySQLDump(filename.c_str(), host.c_str(), user.c_str(), password.c_str(), db_name.c_str(), port);
+    } else if (path == "legacyB") {
+        result.ok = restoreMySQLDumpB(filename, host, user, password, db_name, port);
+    } else if (path == "legacyC") {
+        result.ok = restoreMySQLDumpC(filename.c_str(), host.c_str(), user.c_str(), password.c_str(), db_name.c_str(), port);
+    } else {
+        std::cerr << "Error: Unknown restore path " << path << std::endl;
+        result.ok = false;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// Micro-benchmarks of the statement splitter on the first megabytes of a dump, with each scan
+// kernel it can use. rows holds the bytes of the statements found.
+std::vector<BenchResult> benchmarkScanners(const std::string& filename, size_t megabytes) {
+    std::vector<BenchResult> results;
+    std::unique_ptr<DumpReader> dump = openDumpReader(filename);
+    if (!dump) {
+        return results;
+    }
+    // 1 MB buffers, as the reader hands them out
+    std::vector<std::string> chunks;
+    size_t total = 0;
+    std::vector<char> buffer(BUFFER_SIZE);
+    long bytesRead;
+    while (total < megabytes * 1024 * 1024 && (bytesRead = dump->read(buffer.data(), BUFFER_SIZE)) > 0) {
+        chunks.emplace_back(buffer.data(), bytesRead);
+        total += bytesRead;
+    }
+
+    auto timed = [&](const std::string& stage, const std::string& path, auto&& body) {
+        BenchResult result{stage, path};
+        result.bytes = total;
+        auto start = std::chrono::steady_clock::now();
+        body(result);
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        results.push_back(result);
+    };
+
+    // The statement splitter with each kernel it uses, the statement sizes have to add up the same
+    for (ScanKernel kernel : {ScanKernel::Scalar, ScanKernel::Sse2}) {
+        if (kernel > scanKernel()) {
+            continue;
+        }
+        setenv("SCAN_KERNEL", scanKernelName(kernel), 1);
+        timed("scan_splitter", scanKernelName(kernel), [&](BenchResult& result) {
+            SqlStatementSplitter splitter;
+            for (const auto& chunk : chunks) {
+                splitter.feed(chunk.data(), chunk.size(), [&](std::string_view sql, bool) {
+                    result.statements++;
+                    result.rows += sql.size();
+                    return true;
+                });
+            }
+        });
+        unsetenv("SCAN_KERNEL");
+    }
+
+    // Where the buffers end must not change what the splitter hands out. The dump is fed in pieces
+    // of several sizes and compared with splitting it as one buffer, the edge cases below are fed
+    // in pieces of every size and compared with the statements they have to give.
+    const std::string edges =
+        "SELECT 1;\n-- comment\n-SELECT 2;\n"
+        "DELIMITER //\nCREATE PROCEDURE p() BEGIN /* a // b */ SELECT 3; END//\nDELIMITER ;\n"
+        "DELIMITER -|\nSELECT 4 -- not -| the end\n-|\nDELIMITER ;\nSELECT '5;--';\n";
+    const std::vector<std::pair<std::string, bool>> expected = {
+        {"SELECT 1", false},
+        {"-SELECT 2", false},
+        {"CREATE PROCEDURE p() BEGIN /* a // b */ SELECT 3; END", true},
+        {"SELECT 4 -- not -| the end\n", true},
+        {"SELECT '5;--'", false},
+    };
+    auto split = [](const char* data, size_t size, size_t piece, auto&& onStatement) {
+        SqlStatementSplitter splitter;
+        for (size_t pos = 0; pos < size; pos += piece) {
+            splitter.feed(data + pos, std::min(piece, size - pos), [&](std::string_view sql, bool insideDelimiter) {
+                onStatement(sql, insideDelimiter);
+                return true;
+            });
+        }
+        return splitter.finish();
+    };
+    timed("scan_splitter_pieces", "check", [&](BenchResult& result) {
+        for (size_t piece = 1; piece <= edges.size(); ++piece) {
+            std::vector<std::pair<std::string, bool>> statements;
+            bool finished = split(edges.data(), edges.size(), piece, [&](std::string_view sql, bool insideDelimiter) {
+                statements.emplace_back(std::string(sql), insideDelimiter);
+            });
+            if (!finished || statements != expected) {
+                std::cerr << "Error: The edge cases split differently in pieces of " << piece << " bytes" << std::endl;
+                result.ok = false;
+            }
+        }
+
+        // Feeding one byte at a time is slow, 8 MB of the dump are enough to cross every kind of boundary
+        std::string text;
+        for (const auto& chunk : chunks) {
+            text += chunk;
+        }
+        text.resize(std::min<size_t>(text.size(), 8 * 1024 * 1024));
+        text.resize(text.rfind(";\n") == std::string::npos ? 0 : text.rfind(";\n") + 2);
+        result.bytes = text.size();
+        auto fingerprint = [&](size_t piece, size_t& count) {
+            uint64_t hash = 1469598103934665603ULL;
+            split(text.data(), text.size(), piece, [&](std::string_view sql, bool insideDelimiter) {
+                hash = (hash ^ hashBytes(sql) ^ insideDelimiter) * 1099511628211ULL;
+                count++;
+            });
+            return hash;
+        };
+        size_t wholeCount = 0;
+        uint64_t whole = fingerprint(text.size(), wholeCount);
+        for (size_t piece : {1, 2, 3, 7, 61, 4093, 65536}) {
+            size_t count = 0;
+            if (fingerprint(piece, count) != whole || count != wholeCount) {
+                std::cerr << "Error: The dump split differently in pieces of " << piece << " bytes" << std::endl;
+                result.ok = false;
+            }
+        }
+        result.statements = wholeCount;
+    });
+    return results;
+}
+
+// Restores successive dumps of one site, as it uploads them over the weeks: the same schema with
+// more rows, so every CREATE TABLE carries another AUTO_INCREMENT=. Each snapshot is loaded once
+// running the DDL in the dump and once from a schema template. The first snapshot only saves the
+// template, the later ones should match it and leave their DDL out.
+bool benchmarkSchemaTemplates(const std::string& prefix, GeneratorOptions generator, size_t snapshots, size_t connections, std::ofstream& out) {
+    std::string folder = prefix + "_templates";
+    setenv("SCHEMA_TEMPLATE_FOLDER", folder.c_str(), 1);
+    bool ok = true;
+    for (size_t snapshot = 1; snapshot <= snapshots && ok; ++snapshot) {
+        std::string filename = prefix + "-" + std::to_string(snapshot) + ".sql.gz";
+        if (!generateBenchmarkDump(filename, generator)) {
+            return false;
+        }
+        BenchResult tokenized = benchmarkTokenize(filename);
+        for (const char* path : {"ddl", "template"}) {
+            setenv("SCHEMA_TEMPLATES", std::string(path) == "template" ? "true" : "false", 1);
+            BenchResult loaded = benchmarkLoad(filename, "parallel", tokenized, connections);
+            loaded.path = path;
+            writeBenchResult(out, filename, loaded);
+            ok = ok && loaded.ok;
+        }
+        // About two percent more of everything, a few weeks of a busy clinic
+        generator.obs += generator.obs / 50 + 1;
+        generator.encounters += generator.encounters / 50 + 1;
+        generator.persons += generator.persons / 50 + 1;
+        generator.users++;
+    }
+    return ok;
+}
+
+// Splits "a,b,c" style command line values
+std::vector<std::string> benchmarkList(const std::string& value) {
+    std::vector<std::string> items;
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+int main(int argc, char* argv[])
+{
+    loadEnvironmentFromFile("env.txt");
+    std::string command = argc > 1 ? argv[1] : "";
+    if (argc < 3 || (command != "generate" && command != "run" && command != "scan" && command != "templates")) {
+        std::cerr << "Usage: " << argv[0] << " generate <dump.sql.gz> [obs=N] [encounter=N] [person=N] [concept=N] [level=N]\n"
+                  << "       " << argv[0] << " run <dump.sql.gz> [paths=null,split,columnar,parallel,shell,legacy,legacyB,legacyC] [output=benchmark_results.jsonl] [connections=N]\n"
+                  << "       " << argv[0] << " scan <dump.sql.gz> [mb=64] [output=benchmark_results.jsonl]\n"
+                  << "       " << argv[0] << " templates <prefix> [snapshots=3] [obs=N] [encounter=N] [person=N] [output=benchmark_results.jsonl] [connections=N]" << std::endl;
+        return 1;
+    }
+
+    std::unordered_map<std::string, std::string> options;
+    for (int i = 3; i < argc; ++i) {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        if (equals != std::string::npos) {
+            options[argument.substr(0, equals)] = argument.substr(equals + 1);
+        }
+    }
+    auto option = [&](const std::string& name, const std::string& fallback) {
+        auto it = options.find(name);
+        return it == options.end() ? fallback : it->second;
+    };
+
+    std::string filename = argv[2];
+    GeneratorOptions generator;
+    generator.obs = std::stoul(option("obs", std::to_string(generator.obs)));
+    generator.encounters = std::stoul(option("encounter", std::to_string(generator.encounters)));
+    generator.persons = std::stoul(option("person", std::to_string(generator.persons)));
+    generator.concepts = std::stoul(option("concept", std::to_string(generator.concepts)));
+    generator.level = std::stoi(option("level", std::to_string(generator.level)));
+    if (command == "generate") {
+        auto start = std::chrono::steady_clock::now();
+        if (!generateBenchmarkDump(filename, generator)) {
+            return 1;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Generated " << filename << " (" << fs::file_size(filename) / (1024.0 * 1024.0) << " MB compressed) in " << seconds << " s" << std::endl;
+        return 0;
+    }
+
+    // A restore path whose mysql client dies should be reported as failed, not end the run
+    std::signal(SIGPIPE, SIG_IGN);
+    std::ofstream out(option("output", "benchmark_results.jsonl"), std::ios::app);
+    if (command == "scan") {
+        std::vector<BenchResult> results = benchmarkScanners(filename, std::stoul(option("mb", "64")));
+        bool ok = !results.empty();
+        for (const auto& result : results) {
+            writeBenchResult(out, filename, result);
+            ok = ok && result.ok;
+        }
+        return ok ? 0 : 1;
+    }
+
+    mysql_library_init(0, NULL, NULL);
+    // The in-process paths read the connection from the environment, the legacy ones get it passed
+    setenv("DB_HOST", getEnvOrDefault("DB_HOST", "127.0.0.1").c_str(), 1);
+    setenv("DB_USER", getEnvOrDefault("DB_USER", "root").c_str(), 1);
+    setenv("DB_PASSWORD", getEnvOrDefault("DB_PASSWORD", "").c_str(), 1);
+    setenv("DB_PORT", getEnvOrDefault("DB_PORT", "3306").c_str(), 1);
+    size_t connections = std::stoul(option("connections", getEnvOrDefault("RESTORE_CONNECTIONS", "4")));
+    if (command == "templates") {
+        bool ok = benchmarkSchemaTemplates(filename, generator, std::stoul(option("snapshots", "3")), connections, out);
+        mysql_library_end();
+        return ok ? 0 : 1;
+    }
+
+    BenchResult decompressed = benchmarkDecompress(filename);
+    writeBenchResult(out, filename, decompressed);
+    BenchResult tokenized = benchmarkTokenize(filename);
+    writeBenchResult(out, filename, tokenized);
+
+    bool ok = decompressed.ok && tokenized.ok;
+    for (const auto& path : benchmarkList(option("paths", "parallel"))) {
+        BenchResult loaded = benchmarkLoad(filename, path, tokenized, connections);
+        writeBenchResult(out, filename, loaded);
+        ok = ok && loaded.ok;
+    }
+
+    mysql_library_end();
+    return ok ? 0 : 1;
+}